@@ -1,6 +1,7 @@
 #include "profiler.h"
 #include "../../gui/gui.h"
 #include "../../kernel/kernel.h"
+#include "../../kernel/kmemprof.h"
 
 static profiler_t* profiler = NULL;
 
@@ -39,6 +40,9 @@ void create_profiler_window(void) {
     create_function_list();
     create_statistics_panel();
     create_timeline_view();
+#ifdef CONFIG_KMEMPROF
+    create_heap_view();
+#endif
 }
 
 void create_flame_graph_view(void) {
@@ -327,6 +331,76 @@ void draw_timeline(void) {
     draw_timeline_labels(buffer, start_time, end_time);
 }
 
+#ifdef CONFIG_KMEMPROF
+#define HEAP_VIEW_SITES      32
+#define HEAP_VIEW_REFRESH_MS 1000
+
+// Kernel heap by call site, read from the kernel's heap profiler
+void create_heap_view(void) {
+    profiler->heap_list.x = 0;
+    profiler->heap_list.y = TOOLBAR_HEIGHT + 600;
+    profiler->heap_list.width = 1200;
+    profiler->heap_list.height = 200 - TOOLBAR_HEIGHT;
+    
+    profiler->heap_table = create_table_view(profiler->heap_list.x,
+                                           profiler->heap_list.y,
+                                           profiler->heap_list.width,
+                                           profiler->heap_list.height);
+    
+    add_table_column(profiler->heap_table, "Call site", 400);
+    add_table_column(profiler->heap_table, "Allocs", 120);
+    add_table_column(profiler->heap_table, "Live", 120);
+    add_table_column(profiler->heap_table, "Total", 120);
+    add_table_column(profiler->heap_table, "Long-lived", 120);
+    add_table_column(profiler->heap_table, "Oldest", 100);
+    
+    profiler->heap_refreshed = 0;
+}
+
+void update_heap_view(void) {
+    uint64_t now = get_system_time();
+    if(profiler->heap_refreshed && now - profiler->heap_refreshed < HEAP_VIEW_REFRESH_MS) return;
+    profiler->heap_refreshed = now;
+    
+    kmemprof_site_t sites[HEAP_VIEW_SITES];
+    uint32_t count = kmemprof_get_sites(sites, HEAP_VIEW_SITES, NULL);
+    
+    clear_table(profiler->heap_table);
+    
+    for(uint32_t i = 0; i < count; i++) {
+        kmemprof_site_t* site = &sites[i];
+        
+        char name[128], allocs[16], live[16], total[16], long_lived[16], oldest[16];
+        symbol_info_t* symbol = site->caller ? find_symbol_by_address(site->caller) : NULL;
+        if(symbol) {
+            strncpy(name, symbol->name, 127);
+            name[127] = '\0';
+        } else if(site->caller) {
+            snprintf(name, 128, "0x%lx", site->caller);
+        } else {
+            strcpy(name, "(other)");
+        }
+        
+        snprintf(allocs, 16, "%lu", site->allocs);
+        snprintf(live, 16, "%luK", site->live_bytes / 1024);
+        snprintf(total, 16, "%luK", site->bytes / 1024);
+        snprintf(long_lived, 16, "%lu", site->long_lived);
+        snprintf(oldest, 16, "%lus", site->oldest_ms / 1000);
+        
+        const char* row_data[] = {
+            name,
+            allocs,
+            live,
+            total,
+            long_lived,
+            oldest
+        };
+        
+        add_table_row(profiler->heap_table, row_data);
+    }
+}
+#endif
+
 int stop_profiling(void) {
     if(profiler->state != PROFILER_RUNNING) return -1;
     
@@ -354,6 +428,9 @@ int run_profiler_loop(void) {
         }
         
         update_profiler_display();
+#ifdef CONFIG_KMEMPROF
+        update_heap_view();
+#endif
         
         process_yield();
     }
@@ -2,6 +2,9 @@
 #include "../kernel/kernel.h"
 #include "../fs/fs.h"
 #include "../kernel/process.h"
+#include "../kernel/memory.h"
+#include "../kernel/shm.h"
+#include "../kernel/kmemprof.h"
 
 static shell_context_t shell_ctx;
 
@@ -54,6 +57,10 @@ void init_builtin_commands(void) {
     register_builtin("umount", cmd_umount);
     register_builtin("df", cmd_df);
     register_builtin("free", cmd_free);
+    register_builtin("sched", cmd_sched);
+#ifdef CONFIG_KMEMPROF
+    register_builtin("kmemprof", cmd_kmemprof);
+#endif
     register_builtin("uname", cmd_uname);
     register_builtin("date", cmd_date);
     register_builtin("whoami", cmd_whoami);
@@ -381,7 +388,7 @@ int cmd_ps(int argc, char* argv[]) {
     
     get_process_list(processes, &count);
     
-    printf("  PID  PPID STATE PRI     TIME COMMAND\n");
+    printf("  PID  PPID STATE PRI  TIME(ms)  WAIT(ms)    RSS COMMAND\n");
     
     for(uint32_t i = 0; i < count; i++) {
         const char* state_str;
@@ -393,15 +400,140 @@ int cmd_ps(int argc, char* argv[]) {
             default: state_str = "?"; break;
         }
         
-        printf("%5d %5d %5s %3d %8lu %s\n",
+        printf("%5d %5d %5s %3d %9lu %9lu %5luK %s\n",
                processes[i].pid, processes[i].ppid, state_str,
-               processes[i].priority, processes[i].cpu_time,
-               processes[i].name);
+               processes[i].priority, processes[i].cpu_time / 1000000,
+               processes[i].wait_time / 1000000,
+               processes[i].rss * 4, processes[i].name);
     }
     
     return 0;
 }
 
+int cmd_free(int argc, char* argv[]) {
+    // free -c defragments first, as far as compaction gets
+    if(argc > 1 && strcmp(argv[1], "-c") == 0) {
+        compact_memory(MAX_BUDDY_ORDER - 1);
+    }
+    
+    memory_stats_t stats;
+    get_memory_stats(&stats);
+    compact_stats_t compact;
+    get_compact_stats(&compact);
+    
+    printf("        total     used     free  reclaimable\n");
+    printf("Mem: %8luK %8luK %8luK %11luK\n",
+           stats.total_memory / 1024, stats.used_memory / 1024,
+           stats.available_memory / 1024, stats.reclaimable_memory / 1024);
+    printf("kswapd: %lu wakeups, %lu pages; direct reclaim: %lu calls, %lu pages, %lu short\n",
+           stats.kswapd_wakeups, stats.kswapd_reclaimed,
+           stats.direct_reclaims, stats.direct_reclaimed, stats.direct_failures);
+    printf("compaction: %lu/%lu runs succeeded, %lu of %lu regions freed, %lu aborted, %lu pages moved, %lu cycles\n",
+           compact.successes, compact.runs, compact.regions_freed, compact.regions_scanned,
+           compact.regions_aborted, compact.pages_migrated, compact.cycles);
+    
+    for(uint32_t node = 0; numa_node_count() > 1 && node < numa_node_count(); node++) {
+        numa_stats_t numa;
+        get_numa_stats(node, &numa);
+        printf("node %u: %8luK total %8luK free, %lu local allocs, %lu fallback\n", node,
+               numa.total_pages * 4, numa.free_pages * 4, numa.preferred_allocs, numa.fallback_allocs);
+    }
+    
+    shm_stats_t shm;
+    get_shm_stats(&shm);
+    if(shm.objects) {
+        printf("shared: %u objects, %u mappings, %luK (%luK in large pages)\n",
+               shm.objects, shm.mappings, shm.bytes / 1024, shm.huge_bytes / 1024);
+    }
+    
+    return 0;
+}
+
+// Decimal digits only; false on anything else or overflow
+static bool parse_u64(const char* text, uint64_t* value) {
+    if(!*text) return false;
+    
+    uint64_t result = 0;
+    for(; *text; text++) {
+        if(*text < '0' || *text > '9') return false;
+        if(result > ((uint64_t)-1 - (*text - '0')) / 10) return false;
+        result = result * 10 + (*text - '0');
+    }
+    
+    *value = result;
+    return true;
+}
+
+// Fair-class tunables in microseconds. "sched <latency> <min granularity>
+// <wakeup credit>" replaces them.
+int cmd_sched(int argc, char* argv[]) {
+    fair_tunables_t tunables;
+    
+    if(argc > 1) {
+        uint64_t latency, granularity, credit;
+        if(argc != 4 || !parse_u64(argv[1], &latency) || !parse_u64(argv[2], &granularity) ||
+           !parse_u64(argv[3], &credit) || latency > (uint64_t)-1 / 1000 ||
+           granularity > (uint64_t)-1 / 1000 || credit > (uint64_t)-1 / 1000) {
+            printf("Usage: sched [latency_us min_granularity_us wakeup_credit_us]\n");
+            return 1;
+        }
+        
+        tunables.latency_ns = latency * 1000;
+        tunables.min_granularity_ns = granularity * 1000;
+        tunables.wakeup_credit_ns = credit * 1000;
+        if(!fair_set_tunables(&tunables)) {
+            printf("sched: granularity must be nonzero and no more than the latency\n");
+            return 1;
+        }
+    }
+    
+    fair_get_tunables(&tunables);
+    printf("latency %luus, min granularity %luus, wakeup credit %luus\n",
+           tunables.latency_ns / 1000, tunables.min_granularity_ns / 1000,
+           tunables.wakeup_credit_ns / 1000);
+    return 0;
+}
+
+#ifdef CONFIG_KMEMPROF
+#define KMEMPROF_SHOW_SITES 16
+
+// Kernel heap by call site, most live bytes first. "kmemprof reset"
+// starts the counts over.
+int cmd_kmemprof(int argc, char* argv[]) {
+    if(argc > 1 && strcmp(argv[1], "reset") == 0) {
+        kmemprof_reset();
+        return 0;
+    }
+    
+    static const char* kinds[] = { "kmalloc", "slab", "buddy" };
+    static kmemprof_site_t sites[KMEMPROF_SHOW_SITES];
+    kmemprof_stats_t stats;
+    uint32_t count = kmemprof_get_sites(sites, KMEMPROF_SHOW_SITES, &stats);
+    
+    printf("%lu events, %lu dropped, %lu untracked, %lu unknown frees\n",
+           stats.events, stats.dropped, stats.untracked, stats.unknown_frees);
+    printf("live: %luK in %lu objects from %u call sites\n",
+           stats.live_bytes / 1024, stats.live_objects, stats.sites);
+    
+    printf("caller            kind       allocs    frees      bytes       live  long-lived  oldest\n");
+    for(uint32_t i = 0; i < count; i++) {
+        kmemprof_site_t* site = &sites[i];
+        printf("%016lx  %-7s %9lu %8lu %9luK %9luK %11lu %6lus\n",
+               site->caller, site->caller ? kinds[site->kind] : "other",
+               site->allocs, site->frees, site->bytes / 1024, site->live_bytes / 1024,
+               site->long_lived, site->oldest_ms / 1000);
+    }
+    
+    printf("sizes:");
+    for(uint32_t bucket = 0; bucket < KMEMPROF_HIST_BUCKETS; bucket++) {
+        if(stats.histogram[bucket]) printf(" %luB:%lu", 1UL << bucket, stats.histogram[bucket]);
+    }
+    printf("\n");
+    
+    return 0;
+}
+#endif
+
 int cmd_ppmview(int argc, char* argv[]) {
     if(argc < 2) {
         printf("Usage: ppmview <file.ppm>\n");
@@ -94,6 +94,10 @@ int cmd_mount(int argc, char* argv[]);
 int cmd_umount(int argc, char* argv[]);
 int cmd_df(int argc, char* argv[]);
 int cmd_free(int argc, char* argv[]);
+int cmd_sched(int argc, char* argv[]);
+#ifdef CONFIG_KMEMPROF
+int cmd_kmemprof(int argc, char* argv[]);
+#endif
 int cmd_uname(int argc, char* argv[]);
 int cmd_date(int argc, char* argv[]);
 int cmd_whoami(int argc, char* argv[]);
@@ -454,14 +454,13 @@ uint32_t read_pci_config(int bus, int device, int function, int offset) {
 
 void* map_physical_memory(uint64_t phys_addr, size_t size) {
     // Map physical memory to virtual address space
-    uint64_t virt_addr = 0xFFFF800000000000 + phys_addr;
+    uint64_t virt_addr = PHYS_MAP_BASE + phys_addr;
     
-    // Add page table entries
-    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for(size_t i = 0; i < pages; i++) {
-        map_page(get_kernel_page_table(), virt_addr + i * PAGE_SIZE, 
-                phys_addr + i * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITABLE);
-    }
+    // Framebuffers and MMIO windows are large and aligned, so this mostly
+    // ends up as 2MB pages
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    map_range(get_kernel_page_table(), virt_addr, phys_addr, size,
+              PAGE_PRESENT | PAGE_WRITABLE);
     
     return (void*)virt_addr;
 }
\ No newline at end of file
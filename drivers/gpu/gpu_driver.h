@@ -243,10 +243,6 @@ void* map_physical_memory(uint64_t phys_addr, size_t size);
 void outl(uint16_t port, uint32_t value);
 uint32_t inl(uint16_t port);
 
-// Memory management
-void* get_kernel_page_table(void);
-void map_page(void* page_table, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
-
 // Standard functions
 int abs(int x);
 
@@ -0,0 +1,409 @@
+#include "filemap.h"
+#include "fs.h"
+#include "memory.h"
+#include "reclaim.h"
+#include "kernel.h"
+
+typedef struct {
+    cached_page_t* head;
+    cached_page_t* tail;
+} lru_list_t;
+
+static cached_page_t* filemap_hash[FILEMAP_BUCKETS];
+static lru_list_t lru_active;
+static lru_list_t lru_inactive;
+static spinlock_t filemap_lock = SPINLOCK_INIT;
+static slab_cache_t* filemap_cache;
+static filemap_stats_t filemap_stats;
+
+static uint64_t filemap_shrinker_count(void);
+
+static shrinker_t filemap_shrinker = {
+    .name = "filemap",
+    .count = filemap_shrinker_count,
+    .scan = filemap_shrink,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static inline uint32_t filemap_bucket(uint32_t inode_num, uint64_t index) {
+    uint64_t key = ((uint64_t)inode_num << 32) ^ index;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 54) % FILEMAP_BUCKETS;
+}
+
+// LRU helpers; callers hold filemap_lock
+
+static void lru_add(cached_page_t* entry, bool active) {
+    lru_list_t* list = active ? &lru_active : &lru_inactive;
+    
+    entry->active = active;
+    entry->lru_prev = NULL;
+    entry->lru_next = list->head;
+    if(list->head) list->head->lru_prev = entry;
+    else list->tail = entry;
+    list->head = entry;
+    
+    if(active) filemap_stats.active++;
+    else filemap_stats.inactive++;
+}
+
+static void lru_del(cached_page_t* entry) {
+    lru_list_t* list = entry->active ? &lru_active : &lru_inactive;
+    
+    if(entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else list->head = entry->lru_next;
+    if(entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else list->tail = entry->lru_prev;
+    
+    if(entry->active) filemap_stats.active--;
+    else filemap_stats.inactive--;
+}
+
+static void lru_move(cached_page_t* entry, bool active) {
+    lru_del(entry);
+    lru_add(entry, active);
+}
+
+// First hit marks the page, a second one promotes it to the active list
+static void mark_accessed(cached_page_t* entry) {
+    if(!entry->referenced) {
+        entry->referenced = 1;
+    } else if(!entry->active) {
+        entry->referenced = 0;
+        lru_move(entry, true);
+    }
+}
+
+// Unhash the entry at *link and drop the cache's reference on its frame
+static void filemap_remove(cached_page_t** link) {
+    cached_page_t* entry = *link;
+    
+    *link = entry->next;
+    lru_del(entry);
+    phys_to_page(entry->phys)->mapping = NULL;
+    put_page(entry->phys);
+    slab_free(filemap_cache, entry);
+    filemap_stats.pages--;
+}
+
+// Callers hold filemap_lock. An entry older than the file's mtime is
+// dropped on the spot and reported as a miss.
+static cached_page_t* filemap_lookup(uint32_t inode_num, uint64_t index, uint64_t modified) {
+    cached_page_t** link = &filemap_hash[filemap_bucket(inode_num, index)];
+    while(*link && ((*link)->inode_num != inode_num || (*link)->index != index)) {
+        link = &(*link)->next;
+    }
+    
+    cached_page_t* entry = *link;
+    if(entry && entry->modified != modified) {
+        filemap_remove(link);
+        filemap_stats.stale++;
+        entry = NULL;
+    }
+    
+    if(entry) mark_accessed(entry);
+    return entry;
+}
+
+// Whether a current copy of the page is cached, without counting a use.
+// Callers hold filemap_lock.
+static bool filemap_cached(uint32_t inode_num, uint64_t index, uint64_t modified) {
+    cached_page_t* entry = filemap_hash[filemap_bucket(inode_num, index)];
+    for(; entry; entry = entry->next) {
+        if(entry->inode_num == inode_num && entry->index == index) return entry->modified == modified;
+    }
+    return false;
+}
+
+// Return the frame caching page 'index' of the file, reading it on a miss.
+// The caller gets its own reference and drops it with put_page().
+uint64_t filemap_get_page(uint32_t inode_num, uint64_t index) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if(!inode) return 0;
+    
+    uint64_t modified = inode->modified;
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    cached_page_t* entry = filemap_lookup(inode_num, index, modified);
+    if(entry) {
+        uint64_t phys = entry->phys;
+        get_page(phys);
+        filemap_stats.hits++;
+        spin_unlock(&filemap_lock);
+        irq_restore(flags);
+        return phys;
+    }
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+    
+    // Read outside the lock, then recheck in case someone else got there
+    uint8_t* page = (uint8_t*)alloc_page(ALLOC_MOVABLE);
+    if(!page) return 0;
+    
+    uint64_t offset = index * PAGE_SIZE;
+    long bytes = 0;
+    if(offset < inode->size) {
+        uint64_t count = inode->size - offset;
+        bytes = read_inode_data(inode, offset, page, count < PAGE_SIZE ? count : PAGE_SIZE);
+        if(bytes < 0) bytes = 0;
+    }
+    memory_set(page + bytes, 0, PAGE_SIZE - bytes);
+    
+    if(!filemap_cache) {
+        filemap_cache = create_slab_cache("filemap", sizeof(cached_page_t), 64);
+        if(filemap_cache) register_shrinker(&filemap_shrinker);
+    }
+    
+    uint64_t phys = 0;
+    flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    entry = filemap_lookup(inode_num, index, modified);
+    if(entry) {
+        phys = entry->phys;
+        get_page(phys);
+        filemap_stats.hits++;
+    } else if(filemap_cache && (entry = (cached_page_t*)slab_alloc(filemap_cache))) {
+        uint32_t bucket = filemap_bucket(inode_num, index);
+        
+        entry->inode_num = inode_num;
+        entry->index = index;
+        entry->modified = modified;
+        entry->phys = (uint64_t)page;
+        entry->next = filemap_hash[bucket];
+        entry->referenced = 0;
+        filemap_hash[bucket] = entry;
+        lru_add(entry, false);
+        phys_to_page(entry->phys)->mapping = entry;
+        
+        phys = entry->phys;
+        get_page(phys); // One for the cache, one for the caller
+        filemap_stats.pages++;
+        filemap_stats.misses++;
+        page = NULL;
+    }
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+    
+    // Lost a race: drop our copy. No room for an entry: the caller gets
+    // the page uncached.
+    if(page) {
+        if(phys) put_page((uint64_t)page);
+        else phys = (uint64_t)page;
+    }
+    
+    return phys;
+}
+
+// Compaction moved a cached frame; point its entry at the new copy
+void filemap_migrate_page(uint64_t old_phys, uint64_t new_phys) {
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    page_t* old_page = phys_to_page(old_phys);
+    cached_page_t* entry = (cached_page_t*)old_page->mapping;
+    if(entry && entry->phys == old_phys) {
+        entry->phys = new_phys;
+        phys_to_page(new_phys)->mapping = entry;
+    }
+    old_page->mapping = NULL;
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+}
+
+long filemap_read(uint32_t inode_num, uint64_t offset, void* buffer, size_t count) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if(!inode) return -1;
+    
+    if(offset >= inode->size) return 0;
+    if(offset + count > inode->size) count = inode->size - offset;
+    
+    uint8_t* dest = (uint8_t*)buffer;
+    size_t done = 0;
+    
+    while(done < count) {
+        uint64_t position = offset + done;
+        uint64_t page = filemap_get_page(inode_num, position / PAGE_SIZE);
+        if(!page) break;
+        
+        size_t chunk = PAGE_SIZE - position % PAGE_SIZE;
+        if(chunk > count - done) chunk = count - done;
+        
+        memory_copy(dest + done, (uint8_t*)page + position % PAGE_SIZE, chunk);
+        put_page(page);
+        done += chunk;
+    }
+    
+    return (long)done;
+}
+
+// Bring pages [index, index + count) of a file into the cache ahead of
+// use. They start inactive and unreferenced, so a window that is never
+// touched is the first thing reclaim takes.
+void filemap_readahead(uint32_t inode_num, uint64_t index, uint64_t count) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if(!inode) return;
+    
+    uint64_t pages = (inode->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = index + count < pages ? index + count : pages;
+    uint64_t read = 0;
+    
+    for(; index < end; index++) {
+        uint64_t flags = irq_save();
+        spin_lock(&filemap_lock);
+        bool cached = filemap_cached(inode_num, index, inode->modified);
+        spin_unlock(&filemap_lock);
+        irq_restore(flags);
+        if(cached) continue;
+        
+        uint64_t phys = filemap_get_page(inode_num, index);
+        if(!phys) break;
+        put_page(phys);
+        read++;
+    }
+    
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    filemap_stats.readahead += read;
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+}
+
+// Write a page of a shared mapping back to its file. Only the part inside
+// the file goes; a mapping can't make the file longer.
+long filemap_write_page(uint32_t inode_num, uint64_t index, uint64_t phys) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if(!inode) return -1;
+    
+    uint64_t offset = index * PAGE_SIZE;
+    if(offset >= inode->size) return 0;
+    
+    uint64_t count = inode->size - offset;
+    if(count > PAGE_SIZE) count = PAGE_SIZE;
+    
+    long written = write_inode_data(inode, offset, (void*)phys, count);
+    if(written > 0) {
+        uint64_t flags = irq_save();
+        spin_lock(&filemap_lock);
+        filemap_stats.written++;
+        spin_unlock(&filemap_lock);
+        irq_restore(flags);
+    }
+    
+    return written;
+}
+
+// Finish a round of writeback. The file's mtime moves on and its cached
+// pages move with it, since they hold exactly what was just written;
+// anything else mapping them stays coherent.
+void filemap_write_done(uint32_t inode_num) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if(!inode) return;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    uint64_t old_modified = inode->modified;
+    inode->modified = get_system_time();
+    
+    for(uint32_t bucket = 0; bucket < FILEMAP_BUCKETS; bucket++) {
+        for(cached_page_t* entry = filemap_hash[bucket]; entry; entry = entry->next) {
+            if(entry->inode_num == inode_num && entry->modified == old_modified) {
+                entry->modified = inode->modified;
+            }
+        }
+    }
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+    
+    journal_transaction_t* trans = begin_transaction();
+    log_inode_change(trans, inode_num, inode);
+    commit_transaction(trans);
+}
+
+// Drop every cached page of a file. Processes that still map a page keep
+// their reference and the old contents.
+void filemap_invalidate(uint32_t inode_num) {
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    for(uint32_t bucket = 0; bucket < FILEMAP_BUCKETS; bucket++) {
+        cached_page_t** link = &filemap_hash[bucket];
+        while(*link) {
+            cached_page_t* entry = *link;
+            if(entry->inode_num != inode_num) {
+                link = &entry->next;
+                continue;
+            }
+            
+            filemap_remove(link);
+        }
+    }
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+}
+
+static uint64_t filemap_shrinker_count(void) {
+    return filemap_stats.pages;
+}
+
+// Evict up to 'pages' clean cached pages, oldest inactive first. Returns
+// the number of frames actually freed.
+uint64_t filemap_shrink(uint64_t pages) {
+    uint64_t freed = 0;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    
+    // Keep the inactive list longer than the active one; pages hit
+    // since the last pass get one more trip round the active list
+    uint64_t budget = filemap_stats.active;
+    while(budget-- && filemap_stats.active >= filemap_stats.inactive) {
+        cached_page_t* entry = lru_active.tail;
+        bool keep = entry->referenced;
+        entry->referenced = 0;
+        lru_move(entry, keep);
+    }
+    
+    budget = filemap_stats.inactive;
+    while(budget-- && freed < pages && lru_inactive.tail) {
+        cached_page_t* entry = lru_inactive.tail;
+        
+        if(entry->referenced) {
+            entry->referenced = 0;
+            lru_move(entry, true);
+            continue;
+        }
+        
+        // Mapped by a process: dropping the cache's reference frees nothing
+        if(phys_to_page(entry->phys)->ref_count > 1) {
+            lru_move(entry, false);
+            continue;
+        }
+        
+        cached_page_t** link = &filemap_hash[filemap_bucket(entry->inode_num, entry->index)];
+        while(*link != entry) link = &(*link)->next;
+        
+        filemap_remove(link);
+        filemap_stats.evicted++;
+        freed++;
+    }
+    
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+    
+    return freed;
+}
+
+void get_filemap_stats(filemap_stats_t* stats) {
+    uint64_t flags = irq_save();
+    spin_lock(&filemap_lock);
+    *stats = filemap_stats;
+    spin_unlock(&filemap_lock);
+    irq_restore(flags);
+}
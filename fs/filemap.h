@@ -0,0 +1,63 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// File page cache: file contents cached a page at a time, keyed by inode
+// number, page index and the inode's modification time. Frames are
+// reference counted like any mapped page, the cache itself holding one
+// reference. A page cached before the file's last modification is never
+// returned.
+//
+// Cached pages sit on an active or an inactive LRU list. New pages start
+// inactive; a second hit promotes them. Under memory pressure the
+// registered shrinker evicts from the inactive tail, giving referenced
+// pages another round and skipping pages a process still maps.
+//
+// Shared file mappings map cached frames directly and write into them; the
+// dirty bits live in the PTEs until msync or munmap writes the pages back.
+
+#define FILEMAP_BUCKETS 1024
+
+// Readahead window for sequential faults, in pages
+#define FILEMAP_READAHEAD_MIN 4
+#define FILEMAP_READAHEAD_MAX 32
+
+typedef struct cached_page {
+    uint32_t inode_num;
+    uint64_t index;    // Page offset within the file
+    uint64_t modified; // Inode mtime when the page was read
+    uint64_t phys;  // Frame holding the data
+    struct cached_page* next;
+    
+    // LRU position, most recently used at the head
+    struct cached_page* lru_prev;
+    struct cached_page* lru_next;
+    uint8_t active;
+    uint8_t referenced; // Hit since it was last scanned
+} cached_page_t;
+
+typedef struct {
+    uint64_t pages;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+    uint64_t active;
+    uint64_t inactive;
+    uint64_t evicted;
+    uint64_t readahead;  // Pages read before anyone asked for them
+    uint64_t written;    // Pages written back from shared mappings
+} filemap_stats_t;
+
+uint64_t filemap_get_page(uint32_t inode_num, uint64_t index);
+long filemap_read(uint32_t inode_num, uint64_t offset, void* buffer, size_t count);
+void filemap_invalidate(uint32_t inode_num);
+void filemap_readahead(uint32_t inode_num, uint64_t index, uint64_t count);
+long filemap_write_page(uint32_t inode_num, uint64_t index, uint64_t phys);
+void filemap_write_done(uint32_t inode_num);
+uint64_t filemap_shrink(uint64_t pages);
+void filemap_migrate_page(uint64_t old_phys, uint64_t new_phys);
+void get_filemap_stats(filemap_stats_t* stats);
+
+#endif
@@ -192,6 +192,7 @@ ssize_t fs_write(int fd, const void* buffer, size_t count);
 off_t fs_lseek(int fd, off_t offset, int whence);
 int fs_stat(const char* path, struct stat* buf);
 int fs_fstat(int fd, struct stat* buf);
+uint32_t fs_fd_inode(int fd, uint32_t* flags);
 
 // Directory operations
 int fs_mkdir(const char* path, mode_t mode);
@@ -223,6 +224,7 @@ int fs_umount(const char* mountpoint);
 
 // Utility functions
 uint32_t path_to_inode(const char* path);
+rfs_inode_t* fs_get_inode(uint32_t inode_num);
 uint32_t find_in_directory(uint32_t dir_inode, const char* name);
 void get_parent_path(const char* path, char* parent);
 void get_filename(const char* path, char* filename);
@@ -1,4 +1,6 @@
 #include "fs.h"
+#include "filemap.h"
+#include "elf.h"
 #include "memory.h"
 #include "kernel.h"
 
@@ -48,7 +50,7 @@ void mount_root_fs(void) {
     }
     
     // Load inode table
-    inode_table = (rfs_inode_t*)kmalloc(superblock->inode_count * sizeof(rfs_inode_t));
+    inode_table = (rfs_inode_t*)vmalloc(superblock->inode_count * sizeof(rfs_inode_t));
     read_disk_blocks(superblock->inode_table_start, 
                     (superblock->inode_count * sizeof(rfs_inode_t)) / BLOCK_SIZE + 1,
                     inode_table);
@@ -106,7 +108,7 @@ void format_rfs(void) {
     }
     
     // Initialize inode table
-    inode_table = (rfs_inode_t*)kcalloc(superblock->inode_count, sizeof(rfs_inode_t));
+    inode_table = (rfs_inode_t*)vzalloc(superblock->inode_count * sizeof(rfs_inode_t));
     
     // Create root directory
     create_root_directory();
@@ -154,6 +156,16 @@ void create_root_directory(void) {
     kfree(entries);
 }
 
+// Directory lookups read through the page cache, so adding or removing an
+// entry has to drop the parent's cached pages
+static void invalidate_parent_dir(const char* path) {
+    char parent_path[512];
+    get_parent_path(path, parent_path);
+    
+    uint32_t parent_inode = path_to_inode(parent_path);
+    if(parent_inode != 0) filemap_invalidate(parent_inode);
+}
+
 int fs_open(const char* path, int flags) {
     // Find free slot in open file table
     int slot = -1;
@@ -182,6 +194,7 @@ int fs_open(const char* path, int flags) {
             open_file_slots[slot] = false;
             return -1;
         }
+        invalidate_parent_dir(path);
     }
     
     rfs_inode_t* inode = &inode_table[inode_num - 1];
@@ -220,6 +233,17 @@ int fs_close(int fd) {
     return 0;
 }
 
+// Inode behind an open file and the flags it was opened with, for mmap.
+// Returns 0 if fd isn't open.
+uint32_t fs_fd_inode(int fd, uint32_t* flags) {
+    if(fd < 0 || fd >= MAX_OPEN_FILES || !open_file_slots[fd]) {
+        return 0;
+    }
+    
+    *flags = open_files[fd].flags;
+    return open_files[fd].inode_num;
+}
+
 ssize_t fs_read(int fd, void* buffer, size_t count) {
     if(fd < 0 || fd >= MAX_OPEN_FILES || !open_file_slots[fd]) {
         return -1;
@@ -281,6 +305,10 @@ ssize_t fs_write(int fd, const void* buffer, size_t count) {
         }
         inode->modified = get_system_time();
         
+        // Cached pages of the file are stale now
+        filemap_invalidate(file->inode_num);
+        elf_image_invalidate(file->inode_num);
+        
         // Log changes to journal
         log_inode_change(trans, file->inode_num, inode);
     }
@@ -334,6 +362,7 @@ int fs_mkdir(const char* path, mode_t mode) {
     if(inode_num == 0) {
         return -1;
     }
+    invalidate_parent_dir(path);
     
     // Initialize directory with . and .. entries
     rfs_inode_t* inode = &inode_table[inode_num - 1];
@@ -357,6 +386,8 @@ int fs_mkdir(const char* path, mode_t mode) {
     
     write_disk_block(data_block, entries);
     inode->size = 2 * sizeof(rfs_dirent_t);
+    filemap_invalidate(inode_num);
+    elf_image_invalidate(inode_num);
     
     kfree(entries);
     
@@ -379,8 +410,11 @@ int fs_rmdir(const char* path) {
     
     // Remove from parent directory
     remove_from_parent_dir(path, inode_num);
+    invalidate_parent_dir(path);
     
     // Free inode and blocks
+    filemap_invalidate(inode_num);
+    elf_image_invalidate(inode_num);
     free_inode_blocks(inode);
     free_inode(inode_num);
     
@@ -395,12 +429,15 @@ int fs_unlink(const char* path) {
     
     // Remove from parent directory
     remove_from_parent_dir(path, inode_num);
+    invalidate_parent_dir(path);
     
     // Decrease link count
     inode->links--;
     
     // If no more links, free the inode
     if(inode->links == 0) {
+        filemap_invalidate(inode_num);
+        elf_image_invalidate(inode_num);
         free_inode_blocks(inode);
         free_inode(inode_num);
     }
@@ -494,15 +531,23 @@ uint32_t path_to_inode(const char* path) {
     return current_inode;
 }
 
+rfs_inode_t* fs_get_inode(uint32_t inode_num) {
+    if(inode_num == 0 || inode_num > superblock->inode_count) return NULL;
+    return &inode_table[inode_num - 1];
+}
+
 uint32_t find_in_directory(uint32_t dir_inode, const char* name) {
     rfs_inode_t* inode = &inode_table[dir_inode - 1];
     
     if(inode->type != INODE_TYPE_DIR) return 0;
     
+    // Served from the page cache, so path lookups of hot binaries need no I/O
     uint32_t offset = 0;
     while(offset < inode->size) {
         rfs_dirent_t dirent;
-        read_inode_data(inode, offset, &dirent, sizeof(rfs_dirent_t));
+        if(filemap_read(dir_inode, offset, &dirent, sizeof(rfs_dirent_t)) != sizeof(rfs_dirent_t)) {
+            break;
+        }
         
         if(strcmp(dirent.name, name) == 0) {
             return dirent.inode;
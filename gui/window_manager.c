@@ -22,6 +22,9 @@ static font_t title_font;
 // Theme system
 static theme_t current_theme;
 
+// Window structure cache
+static slab_cache_t* window_cache;
+
 void gui_init(void) {
     // Initialize graphics driver
     init_graphics_driver();
@@ -30,7 +33,7 @@ void gui_init(void) {
     get_screen_info(&screen_width, &screen_height, &screen_bpp);
     
     // Allocate framebuffer
-    framebuffer = (uint32_t*)kmalloc(screen_width * screen_height * 4);
+    framebuffer = (uint32_t*)vmalloc(screen_width * screen_height * 4);
     
     // Initialize GUI context
     gui_context = (gui_context_t*)kmalloc(sizeof(gui_context_t));
@@ -82,6 +85,13 @@ void init_desktop(void) {
     draw_desktop();
 }
 
+void* get_window_cache(void) {
+    if(!window_cache) {
+        window_cache = create_slab_cache("window", sizeof(window_t), 32);
+    }
+    return window_cache;
+}
+
 window_t* create_window(const char* title, int x, int y, int width, int height, uint32_t flags) {
     // Allocate window structure
     window_t* window = (window_t*)slab_alloc(get_window_cache());
@@ -100,7 +110,7 @@ window_t* create_window(const char* title, int x, int y, int width, int height,
     window->focused = false;
     
     // Allocate window buffer
-    window->buffer = (uint32_t*)kmalloc(width * height * 4);
+    window->buffer = (uint32_t*)vmalloc(width * height * 4);
     
     // Initialize window decorations
     window->title_bar_height = TITLE_BAR_HEIGHT;
@@ -139,7 +149,7 @@ void destroy_window(window_t* window) {
     }
     
     // Free window buffer
-    kfree(window->buffer);
+    vfree(window->buffer);
     
     // Free window structure
     slab_free(get_window_cache(), window);
@@ -339,8 +349,8 @@ void maximize_window(window_t* window) {
         window->height = screen_height - TASKBAR_HEIGHT;
         
         // Reallocate buffer
-        kfree(window->buffer);
-        window->buffer = (uint32_t*)kmalloc(window->width * window->height * 4);
+        vfree(window->buffer);
+        window->buffer = (uint32_t*)vmalloc(window->width * window->height * 4);
     }
     
     draw_window(window);
@@ -381,10 +391,10 @@ bool load_ppm_image(const char* path, ppm_image_t* image) {
     sscanf(line, "%d", &max_val);
     
     // Allocate image data
-    image->data = (uint32_t*)kmalloc(image->width * image->height * 4);
+    image->data = (uint32_t*)vmalloc(image->width * image->height * 4);
     
     // Read pixel data
-    uint8_t* rgb_data = (uint8_t*)kmalloc(image->width * image->height * 3);
+    uint8_t* rgb_data = (uint8_t*)vmalloc(image->width * image->height * 3);
     fs_read(fd, rgb_data, image->width * image->height * 3);
     
     // Convert RGB to RGBA
@@ -395,7 +405,7 @@ bool load_ppm_image(const char* path, ppm_image_t* image) {
         image->data[i] = (0xFF << 24) | (r << 16) | (g << 8) | b;
     }
     
-    kfree(rgb_data);
+    vfree(rgb_data);
     fs_close(fd);
     
     return true;
@@ -0,0 +1,101 @@
+#include <stddef.h>
+#include "acpi.h"
+#include "memory.h"
+#include "kernel.h"
+
+#define EBDA_SEGMENT_PTR 0x40E // BIOS data area word holding the EBDA segment
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_END     0x100000
+
+static acpi_rsdp_t* rsdp;
+static acpi_sdt_header_t* root_table; // XSDT when there is one, else RSDT
+static bool root_is_xsdt;
+
+static bool acpi_checksum(const void* data, uint64_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for(uint64_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+// Tables live in reserved memory, which can sit above the RAM the identity
+// map covers; map any 2 MB chunk of the range that is missing
+static void acpi_map(uint64_t address, uint64_t size) {
+    page_table_t* kernel = get_kernel_page_table();
+    uint64_t chunk = address & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
+    
+    for(; chunk < address + size; chunk += LARGE_PAGE_SIZE) {
+        if(chunk && !get_physical_address(kernel, chunk)) {
+            map_range(kernel, chunk, chunk, LARGE_PAGE_SIZE, PAGE_PRESENT | PAGE_NO_EXECUTE);
+        }
+    }
+}
+
+static acpi_sdt_header_t* acpi_map_table(uint64_t address) {
+    if(!address) return NULL;
+    
+    acpi_map(address, sizeof(acpi_sdt_header_t));
+    acpi_sdt_header_t* table = (acpi_sdt_header_t*)address;
+    acpi_map(address, table->length);
+    
+    return acpi_checksum(table, table->length) ? table : NULL;
+}
+
+static acpi_rsdp_t* acpi_scan_rsdp(uint64_t start, uint64_t end) {
+    for(uint64_t address = start; address + sizeof(acpi_rsdp_t) <= end; address += 16) {
+        acpi_rsdp_t* candidate = (acpi_rsdp_t*)address;
+        if(memory_compare(candidate->signature, "RSD PTR ", 8) != 0) continue;
+        if(acpi_checksum(candidate, 20)) return candidate;
+    }
+    return NULL;
+}
+
+// Read a word of low firmware memory. The address goes through a volatile
+// so the compiler cannot treat a small constant as a null-based pointer.
+static uint16_t bios_read16(uintptr_t address) {
+    volatile uintptr_t where = address;
+    return *(volatile uint16_t*)where;
+}
+
+// Find the RSDP in the first KB of the EBDA or the BIOS ROM area, then the
+// root table it points at. Returns false if the firmware has no ACPI.
+bool acpi_init(void) {
+    uint64_t ebda = (uint64_t)bios_read16(EBDA_SEGMENT_PTR) << 4;
+    if(ebda) rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    if(!rsdp) rsdp = acpi_scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+    if(!rsdp) return false;
+    
+    if(rsdp->revision >= 2 && rsdp->xsdt_address && acpi_checksum(rsdp, rsdp->length)) {
+        root_table = acpi_map_table(rsdp->xsdt_address);
+        root_is_xsdt = root_table != NULL;
+    }
+    if(!root_table) root_table = acpi_map_table(rsdp->rsdt_address);
+    
+    if(!root_table) {
+        kprintf("ACPI: RSDP at %lx but no valid root table\n", (uint64_t)rsdp);
+        return false;
+    }
+    
+    kprintf("ACPI: revision %u, %s at %lx\n", rsdp->revision,
+            root_is_xsdt ? "XSDT" : "RSDT", (uint64_t)root_table);
+    return true;
+}
+
+// Returns the first table with a matching signature and a valid checksum
+acpi_sdt_header_t* acpi_find_table(const char* signature) {
+    if(!root_table) return NULL;
+    
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t entries = (root_table->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    uint8_t* pointers = (uint8_t*)root_table + sizeof(acpi_sdt_header_t);
+    
+    for(uint32_t i = 0; i < entries; i++) {
+        uint64_t address = root_is_xsdt ? *(uint64_t*)(pointers + i * 8)
+                                        : *(uint32_t*)(pointers + i * 4);
+        
+        acpi_sdt_header_t* table = acpi_map_table(address);
+        if(table && memory_compare(table->signature, signature, 4) == 0) return table;
+    }
+    
+    return NULL;
+}
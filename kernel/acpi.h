@@ -0,0 +1,144 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ACPI table discovery. Only the tables the kernel reads are described:
+// the RSDP and root tables, the SRAT and SLIT that give the NUMA
+// topology, and the MADT that lists the CPUs. Tables are read in place through the identity map.
+
+typedef struct {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;  // Covers the first 20 bytes
+    char oem_id[6];
+    uint8_t revision;  // 0 for ACPI 1.0 (RSDT only), 2 and up add the XSDT
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length; // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// System Resource Affinity Table: which proximity domain each CPU and
+// memory range belongs to
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} __attribute__((packed)) acpi_srat_t;
+
+#define SRAT_PROCESSOR_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY    1
+#define SRAT_X2APIC_AFFINITY    2
+
+#define SRAT_ENABLED       0x1
+#define SRAT_HOT_PLUGGABLE 0x2 // Memory: may not be present at boot
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_srat_entry_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_cpu_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_memory_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t proximity;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+// System Locality Information Table: relative access cost between
+// proximity domains, row-major, 10 meaning local
+typedef struct {
+    acpi_sdt_header_t header;
+    uint64_t localities;
+    uint8_t distance[];
+} __attribute__((packed)) acpi_slit_t;
+
+// Multiple APIC Description Table ("APIC"): the local APIC address and one
+// entry per processor
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_LOCAL_APIC     0
+#define MADT_LAPIC_OVERRIDE 5 // 64-bit local APIC address
+#define MADT_LOCAL_X2APIC   9
+
+#define MADT_ENABLED        0x1
+#define MADT_ONLINE_CAPABLE 0x2 // Disabled now, but may be started
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed)) acpi_madt_lapic_override_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t processor_uid;
+} __attribute__((packed)) acpi_madt_x2apic_t;
+
+bool acpi_init(void);
+acpi_sdt_header_t* acpi_find_table(const char* signature);
+
+#endif
@@ -0,0 +1,178 @@
+#include "clock.h"
+#include "vdso.h"
+#include "timer.h"
+#include "cpu.h"
+#include "io.h"
+#include "memory.h"
+#include "kernel.h"
+
+#define CPUID_INVARIANT_TSC (1 << 8) // Leaf 0x80000007, EDX
+
+// CMOS real-time clock
+#define CMOS_ADDRESS  0x70
+#define CMOS_DATA     0x71
+#define RTC_SECONDS   0x00
+#define RTC_MINUTES   0x02
+#define RTC_HOURS     0x04
+#define RTC_DAY       0x07
+#define RTC_MONTH     0x08
+#define RTC_YEAR      0x09
+#define RTC_STATUS_A  0x0A
+#define RTC_STATUS_B  0x0B
+#define RTC_UPDATING  0x80 // Status A: fields are changing
+#define RTC_24_HOUR   0x02 // Status B
+#define RTC_BINARY    0x04 // Status B: fields are not BCD
+#define RTC_PM        0x80 // Hours, in 12-hour mode
+
+static uint64_t tsc_khz;
+static uint64_t tsc_base;        // TSC at monotonic time 0
+static uint64_t mult;            // ns per cycle << CLOCK_SHIFT
+static int64_t realtime_offset;  // Realtime ns minus monotonic ns
+static bool tsc_invariant;
+
+// Crystal-derived rate, when the CPU reports both ratio and crystal
+static uint64_t tsc_khz_from_cpuid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x15) return 0;
+    
+    cpuid(0x15, &eax, &ebx, &ecx, &edx);
+    if (!eax || !ebx || !ecx) return 0;
+    return (uint64_t)ecx * ebx / eax / 1000;
+}
+
+static uint64_t tsc_khz_from_pit(void) {
+    uint64_t start = rdtsc();
+    pit_delay_us(CLOCK_CALIBRATE_US);
+    return (rdtsc() - start) * 1000 / CLOCK_CALIBRATE_US;
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+static uint8_t bcd_to_binary(uint8_t value) {
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+// Days from 1970-01-01 to a civil date (Howard Hinnant's days_from_civil)
+static int64_t days_from_civil(int64_t year, uint32_t month, uint32_t day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t year_of_era = (uint32_t)(year - era * 400);
+    uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (int64_t)day_of_era - 719468;
+}
+
+// Seconds since the Unix epoch; the RTC keeps UTC and a two-digit year
+static int64_t rtc_read_seconds(void) {
+    uint8_t fields[6];
+    uint8_t previous[6];
+    
+    // Read until two passes agree, so no field rolled over in between
+    for (uint32_t pass = 0; pass < 8; pass++) {
+        while (cmos_read(RTC_STATUS_A) & RTC_UPDATING);
+        
+        fields[0] = cmos_read(RTC_SECONDS);
+        fields[1] = cmos_read(RTC_MINUTES);
+        fields[2] = cmos_read(RTC_HOURS);
+        fields[3] = cmos_read(RTC_DAY);
+        fields[4] = cmos_read(RTC_MONTH);
+        fields[5] = cmos_read(RTC_YEAR);
+        
+        if (pass && memory_compare(fields, previous, sizeof(fields)) == 0) break;
+        memory_copy(previous, fields, sizeof(fields));
+    }
+    
+    uint8_t status = cmos_read(RTC_STATUS_B);
+    bool pm = fields[2] & RTC_PM;
+    fields[2] &= ~RTC_PM;
+    if (!(status & RTC_BINARY)) {
+        for (uint32_t i = 0; i < 6; i++) fields[i] = bcd_to_binary(fields[i]);
+    }
+    if (!(status & RTC_24_HOUR)) {
+        fields[2] %= 12;
+        if (pm) fields[2] += 12;
+    }
+    
+    int64_t days = days_from_civil(2000 + fields[5], fields[4], fields[3]);
+    return days * 86400 + fields[2] * 3600 + fields[1] * 60 + fields[0];
+}
+
+void clock_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = edx & CPUID_INVARIANT_TSC;
+    }
+    
+    tsc_khz = tsc_khz_from_cpuid();
+    if (!tsc_khz) tsc_khz = tsc_khz_from_pit();
+    mult = (NSEC_PER_MSEC << CLOCK_SHIFT) / tsc_khz;
+    
+    int64_t rtc_seconds = rtc_read_seconds();
+    tsc_base = rdtsc();
+    realtime_offset = rtc_seconds * (int64_t)NSEC_PER_SEC;
+    
+    kprintf("Clock: TSC %lu kHz%s\n", tsc_khz, tsc_invariant ? "" : ", not invariant; time may drift");
+}
+
+uint64_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+bool clock_tsc_invariant(void) {
+    return tsc_invariant;
+}
+
+// 128-bit products, so no interval overflows
+uint64_t clock_ns_to_tsc(uint64_t ns) {
+    return (uint64_t)((unsigned __int128)ns * tsc_khz / NSEC_PER_MSEC);
+}
+
+uint64_t clock_tsc_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * mult) >> CLOCK_SHIFT);
+}
+
+uint64_t clock_monotonic_ns(void) {
+    return clock_tsc_to_ns(rdtsc() - tsc_base);
+}
+
+uint64_t clock_realtime_ns(void) {
+    return clock_monotonic_ns() + realtime_offset;
+}
+
+int clock_gettime(int clock, timespec_t* ts) {
+    uint64_t ns;
+    if (clock == CLOCK_MONOTONIC) {
+        ns = clock_monotonic_ns();
+    } else if (clock == CLOCK_REALTIME) {
+        ns = clock_realtime_ns();
+    } else {
+        return -1;
+    }
+    
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+    return 0;
+}
+
+// Milliseconds since boot, as every caller has always assumed
+uint64_t get_system_time(void) {
+    return clock_monotonic_ns() / NSEC_PER_MSEC;
+}
+
+void clock_fill_vdso(vdso_data_t* data) {
+    data->seq++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    data->tsc_base = tsc_base;
+    data->mult = mult;
+    data->realtime_offset = realtime_offset;
+    
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    data->seq++;
+}
@@ -0,0 +1,46 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Clocks read from the TSC. Its rate is calibrated once at boot and taken
+// to be constant, which CPUs with an invariant TSC guarantee, and the TSCs
+// of all CPUs are taken to run in step. Monotonic time counts from
+// clock_init; realtime adds the CMOS clock read at that moment.
+
+// POSIX clock ids
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+#define CLOCK_SHIFT          32    // ns = cycles * mult >> CLOCK_SHIFT
+#define CLOCK_CALIBRATE_US   50000 // PIT interval when CPUID does not give the rate
+
+typedef struct {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+} timespec_t;
+
+struct vdso_data;
+
+// First thing after the per-CPU data; needs nothing else
+void clock_init(void);
+
+uint64_t clock_tsc_khz(void);
+bool clock_tsc_invariant(void);
+uint64_t clock_ns_to_tsc(uint64_t ns);
+uint64_t clock_tsc_to_ns(uint64_t cycles);
+
+uint64_t clock_monotonic_ns(void);
+uint64_t clock_realtime_ns(void);
+
+// -1 for an unknown clock
+int clock_gettime(int clock, timespec_t* ts);
+
+// Publish the clock parameters to the page user space reads
+void clock_fill_vdso(struct vdso_data* data);
+
+#endif
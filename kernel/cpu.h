@@ -0,0 +1,113 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 64
+#define CACHE_LINE_SIZE 64
+
+// Each CPU's GS base points at its cpu_t (smp.h), whose id field sits at
+// this offset. The BSP sets its GS base before anything asks.
+#define CPU_ID_OFFSET 8
+
+static inline uint32_t cpu_id(void) {
+    uint32_t id;
+    __asm__ __volatile__ ("movl %%gs:%c1, %0" : "=r"(id) : "i"(CPU_ID_OFFSET));
+    return id;
+}
+
+// Disable interrupts on this CPU, returning the previous RFLAGS
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__ ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if(flags & 0x200) {
+        __asm__ __volatile__ ("sti" : : : "memory");
+    }
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__ ("cpuid"
+                          : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                          : "a"(leaf), "c"(0));
+}
+
+// Model-specific registers
+#define MSR_APIC_BASE      0x1B
+#define MSR_TSC_DEADLINE   0x6E0
+#define MSR_EFER           0xC0000080
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102 // Swapped with GS base by swapgs
+
+static inline uint64_t read_msr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void write_msr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__ ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Time stamp counter, for cycle accounting
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Control registers
+#define CR0_WP (1ULL << 16) // Enforce read-only pages in ring 0 too
+#define CR4_PGE (1ULL << 7)  // Global pages survive a CR3 reload
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    __asm__ __volatile__ ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    __asm__ __volatile__ ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    __asm__ __volatile__ ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr2(void) {
+    uint64_t value;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+// TLB maintenance
+static inline void flush_tlb_page(uint64_t virtual_addr) {
+    __asm__ __volatile__ ("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+}
+
+static inline void flush_tlb_all(void) {
+    uint64_t cr3;
+    __asm__ __volatile__ ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+// Global entries too, which only a change to CR4.PGE drops
+static inline void flush_tlb_global(void) {
+    uint64_t cr4 = read_cr4();
+    if(cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        flush_tlb_all();
+    }
+}
+
+#endif
@@ -1,60 +1,136 @@
 #include "kernel.h"
 #include "proc.h"
+#include "elf.h"
+#include "filemap.h"
+#include "fs.h"
+#include "spinlock.h"
 #include <string.h>
 
-#define ELF_MAGIC 0x464C457F
+static elf_image_t image_cache[ELF_IMAGE_CACHE_SIZE];
+static uint64_t image_clock;
+static spinlock_t image_lock = SPINLOCK_INIT;
 
-typedef struct {
-    uint32_t magic;
-    uint8_t  bits;
-    uint8_t  endian;
-    uint8_t  version;
-    uint8_t  abi;
-    uint8_t  abi_version;
-    uint8_t  pad[7];
-    uint16_t type;
-    uint16_t machine;
-    uint32_t version2;
-    uint64_t entry;
-    uint64_t phoff;
-    uint64_t shoff;
-    uint32_t flags;
-    uint16_t ehsize;
-    uint16_t phentsize;
-    uint16_t phnum;
-    uint16_t shentsize;
-    uint16_t shnum;
-    uint16_t shstrndx;
-} elf64_header_t;
+static bool elf_image_lookup(uint32_t inode_num, uint64_t modified, elf_image_t* image) {
+    bool found = false;
+    uint64_t flags = irq_save();
+    spin_lock(&image_lock);
+    
+    for (int i = 0; i < ELF_IMAGE_CACHE_SIZE; i++) {
+        if (image_cache[i].inode_num == inode_num && image_cache[i].modified == modified) {
+            image_cache[i].last_used = ++image_clock;
+            *image = image_cache[i];
+            found = true;
+            break;
+        }
+    }
+    
+    spin_unlock(&image_lock);
+    irq_restore(flags);
+    return found;
+}
 
-typedef struct {
-    uint32_t type;
-    uint32_t flags;
-    uint64_t offset;
-    uint64_t vaddr;
-    uint64_t paddr;
-    uint64_t filesz;
-    uint64_t memsz;
-    uint64_t align;
-} elf64_phdr_t;
+// Replace the entry for the same inode, else a free slot, else the least
+// recently used one
+static void elf_image_insert(const elf_image_t* image) {
+    uint64_t flags = irq_save();
+    spin_lock(&image_lock);
+    
+    int victim = 0;
+    for (int i = 0; i < ELF_IMAGE_CACHE_SIZE; i++) {
+        if (image_cache[i].inode_num == image->inode_num || image_cache[i].inode_num == 0) {
+            victim = i;
+            break;
+        }
+        if (image_cache[i].last_used < image_cache[victim].last_used) victim = i;
+    }
+    
+    image_cache[victim] = *image;
+    image_cache[victim].last_used = ++image_clock;
+    
+    spin_unlock(&image_lock);
+    irq_restore(flags);
+}
 
-int elf_load(process_t* p, void* data) {
-    elf64_header_t* header = (elf64_header_t*)data;
+void elf_image_invalidate(uint32_t inode_num) {
+    uint64_t flags = irq_save();
+    spin_lock(&image_lock);
     
-    if (header->magic != ELF_MAGIC) return -1;
-    if (header->bits != 2) return -1; // 64-bit
+    for (int i = 0; i < ELF_IMAGE_CACHE_SIZE; i++) {
+        if (image_cache[i].inode_num == inode_num) image_cache[i].inode_num = 0;
+    }
+    
+    spin_unlock(&image_lock);
+    irq_restore(flags);
+}
 
-    elf64_phdr_t* phdr = (elf64_phdr_t*)((uint8_t*)data + header->phoff);
-    
-    for (int i = 0; i < header->phnum; i++) {
-        if (phdr[i].type == 1) { // PT_LOAD
-            // Map memory in process address space and copy data
-            // vmm_map(p->page_table, phdr[i].vaddr, phdr[i].memsz, phdr[i].flags);
-            // memcpy((void*)phdr[i].vaddr, (uint8_t*)data + phdr[i].offset, phdr[i].filesz);
-            // memset((void*)(phdr[i].vaddr + phdr[i].filesz), 0, phdr[i].memsz - phdr[i].filesz);
-        }
+static bool elf_parse_image(uint32_t inode_num, uint64_t modified, elf_image_t* image) {
+    elf64_header_t header;
+    
+    if (filemap_read(inode_num, 0, &header, sizeof(header)) != sizeof(header)) return false;
+    if (header.magic != ELF_MAGIC) return false;
+    if (header.bits != 2) return false; // 64-bit
+    
+    image->inode_num = inode_num;
+    image->modified = modified;
+    image->entry = header.entry;
+    image->segment_count = 0;
+    
+    for (int i = 0; i < header.phnum; i++) {
+        elf64_phdr_t phdr;
+        uint64_t offset = header.phoff + (uint64_t)i * sizeof(elf64_phdr_t);
+        
+        if (filemap_read(inode_num, offset, &phdr, sizeof(phdr)) != sizeof(phdr)) return false;
+        if (phdr.type != PT_LOAD) continue;
+        
+        // File offset and address must share a page offset to map directly
+        if ((phdr.vaddr - phdr.offset) & (PAGE_SIZE - 1)) return false;
+        if (phdr.filesz > phdr.memsz) return false;
+        if (image->segment_count == ELF_MAX_SEGMENTS) return false;
+        
+        image->segments[image->segment_count++] = phdr;
+    }
+    
+    return true;
+}
+
+// Map every PT_LOAD segment of an executable as a file-backed VMA. Text and
+// data are faulted in from the page cache as they are touched, so text
+// pages are shared by every process running the binary, and writable
+// segments get private copies on write.
+bool elf_map_image(uint32_t inode_num, vma_t** vmas, uint64_t* entry) {
+    rfs_inode_t* inode = fs_get_inode(inode_num);
+    if (!inode) return false;
+    
+    elf_image_t image;
+    if (!elf_image_lookup(inode_num, inode->modified, &image)) {
+        if (!elf_parse_image(inode_num, inode->modified, &image)) return false;
+        elf_image_insert(&image);
     }
     
-    p->context->rip = header->entry;
+    for (uint32_t i = 0; i < image.segment_count; i++) {
+        elf64_phdr_t* phdr = &image.segments[i];
+        
+        uint64_t flags = PAGE_USER;
+        if (phdr->flags & PF_W) flags |= PAGE_WRITABLE;
+        if (!(phdr->flags & PF_X)) flags |= PAGE_NO_EXECUTE;
+        
+        vma_t* vma = vma_create(vmas, phdr->vaddr, phdr->vaddr + phdr->memsz, flags, VMA_FILE);
+        if (!vma) return false;
+        
+        vma->inode_num = inode_num;
+        vma->file_offset = phdr->offset & ~(uint64_t)(PAGE_SIZE - 1);
+        vma->file_end = phdr->vaddr + phdr->filesz;
+    }
+    
+    *entry = image.entry;
+    return true;
+}
+
+int elf_load(process_t* p, uint32_t inode_num) {
+    uint64_t entry;
+    
+    if (!elf_map_image(inode_num, &p->vmas, &entry)) return -1;
+    
+    p->context->rip = entry;
     return 0;
 }
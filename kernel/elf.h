@@ -0,0 +1,71 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vma.h"
+
+#define ELF_MAGIC 0x464C457F
+
+// Program header types and flags
+#define PT_LOAD 1
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  bits;
+    uint8_t  endian;
+    uint8_t  version;
+    uint8_t  abi;
+    uint8_t  abi_version;
+    uint8_t  pad[7];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version2;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf64_header_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+} elf64_phdr_t;
+
+// Parsed executable metadata, cached by inode and mtime so exec of a hot
+// binary touches neither the disk nor the page cache for its headers
+#define ELF_IMAGE_CACHE_SIZE 64
+#define ELF_MAX_SEGMENTS     16
+
+typedef struct {
+    uint32_t inode_num; // 0 marks a free slot
+    uint64_t modified;
+    uint64_t entry;
+    uint64_t last_used;
+    uint32_t segment_count;
+    elf64_phdr_t segments[ELF_MAX_SEGMENTS]; // PT_LOAD headers only
+} elf_image_t;
+
+bool elf_map_image(uint32_t inode_num, vma_t** vmas, uint64_t* entry);
+
+// Forget the cached headers of an inode that was written or freed. The
+// mtime check alone misses a rewrite in the same millisecond or a
+// recycled inode number.
+void elf_image_invalidate(uint32_t inode_num);
+
+#endif
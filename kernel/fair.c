@@ -0,0 +1,353 @@
+#include "sched.h"
+
+static const uint32_t fair_weights[SCHED_PRIORITY_LEVELS] = SCHED_FAIR_WEIGHTS;
+
+static fair_tunables_t tunables = {
+    .latency_ns = SCHED_LATENCY_NS,
+    .min_granularity_ns = SCHED_MIN_GRANULARITY_NS,
+    .wakeup_credit_ns = SCHED_WAKEUP_CREDIT_NS,
+};
+
+// Virtual runtimes only ever grow, so compare them by signed difference
+// and a wrap-around never reorders the tree
+static inline bool vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+void fair_queue_init(fair_queue_t* queue) {
+    queue->root = NULL;
+    queue->leftmost = NULL;
+    queue->min_vruntime = 0;
+    queue->total_weight = 0;
+    queue->count = 0;
+}
+
+uint32_t fair_weight(uint32_t priority) {
+    if (priority >= SCHED_PRIORITY_LEVELS) priority = SCHED_PRIORITY_LEVELS - 1;
+    return fair_weights[priority];
+}
+
+// A new task starts level with the queue rather than ahead of everyone
+void fair_node_init(fair_queue_t* queue, fair_node_t* node, uint32_t priority) {
+    node->parent = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = false;
+    node->queued = false;
+    node->vruntime = queue->min_vruntime;
+    node->weight = fair_weight(priority);
+}
+
+// Red-black tree rotations and fixups, after CLRS with NULL leaves
+
+static void rotate_left(fair_queue_t* queue, fair_node_t* node) {
+    fair_node_t* right = node->right;
+    node->right = right->left;
+    if (right->left) right->left->parent = node;
+    
+    right->parent = node->parent;
+    if (!node->parent) {
+        queue->root = right;
+    } else if (node == node->parent->left) {
+        node->parent->left = right;
+    } else {
+        node->parent->right = right;
+    }
+    
+    right->left = node;
+    node->parent = right;
+}
+
+static void rotate_right(fair_queue_t* queue, fair_node_t* node) {
+    fair_node_t* left = node->left;
+    node->left = left->right;
+    if (left->right) left->right->parent = node;
+    
+    left->parent = node->parent;
+    if (!node->parent) {
+        queue->root = left;
+    } else if (node == node->parent->right) {
+        node->parent->right = left;
+    } else {
+        node->parent->left = left;
+    }
+    
+    left->right = node;
+    node->parent = left;
+}
+
+static void insert_fixup(fair_queue_t* queue, fair_node_t* node) {
+    while (node->parent && node->parent->red) {
+        fair_node_t* parent = node->parent;
+        fair_node_t* grandparent = parent->parent;
+        
+        if (parent == grandparent->left) {
+            fair_node_t* uncle = grandparent->right;
+            if (uncle && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                node = parent;
+                rotate_left(queue, node);
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rotate_right(queue, grandparent);
+        } else {
+            fair_node_t* uncle = grandparent->left;
+            if (uncle && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                node = parent;
+                rotate_right(queue, node);
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            rotate_left(queue, grandparent);
+        }
+    }
+    queue->root->red = false;
+}
+
+// node took a black away from the path through it; node may be NULL, so
+// its parent is passed along
+static void remove_fixup(fair_queue_t* queue, fair_node_t* node, fair_node_t* parent) {
+    while (node != queue->root && (!node || !node->red)) {
+        if (node == parent->left) {
+            fair_node_t* sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(queue, parent);
+                sibling = parent->right;
+            }
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!sibling->right || !sibling->right->red) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(queue, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(queue, parent);
+        } else {
+            fair_node_t* sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(queue, parent);
+                sibling = parent->left;
+            }
+            if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!sibling->left || !sibling->left->red) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(queue, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(queue, parent);
+        }
+        node = queue->root;
+    }
+    if (node) node->red = false;
+}
+
+// min_vruntime follows the task furthest behind, queued or running, but
+// never goes back
+static void update_min_vruntime(fair_queue_t* queue, fair_node_t* running) {
+    uint64_t lowest = queue->min_vruntime;
+    bool found = false;
+    
+    if (running && !running->queued) {
+        lowest = running->vruntime;
+        found = true;
+    }
+    if (queue->leftmost && (!found || vruntime_before(queue->leftmost->vruntime, lowest))) {
+        lowest = queue->leftmost->vruntime;
+        found = true;
+    }
+    
+    if (found && vruntime_before(queue->min_vruntime, lowest)) queue->min_vruntime = lowest;
+}
+
+// Behind equal vruntimes, so ties run in queueing order. A task that slept
+// keeps what it was owed up to the wakeup credit, so an interactive task
+// runs soon after waking without banking a whole sleep's worth of CPU.
+void fair_queue_add(fair_queue_t* queue, fair_node_t* node) {
+    if (node->queued) return;
+    
+    uint64_t floor = queue->min_vruntime - tunables.wakeup_credit_ns;
+    if (vruntime_before(node->vruntime, floor)) node->vruntime = floor;
+    
+    fair_node_t* parent = NULL;
+    fair_node_t** link = &queue->root;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (vruntime_before(node->vruntime, parent->vruntime)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    node->queued = true;
+    *link = node;
+    if (leftmost) queue->leftmost = node;
+    
+    insert_fixup(queue, node);
+    queue->total_weight += node->weight;
+    queue->count++;
+}
+
+void fair_queue_remove(fair_queue_t* queue, fair_node_t* node) {
+    if (!node->queued) return;
+    
+    // The next leftmost is the in-order successor, which has no left child
+    if (queue->leftmost == node) {
+        fair_node_t* next = node->right;
+        if (next) {
+            while (next->left) next = next->left;
+        } else {
+            next = node->parent;
+        }
+        queue->leftmost = next;
+    }
+    
+    fair_node_t* child;
+    fair_node_t* parent;
+    bool removed_red;
+    
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        
+        if (child) child->parent = parent;
+        if (!parent) {
+            queue->root = child;
+        } else if (parent->left == node) {
+            parent->left = child;
+        } else {
+            parent->right = child;
+        }
+    } else {
+        // Two children: the successor takes node's place and colour, and
+        // the tree loses the successor's colour at its old spot
+        fair_node_t* successor = node->right;
+        while (successor->left) successor = successor->left;
+        
+        child = successor->right;
+        removed_red = successor->red;
+        
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child) child->parent = parent;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+        
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        successor->red = node->red;
+        if (!node->parent) {
+            queue->root = successor;
+        } else if (node->parent->left == node) {
+            node->parent->left = successor;
+        } else {
+            node->parent->right = successor;
+        }
+    }
+    
+    if (!removed_red) remove_fixup(queue, child, parent);
+    
+    node->parent = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->queued = false;
+    queue->total_weight -= node->weight;
+    queue->count--;
+}
+
+// Take the task furthest behind
+fair_node_t* fair_queue_pop(fair_queue_t* queue) {
+    fair_node_t* node = queue->leftmost;
+    if (!node) return NULL;
+    
+    fair_queue_remove(queue, node);
+    update_min_vruntime(queue, node);
+    return node;
+}
+
+// Heavier tasks age more slowly: a nice 0 task's vruntime advances at the
+// rate of real time
+void fair_charge(fair_queue_t* queue, fair_node_t* node, uint64_t ns) {
+    bool queued = node->queued;
+    if (queued) fair_queue_remove(queue, node);
+    
+    node->vruntime += ns * SCHED_NICE_0_WEIGHT / node->weight;
+    update_min_vruntime(queue, node);
+    
+    if (queued) fair_queue_add(queue, node);
+}
+
+// The latency target shared out by weight, stretched so no slice drops
+// below the minimum granularity once too many tasks are runnable
+uint64_t fair_slice_ns(fair_queue_t* queue, fair_node_t* node) {
+    uint64_t total = queue->total_weight + (node->queued ? 0 : node->weight);
+    uint64_t runnable = queue->count + (node->queued ? 0 : 1);
+    
+    uint64_t period = tunables.latency_ns;
+    if (runnable * tunables.min_granularity_ns > period) {
+        period = runnable * tunables.min_granularity_ns;
+    }
+    
+    uint64_t slice = period * node->weight / total;
+    return slice < tunables.min_granularity_ns ? tunables.min_granularity_ns : slice;
+}
+
+bool fair_set_tunables(const fair_tunables_t* values) {
+    if (!values->min_granularity_ns || values->min_granularity_ns > values->latency_ns) return false;
+    
+    tunables = *values;
+    return true;
+}
+
+void fair_get_tunables(fair_tunables_t* values) {
+    *values = tunables;
+}
@@ -1,26 +1,84 @@
 #include "kernel.h"
+#include "interrupt.h"
+#include "syscall.h"
+#include "io.h"
 #include "process.h"
+#include "memory.h"
+#include "vma.h"
+#include "cpu.h"
+#include "lapic.h"
+#include "smp.h"
+#include "timer.h"
+
+// Page fault error code bits
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+static void page_fault_handler(interrupt_frame_t* frame) {
+    uint64_t address = read_cr2();
+    
+    // Compaction is moving the frame; the access retries once it is back
+    if (page_is_migrating((page_table_t*)read_cr3(), address)) return;
+    
+    // Not present: first touch of a demand-paged range
+    if (!(frame->err_code & PF_PRESENT)) {
+        process_t* proc = get_current_process();
+        if (proc && vma_handle_fault(proc->vmas, (page_table_t*)read_cr3(), address,
+                                     frame->err_code & PF_WRITE)) {
+            return;
+        }
+    }
+    
+    // Write to a present page: copy-on-write after fork
+    if ((frame->err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE) &&
+       handle_cow_fault((page_table_t*)read_cr3(), address)) {
+        return;
+    }
+    
+    kprintf("Page fault at 0x%lx (rip 0x%lx, error 0x%lx)\n", address, frame->rip, frame->err_code);
+    
+    if (frame->err_code & PF_USER) {
+        process_exit(-1);
+    } else {
+        kernel_panic("Page fault in kernel mode");
+    }
+}
 
 // Central Interrupt Dispatcher
 void handle_interrupt(interrupt_frame_t* frame) {
     uint64_t int_no = frame->int_no;
     
+    // Acknowledge first: a timer interrupt can switch to another thread and
+    // only come back here once this one runs again
+    if (int_no >= 32 && int_no <= 47) {
+        if (int_no >= 40) outb(0xA0, 0x20); // Slave
+        outb(0x20, 0x20); // Master
+    } else if (int_no >= SCHED_IPI_VECTOR && int_no != SPURIOUS_VECTOR) {
+        lapic_eoi();
+    }
+    
     switch (int_no) {
-        case 32: // Timer Interrupt (IRQ 0)
+        case 14: // Page Fault
+            page_fault_handler(frame);
+            break;
+        case 32: // Timer Interrupt (IRQ 0), only without an APIC timer
+        case LAPIC_TIMER_VECTOR:
             timer_handler(frame);
             break;
         case 128: // System Call (int 0x80)
             handle_syscall(frame);
             break;
+        case TLB_SHOOTDOWN_VECTOR:
+            tlb_shootdown_poll();
+            break;
+        case SCHED_IPI_VECTOR:
+            // Nothing to do: waking from hlt sends the scheduler loop back
+            // to its run queue
+            break;
         default:
             // Handle other interrupts (keyboard, mouse, disc)
             // driver_dispatch_interrupt(int_no, frame);
             break;
     }
-    
-    // Acknowledgement for PIC/APIC
-    if (int_no >= 32 && int_no <= 47) {
-        if (int_no >= 40) outb(0xA0, 0x20); // Slave
-        outb(0x20, 0x20); // Master
-    }
 }
@@ -5,7 +5,14 @@
 
 #define MAX_INTERRUPTS 256
 
+// Stack layout built by isr_common_stub
 typedef struct {
+    uint64_t rax, rbx, rcx, rdx;
+    uint64_t rsi, rdi, rbp;
+    uint64_t r8, r9, r10, r11;
+    uint64_t r12, r13, r14, r15;
+    uint64_t int_no;
+    uint64_t err_code;
     uint64_t rip;
     uint64_t cs;
     uint64_t rflags;
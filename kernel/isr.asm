@@ -5,6 +5,14 @@ extern handle_interrupt
 ; This is the core of preemptive multitasking
 ; It saves ALL registers onto the stack, creating an interrupt_frame_t
 isr_common_stub:
+    ; The kernel's rep movs/stos copies run forwards; user code or an
+    ; interrupted std may have left DF set
+    cld
+    ; Coming from user mode, swap in this CPU's cpu_t as the GS base
+    test qword [rsp+24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
     push r15
     push r14
     push r13
@@ -44,4 +52,10 @@ isr_common_stub:
     pop r15
 
     add rsp, 16 ; Skip error code and interrupt number
+
+    ; Returning to user mode, give it back its own GS base
+    test qword [rsp+8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
@@ -0,0 +1,466 @@
+#include "kbench.h"
+#include "kernel.h"
+#include "memory.h"
+#include "proc.h"
+#include "smp.h"
+#include "timer.h"
+#include "clock.h"
+
+static uint64_t tsc_khz;
+
+static kbench_t benchmarks[] = {
+    { "physical_pages", kbench_physical_pages },
+    { "tlb_reach", kbench_tlb_reach },
+    { "memory_copy", kbench_memory_copy },
+    { "context_switch", kbench_context_switch },
+    { "parallel", kbench_parallel },
+    { "timer_sleep", kbench_timer_sleep },
+    { "clock_read", kbench_clock_read },
+    { "fair_queue", kbench_fair_queue },
+};
+
+uint64_t kbench_cycles(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t kbench_cycles_to_ns(uint64_t cycles) {
+    if(tsc_khz == 0) return 0;
+    return cycles * 1000000 / tsc_khz;
+}
+
+void kbench_calibrate(void) {
+    tsc_khz = clock_tsc_khz();
+}
+
+void kbench_run_all(void) {
+    kbench_calibrate();
+    kprintf("kbench: TSC %lu kHz\n", tsc_khz);
+    
+    for(uint32_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        kprintf("kbench: running %s\n", benchmarks[i].name);
+        benchmarks[i].run();
+    }
+}
+
+// Physical page allocator
+
+#define PMM_BENCH_ALLOCS 1024
+
+// Pages taken to raise occupancy are chained through their first word so they
+// can be returned without a side table.
+static uint64_t pmm_fill(uint64_t head, uint64_t pages) {
+    for(uint64_t i = 0; i < pages; i++) {
+        uint64_t page = alloc_physical_page();
+        if(!page) break;
+        *(uint64_t*)page = head;
+        head = page;
+    }
+    return head;
+}
+
+static void pmm_drain(uint64_t head) {
+    while(head) {
+        uint64_t next = *(uint64_t*)head;
+        free_physical_page(head);
+        head = next;
+    }
+}
+
+void kbench_physical_pages(void) {
+    static uint64_t pages[PMM_BENCH_ALLOCS];
+    static const uint32_t occupancy[] = { 10, 50, 90 };
+    
+    uint64_t free_at_start = get_free_physical_pages();
+    uint64_t filled = 0;
+    uint64_t chain = 0;
+    
+    for(uint32_t level = 0; level < 3; level++) {
+        uint64_t target = free_at_start * occupancy[level] / 100;
+        chain = pmm_fill(chain, target - filled);
+        filled = target;
+        
+        uint64_t start = kbench_cycles();
+        for(uint32_t i = 0; i < PMM_BENCH_ALLOCS; i++) {
+            pages[i] = alloc_physical_page();
+        }
+        uint64_t cycles = kbench_cycles() - start;
+        
+        for(uint32_t i = 0; i < PMM_BENCH_ALLOCS; i++) {
+            if(pages[i]) free_physical_page(pages[i]);
+        }
+        
+        kprintf("kbench: alloc_physical_page at %u%% occupancy: %lu ns/alloc\n",
+                occupancy[level], kbench_cycles_to_ns(cycles) / PMM_BENCH_ALLOCS);
+    }
+    
+    pmm_drain(chain);
+}
+
+// TLB reach of 4K versus large-page mappings. Without a free block of
+// TLB_BENCH_SIZE the walk falls back to the largest one down to
+// TLB_BENCH_MIN_SIZE, and says so.
+
+#define TLB_BENCH_SIZE     (256ULL * 1024 * 1024)
+#define TLB_BENCH_MIN_SIZE (16ULL * 1024 * 1024)
+#define TLB_BENCH_WINDOW   0xFFFFB00000000000
+#define TLB_BENCH_PASSES   8
+
+// Touch one line per page, offset so the walk doesn't hit a single cache set
+static uint64_t tlb_walk(volatile uint8_t* base, uint64_t size) {
+    uint64_t start = kbench_cycles();
+    for(uint32_t pass = 0; pass < TLB_BENCH_PASSES; pass++) {
+        for(uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+            (void)base[offset + ((offset >> 12) & 63) * 64];
+        }
+    }
+    return kbench_cycles() - start;
+}
+
+void kbench_tlb_reach(void) {
+    uint64_t size = TLB_BENCH_SIZE;
+    void* buffer = buddy_alloc(get_order(size));
+    while(!buffer && size > TLB_BENCH_MIN_SIZE) {
+        size /= 2;
+        buffer = buddy_alloc(get_order(size));
+    }
+    if(!buffer) {
+        kprintf("kbench: tlb_reach skipped, no %lu MB block\n", TLB_BENCH_MIN_SIZE >> 20);
+        return;
+    }
+    if(size != TLB_BENCH_SIZE) {
+        kprintf("kbench: tlb_reach: no %lu MB block, walking %lu MB\n",
+                TLB_BENCH_SIZE >> 20, size >> 20);
+    }
+    
+    uint64_t phys = (uint64_t)buffer;
+    page_table_t* pml4 = get_kernel_page_table();
+    
+    // Same physical range through a 4K-only window
+    for(uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        map_page(pml4, TLB_BENCH_WINDOW + offset, phys + offset, PAGE_PRESENT | PAGE_WRITABLE);
+    }
+    
+    uint64_t accesses = TLB_BENCH_PASSES * (size / PAGE_SIZE);
+    uint64_t small = tlb_walk((volatile uint8_t*)TLB_BENCH_WINDOW, size);
+    uint64_t large = tlb_walk((volatile uint8_t*)(PHYS_MAP_BASE + phys), size);
+    
+    kprintf("kbench: %lu MB strided walk, 4K pages: %lu cycles/access, direct map: %lu cycles/access\n",
+            size >> 20, small / accesses, large / accesses);
+    
+    // The window's page tables go too
+    unmap_range(pml4, TLB_BENCH_WINDOW, size);
+    buddy_free(buffer, get_order(size));
+}
+
+// memory_copy / memory_set throughput across sizes
+
+#define COPY_BENCH_MAX   (8ULL * 1024 * 1024)
+#define COPY_BENCH_BYTES (64ULL * 1024 * 1024) // Moved per size
+
+void kbench_memory_copy(void) {
+    uint32_t order = get_order(COPY_BENCH_MAX * 2);
+    uint8_t* buffer = buddy_alloc(order);
+    if(!buffer) {
+        kprintf("kbench: memory_copy skipped, no %lu MB block\n", (COPY_BENCH_MAX * 2) >> 20);
+        return;
+    }
+    
+    uint8_t* src = buffer;
+    uint8_t* dst = buffer + COPY_BENCH_MAX;
+    memory_set(src, 0x5A, COPY_BENCH_MAX);
+    
+    static const uint64_t sizes[] = {
+        16, 64, 256, 1024, 4096, 16384, 65536, 262144,
+        1024 * 1024, 4 * 1024 * 1024, COPY_BENCH_MAX
+    };
+    
+    for(uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t size = sizes[i];
+        uint64_t iterations = COPY_BENCH_BYTES / size;
+        
+        uint64_t start = kbench_cycles();
+        for(uint64_t n = 0; n < iterations; n++) {
+            memory_copy(dst, src, size);
+        }
+        uint64_t copy_ns = kbench_cycles_to_ns(kbench_cycles() - start);
+        
+        start = kbench_cycles();
+        for(uint64_t n = 0; n < iterations; n++) {
+            memory_set(dst, (uint8_t)n, size);
+        }
+        uint64_t set_ns = kbench_cycles_to_ns(kbench_cycles() - start);
+        
+        // bytes per ns * 1000 = MB/s
+        kprintf("kbench: %lu B: copy %lu MB/s (%lu ns/op), set %lu MB/s\n",
+                size,
+                copy_ns ? COPY_BENCH_BYTES * 1000 / copy_ns : 0,
+                copy_ns / iterations,
+                set_ns ? COPY_BENCH_BYTES * 1000 / set_ns : 0);
+    }
+    
+    buddy_free(buffer, order);
+}
+
+// Context switches between two kernel threads that yield back and forth
+
+#define SWITCH_BENCH_ROUNDS 100000
+
+static volatile uint64_t switch_rounds_left;
+static volatile bool switch_go;
+
+// Each pass hands the CPU to the other thread through the scheduler loop
+static void switch_bench_thread(void) {
+    // Another CPU may start a thread before it is pinned; wait until both are
+    while(!switch_go) scheduler_yield();
+    
+    while(switch_rounds_left) {
+        switch_rounds_left--;
+        scheduler_yield();
+    }
+    
+    proc_exit(0);
+    scheduler_yield();
+}
+
+void kbench_context_switch(void) {
+    process_t* threads[2];
+    switch_rounds_left = SWITCH_BENCH_ROUNDS;
+    switch_go = false;
+    threads[0] = proc_create_kthread("kbench-ping", switch_bench_thread);
+    threads[1] = proc_create_kthread("kbench-pong", switch_bench_thread);
+    
+    bool ready = threads[0] && threads[1];
+    if(ready) {
+        // Above every other kernel thread, so only the pair runs, and both
+        // on this CPU so each switch is a real handoff
+        for(uint32_t i = 0; i < 2; i++) {
+            sched_set_priority(threads[i], 0);
+            sched_set_affinity(threads[i], 1ULL << cpu_id());
+        }
+    } else {
+        // Let whichever thread did start exit straight away
+        kprintf("kbench: context_switch skipped, no process slots\n");
+        switch_rounds_left = 0;
+    }
+    
+    switch_go = true;
+    uint64_t start = kbench_cycles();
+    for(uint32_t i = 0; i < 2; i++) {
+        while(threads[i] && threads[i]->state != PROC_STATE_ZOMBIE) {
+            scheduler_run_next();
+        }
+    }
+    uint64_t ns = kbench_cycles_to_ns(kbench_cycles() - start);
+    
+    if(ready) {
+        kprintf("kbench: context_switch: %lu ns/switch, %lu switches/sec\n",
+                ns / SWITCH_BENCH_ROUNDS,
+                ns ? SWITCH_BENCH_ROUNDS * 1000000000ULL / ns : 0);
+    }
+    
+    for(uint32_t i = 0; i < 2; i++) {
+        if(threads[i]) proc_reap(threads[i]);
+    }
+}
+
+// The same CPU-bound work done by one thread, then split across one thread
+// per CPU; idle CPUs pick the threads up through work stealing
+
+#define PARALLEL_BENCH_ITERATIONS (1ULL << 26)
+#define PARALLEL_BENCH_CHUNK      (1ULL << 16) // Iterations between yields
+
+static volatile uint64_t parallel_share;
+static volatile uint64_t parallel_sink;
+
+static void parallel_bench_thread(void) {
+    uint64_t hash = cpu_id() + 1;
+    for(uint64_t done = 0; done < parallel_share; done += PARALLEL_BENCH_CHUNK) {
+        for(uint64_t i = 0; i < PARALLEL_BENCH_CHUNK; i++) {
+            hash = hash * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        scheduler_yield();
+    }
+    
+    __atomic_fetch_add(&parallel_sink, hash, __ATOMIC_RELAXED);
+    proc_exit(0);
+    scheduler_yield();
+}
+
+// Nanoseconds for count threads to share the work, 0 if they could not start
+static uint64_t parallel_run(uint32_t count) {
+    process_t* threads[MAX_CPUS];
+    parallel_share = PARALLEL_BENCH_ITERATIONS / count;
+    
+    uint32_t started = 0;
+    uint64_t start = kbench_cycles();
+    for(; started < count; started++) {
+        threads[started] = proc_create_kthread("kbench-parallel", parallel_bench_thread);
+        if(!threads[started]) break;
+    }
+    
+    // This CPU takes its share of the threads too
+    for(uint32_t i = 0; i < started; i++) {
+        while(threads[i]->state != PROC_STATE_ZOMBIE) {
+            if(!scheduler_run_next()) __asm__ __volatile__ ("pause");
+        }
+    }
+    uint64_t ns = kbench_cycles_to_ns(kbench_cycles() - start);
+    
+    for(uint32_t i = 0; i < started; i++) {
+        proc_reap(threads[i]);
+    }
+    return started == count ? ns : 0;
+}
+
+void kbench_parallel(void) {
+    uint32_t cpus = smp_cpu_count();
+    uint64_t serial_ns = parallel_run(1);
+    uint64_t parallel_ns = cpus > 1 ? parallel_run(cpus) : serial_ns;
+    if(!serial_ns || !parallel_ns) {
+        kprintf("kbench: parallel skipped, no process slots\n");
+        return;
+    }
+    
+    // Speedup in hundredths
+    uint64_t speedup = serial_ns * 100 / parallel_ns;
+    kprintf("kbench: parallel: 1 CPU %lu ms, %u CPUs %lu ms, speedup %lu.%02lu\n",
+            serial_ns / 1000000, cpus, parallel_ns / 1000000,
+            speedup / 100, speedup % 100);
+    
+    for(uint32_t i = 0; i < cpus; i++) {
+        cpu_t* cpu = smp_cpu(i);
+        kprintf("kbench: cpu%u: %lu switches, %lu steals, %lu pulls, %lu timer interrupts\n",
+                i, cpu->switches, cpu->steals, cpu->pulls, cpu->timer_interrupts);
+    }
+}
+
+// How late one-shot timers wake a sleeping thread, at a sub-millisecond
+// interval a periodic tick could not give
+
+#define SLEEP_BENCH_ROUNDS 200
+#define SLEEP_BENCH_NS     200000
+
+static volatile uint64_t sleep_late_cycles;
+static volatile uint64_t sleep_worst_cycles;
+
+static void sleep_bench_thread(void) {
+    uint64_t interval = clock_ns_to_tsc(SLEEP_BENCH_NS);
+    for(uint32_t i = 0; i < SLEEP_BENCH_ROUNDS; i++) {
+        uint64_t start = kbench_cycles();
+        proc_sleep_ns(SLEEP_BENCH_NS);
+        uint64_t slept = kbench_cycles() - start;
+        
+        uint64_t late = slept > interval ? slept - interval : 0;
+        sleep_late_cycles += late;
+        if(late > sleep_worst_cycles) sleep_worst_cycles = late;
+    }
+    
+    proc_exit(0);
+    scheduler_yield();
+}
+
+void kbench_timer_sleep(void) {
+    sleep_late_cycles = 0;
+    sleep_worst_cycles = 0;
+    
+    process_t* thread = proc_create_kthread("kbench-sleep", sleep_bench_thread);
+    if(!thread) {
+        kprintf("kbench: timer_sleep skipped, no process slots\n");
+        return;
+    }
+    
+    while(thread->state != PROC_STATE_ZOMBIE) {
+        if(!scheduler_run_next()) __asm__ __volatile__ ("pause");
+    }
+    proc_reap(thread);
+    
+    kprintf("kbench: timer_sleep: %u us sleeps wake %lu ns late on average, %lu ns at worst\n",
+            SLEEP_BENCH_NS / 1000,
+            kbench_cycles_to_ns(sleep_late_cycles / SLEEP_BENCH_ROUNDS),
+            kbench_cycles_to_ns(sleep_worst_cycles));
+}
+
+// Cost of one nanosecond timestamp, and that successive ones never go back
+
+#define CLOCK_BENCH_READS 1000000
+
+void kbench_clock_read(void) {
+    uint64_t start = kbench_cycles();
+    for(uint32_t i = 0; i < CLOCK_BENCH_READS; i++) {
+        clock_monotonic_ns();
+    }
+    uint64_t ns = kbench_cycles_to_ns(kbench_cycles() - start);
+    
+    uint64_t previous = clock_monotonic_ns();
+    bool monotonic = true;
+    for(uint32_t i = 0; i < CLOCK_BENCH_READS / 10; i++) {
+        uint64_t now = clock_monotonic_ns();
+        if(now < previous) monotonic = false;
+        previous = now;
+    }
+    
+    kprintf("kbench: clock_read: %lu.%02lu ns/read%s\n",
+            ns / CLOCK_BENCH_READS, ns * 100 / CLOCK_BENCH_READS % 100,
+            monotonic ? "" : ", went backwards");
+}
+
+// Fair-share queue: the cost of picking and requeueing as the tree grows,
+// and how a simulated CPU divides between a hog at the default level and
+// an interactive task one level up
+
+#define FAIR_BENCH_TASKS  1024
+#define FAIR_BENCH_ROUNDS 100000
+
+void kbench_fair_queue(void) {
+    static fair_node_t nodes[FAIR_BENCH_TASKS];
+    static const uint32_t sizes[] = { 4, 64, FAIR_BENCH_TASKS };
+    fair_queue_t queue;
+    
+    for(uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fair_queue_init(&queue);
+        for(uint32_t n = 0; n < sizes[i]; n++) {
+            fair_node_init(&queue, &nodes[n], n % SCHED_PRIORITY_LEVELS);
+            fair_queue_add(&queue, &nodes[n]);
+        }
+        
+        uint64_t start = kbench_cycles();
+        for(uint32_t round = 0; round < FAIR_BENCH_ROUNDS; round++) {
+            fair_node_t* node = fair_queue_pop(&queue);
+            fair_charge(&queue, node, fair_slice_ns(&queue, node));
+            fair_queue_add(&queue, node);
+        }
+        uint64_t ns = kbench_cycles_to_ns(kbench_cycles() - start);
+        
+        kprintf("kbench: fair_queue: %u tasks, %lu ns per pick and requeue\n",
+                sizes[i], ns / FAIR_BENCH_ROUNDS);
+    }
+    
+    fair_queue_init(&queue);
+    fair_node_t* hog = &nodes[0];
+    fair_node_t* interactive = &nodes[1];
+    fair_node_init(&queue, hog, SCHED_DEFAULT_PRIORITY);
+    fair_node_init(&queue, interactive, SCHED_DEFAULT_PRIORITY - 1);
+    fair_queue_add(&queue, hog);
+    fair_queue_add(&queue, interactive);
+    
+    uint64_t hog_ns = 0;
+    uint64_t interactive_ns = 0;
+    for(uint32_t round = 0; round < FAIR_BENCH_ROUNDS; round++) {
+        fair_node_t* node = fair_queue_pop(&queue);
+        uint64_t slice = fair_slice_ns(&queue, node);
+        fair_charge(&queue, node, slice);
+        fair_queue_add(&queue, node);
+        
+        if(node == hog) {
+            hog_ns += slice;
+        } else {
+            interactive_ns += slice;
+        }
+    }
+    
+    kprintf("kbench: fair_queue: level %u gets %lu%% of the CPU beside a hog at level %u\n",
+            SCHED_DEFAULT_PRIORITY - 1, interactive_ns * 100 / (hog_ns + interactive_ns),
+            SCHED_DEFAULT_PRIORITY);
+}
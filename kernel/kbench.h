@@ -0,0 +1,32 @@
+#ifndef KBENCH_H
+#define KBENCH_H
+
+#include <stdint.h>
+
+// Boot-time microbenchmarks, built with `make KBENCH=1`
+
+typedef void (*kbench_func_t)(void);
+
+typedef struct {
+    const char* name;
+    kbench_func_t run;
+} kbench_t;
+
+void kbench_calibrate(void);
+void kbench_run_all(void);
+
+// Timing helpers
+uint64_t kbench_cycles(void);
+uint64_t kbench_cycles_to_ns(uint64_t cycles);
+
+// Benchmarks
+void kbench_physical_pages(void);
+void kbench_tlb_reach(void);
+void kbench_memory_copy(void);
+void kbench_context_switch(void);
+void kbench_parallel(void);
+void kbench_timer_sleep(void);
+void kbench_clock_read(void);
+void kbench_fair_queue(void);
+
+#endif
@@ -97,5 +97,6 @@ void scheduler_start(void);
 void console_write(const char* str);
 void gui_emergency_mode(void);
 int vsprintf(char* buffer, const char* format, va_list args);
+uint64_t get_system_time(void);
 
 #endif
\ No newline at end of file
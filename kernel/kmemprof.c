@@ -0,0 +1,264 @@
+#include "kmemprof.h"
+
+#ifdef CONFIG_KMEMPROF
+
+#include "memory.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Single producer, single consumer: only the owning CPU writes, with
+// interrupts off, and drains hold kmemprof_lock
+typedef struct {
+    kmemprof_event_t events[KMEMPROF_RING_SIZE];
+    uint32_t head; // Next slot the owner writes
+    uint32_t tail; // Next slot a drain reads
+    uint64_t dropped;
+} kmemprof_ring_t;
+
+typedef struct {
+    uint64_t ptr; // 0 for an empty slot
+    uint64_t timestamp;
+    uint32_t size;
+    uint32_t site;
+} kmemprof_object_t;
+
+static kmemprof_ring_t rings[MAX_CPUS];
+static kmemprof_site_t sites[KMEMPROF_SITES];
+static kmemprof_object_t objects[KMEMPROF_OBJECTS];
+static uint32_t object_count;
+static kmemprof_stats_t totals;
+static spinlock_t kmemprof_lock = SPINLOCK_INIT;
+
+void kmemprof_record(uint32_t kind, void* ptr, uint64_t size, void* caller) {
+    uint64_t flags = irq_save();
+    kmemprof_ring_t* ring = &rings[cpu_id()];
+    uint32_t head = ring->head;
+    
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= KMEMPROF_RING_SIZE) {
+        ring->dropped++;
+    } else {
+        kmemprof_event_t* event = &ring->events[head % KMEMPROF_RING_SIZE];
+        event->caller = (uint64_t)caller;
+        event->ptr = (uint64_t)ptr;
+        event->timestamp = get_system_time();
+        event->size = (uint32_t)size;
+        event->kind = kind;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    
+    irq_restore(flags);
+}
+
+static inline uint32_t kmemprof_hash(uint64_t key, uint32_t buckets) {
+    return (uint32_t)(((key >> 4) * 0x9E3779B97F4A7C15ULL) >> 40) % buckets;
+}
+
+// Slot 0 collects the sites that found the table full
+static uint32_t kmemprof_site(uint64_t caller, uint32_t kind) {
+    uint32_t index = kmemprof_hash(caller, KMEMPROF_SITES - 1) + 1;
+    
+    for(uint32_t probe = 0; probe < KMEMPROF_SITES - 1; probe++) {
+        kmemprof_site_t* site = &sites[index];
+        if(site->caller == caller) return index;
+        if(site->caller == 0) {
+            site->caller = caller;
+            site->kind = kind;
+            totals.sites++;
+            return index;
+        }
+        index = index == KMEMPROF_SITES - 1 ? 1 : index + 1;
+    }
+    
+    return 0;
+}
+
+static kmemprof_object_t* kmemprof_find(uint64_t ptr) {
+    uint32_t index = kmemprof_hash(ptr, KMEMPROF_OBJECTS);
+    
+    while(objects[index].ptr) {
+        if(objects[index].ptr == ptr) return &objects[index];
+        index = (index + 1) % KMEMPROF_OBJECTS;
+    }
+    
+    return NULL;
+}
+
+// Linear probing delete: pull later entries of the run back over the hole
+// so lookups never stop early
+static void kmemprof_remove(kmemprof_object_t* object) {
+    uint32_t hole = (uint32_t)(object - objects);
+    uint32_t index = hole;
+    
+    while(true) {
+        index = (index + 1) % KMEMPROF_OBJECTS;
+        if(!objects[index].ptr) break;
+        
+        uint32_t home = kmemprof_hash(objects[index].ptr, KMEMPROF_OBJECTS);
+        bool movable = hole <= index ? (home <= hole || home > index) : (home <= hole && home > index);
+        if(movable) {
+            objects[hole] = objects[index];
+            hole = index;
+        }
+    }
+    
+    objects[hole].ptr = 0;
+    object_count--;
+}
+
+static void kmemprof_account_free(kmemprof_object_t* object) {
+    kmemprof_site_t* site = &sites[object->site];
+    site->frees++;
+    site->live_bytes -= object->size;
+    site->live_objects--;
+    totals.live_bytes -= object->size;
+    totals.live_objects--;
+    kmemprof_remove(object);
+}
+
+static void kmemprof_account(kmemprof_event_t* event) {
+    totals.events++;
+    
+    kmemprof_object_t* object = kmemprof_find(event->ptr);
+    if(event->kind == KMEMPROF_FREE) {
+        if(object) kmemprof_account_free(object);
+        else totals.unknown_frees++;
+        return;
+    }
+    
+    // Reused without a free we saw: the free was dropped
+    if(object) kmemprof_account_free(object);
+    
+    uint32_t index = kmemprof_site(event->caller, event->kind);
+    kmemprof_site_t* site = &sites[index];
+    site->allocs++;
+    site->bytes += event->size;
+    
+    uint32_t bucket = event->size ? 63 - __builtin_clzll(event->size) : 0;
+    if(bucket >= KMEMPROF_HIST_BUCKETS) bucket = KMEMPROF_HIST_BUCKETS - 1;
+    totals.histogram[bucket]++;
+    
+    // Keep the table under 7/8 full so probe runs stay short
+    if(object_count >= KMEMPROF_OBJECTS / 8 * 7) {
+        totals.untracked++;
+        return;
+    }
+    
+    uint32_t slot = kmemprof_hash(event->ptr, KMEMPROF_OBJECTS);
+    while(objects[slot].ptr) slot = (slot + 1) % KMEMPROF_OBJECTS;
+    
+    objects[slot].ptr = event->ptr;
+    objects[slot].timestamp = event->timestamp;
+    objects[slot].size = event->size;
+    objects[slot].site = index;
+    object_count++;
+    
+    site->live_bytes += event->size;
+    site->live_objects++;
+    totals.live_bytes += event->size;
+    totals.live_objects++;
+}
+
+// Callers hold kmemprof_lock
+static bool kmemprof_drain_locked(void) {
+    bool drained = false;
+    
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        kmemprof_ring_t* ring = &rings[cpu];
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+        
+        for(; tail != head; tail++) {
+            kmemprof_account(&ring->events[tail % KMEMPROF_RING_SIZE]);
+            drained = true;
+        }
+        
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    
+    return drained;
+}
+
+// Fold the rings into the tables. Called from the idle loop; returns
+// false once there was nothing to do.
+bool kmemprof_drain(void) {
+    uint64_t flags = irq_save();
+    spin_lock(&kmemprof_lock);
+    bool drained = kmemprof_drain_locked();
+    spin_unlock(&kmemprof_lock);
+    irq_restore(flags);
+    
+    return drained;
+}
+
+// Start the totals and histogram over. Live objects stay tracked so their
+// frees still balance.
+void kmemprof_reset(void) {
+    uint64_t flags = irq_save();
+    spin_lock(&kmemprof_lock);
+    
+    kmemprof_drain_locked();
+    
+    for(uint32_t i = 0; i < KMEMPROF_SITES; i++) {
+        sites[i].allocs = sites[i].live_objects;
+        sites[i].frees = 0;
+        sites[i].bytes = sites[i].live_bytes;
+    }
+    
+    totals.events = 0;
+    totals.untracked = 0;
+    totals.unknown_frees = 0;
+    memory_set(totals.histogram, 0, sizeof(totals.histogram));
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) rings[cpu].dropped = 0;
+    
+    spin_unlock(&kmemprof_lock);
+    irq_restore(flags);
+}
+
+// Copy out up to max sites, most live bytes first, ages worked out now
+uint32_t kmemprof_get_sites(kmemprof_site_t* out, uint32_t max, kmemprof_stats_t* stats) {
+    uint64_t now = get_system_time();
+    uint32_t count = 0;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&kmemprof_lock);
+    
+    kmemprof_drain_locked();
+    
+    for(uint32_t i = 0; i < KMEMPROF_SITES; i++) {
+        sites[i].long_lived = 0;
+        sites[i].oldest_ms = 0;
+    }
+    
+    for(uint32_t i = 0; i < KMEMPROF_OBJECTS; i++) {
+        if(!objects[i].ptr) continue;
+        
+        kmemprof_site_t* site = &sites[objects[i].site];
+        uint64_t age = now - objects[i].timestamp;
+        if(age > KMEMPROF_LONG_LIVED_MS) site->long_lived++;
+        if(age > site->oldest_ms) site->oldest_ms = age;
+    }
+    
+    // Insertion into a sorted window of the top max
+    for(uint32_t i = 0; i < KMEMPROF_SITES; i++) {
+        if(!sites[i].allocs) continue;
+        
+        uint32_t position = count < max ? count++ : max;
+        while(position > 0 && out[position - 1].live_bytes < sites[i].live_bytes) {
+            if(position < max) out[position] = out[position - 1];
+            position--;
+        }
+        if(position < max) out[position] = sites[i];
+    }
+    
+    if(stats) {
+        *stats = totals;
+        for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) stats->dropped += rings[cpu].dropped;
+    }
+    
+    spin_unlock(&kmemprof_lock);
+    irq_restore(flags);
+    
+    return count;
+}
+
+#endif
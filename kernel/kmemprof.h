@@ -0,0 +1,77 @@
+#ifndef KMEMPROF_H
+#define KMEMPROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Kernel heap profiler, built with `make KMEMPROF=1`. kmalloc, slab_alloc
+// and buddy_alloc log every allocation and free into a ring owned by the
+// CPU; the idle loop, or anyone reading the results, folds the rings into
+// per-call-site totals, a size histogram and a table of live objects.
+// Without CONFIG_KMEMPROF the hooks compile to nothing.
+
+#define KMEMPROF_RING_SIZE     2048  // Events a CPU can log between drains
+#define KMEMPROF_SITES         1024  // Call sites tracked; the rest share slot 0
+#define KMEMPROF_OBJECTS       32768 // Live allocations tracked
+#define KMEMPROF_HIST_BUCKETS  24    // Power-of-two size buckets, 1 B up to 8 MB
+#define KMEMPROF_LONG_LIVED_MS 10000 // Alive longer than this counts as long-lived
+
+// Where an event came from
+#define KMEMPROF_KMALLOC 0
+#define KMEMPROF_SLAB    1
+#define KMEMPROF_BUDDY   2
+#define KMEMPROF_FREE    3
+
+typedef struct {
+    uint64_t caller;    // Return address into the allocating code
+    uint64_t ptr;
+    uint64_t timestamp; // get_system_time() when it happened
+    uint32_t size;
+    uint32_t kind;
+} kmemprof_event_t;
+
+typedef struct {
+    uint64_t caller; // 0 for sites that didn't fit in the table
+    uint32_t kind;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;        // Allocated since the last reset
+    uint64_t live_bytes;
+    uint64_t live_objects;
+    uint64_t long_lived;   // Live objects older than KMEMPROF_LONG_LIVED_MS
+    uint64_t oldest_ms;    // Age of the oldest live object
+} kmemprof_site_t;
+
+typedef struct {
+    uint64_t events;
+    uint64_t dropped;       // Logged while the CPU's ring was full
+    uint64_t untracked;     // Allocations the object table had no room for
+    uint64_t unknown_frees; // Frees of pointers not in the object table
+    uint64_t live_bytes;
+    uint64_t live_objects;
+    uint64_t histogram[KMEMPROF_HIST_BUCKETS]; // Allocations by size, bucket n holds [2^n, 2^(n+1))
+    uint32_t sites;
+} kmemprof_stats_t;
+
+#ifdef CONFIG_KMEMPROF
+
+void kmemprof_record(uint32_t kind, void* ptr, uint64_t size, void* caller);
+bool kmemprof_drain(void);
+void kmemprof_reset(void);
+uint32_t kmemprof_get_sites(kmemprof_site_t* sites, uint32_t max, kmemprof_stats_t* stats);
+
+// Expanded inside the allocator entry points, so the caller is theirs
+#define kmemprof_alloc(kind, ptr, size) \
+    do { if(ptr) kmemprof_record(kind, ptr, size, __builtin_return_address(0)); } while(0)
+#define kmemprof_free(ptr) \
+    do { if(ptr) kmemprof_record(KMEMPROF_FREE, ptr, 0, NULL); } while(0)
+
+#else
+
+#define kmemprof_alloc(kind, ptr, size) ((void)0)
+#define kmemprof_free(ptr) ((void)0)
+static inline bool kmemprof_drain(void) { return false; }
+
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+#include <stddef.h>
+#include "lapic.h"
+#include "memory.h"
+#include "cpu.h"
+
+static volatile uint32_t* lapic_base;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic_base[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_base[reg / 4] = value;
+}
+
+// The APIC page sits in the MMIO hole above RAM, outside the identity map;
+// map it uncached unless it already is
+void lapic_init(uint64_t base) {
+    page_table_t* kernel = get_kernel_page_table();
+    if(!get_physical_address(kernel, base)) {
+        map_page(kernel, base, base, PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLE | PAGE_NO_EXECUTE);
+    }
+    
+    // Make sure the APIC is globally enabled at the address we mapped
+    write_msr(MSR_APIC_BASE, (read_msr(MSR_APIC_BASE) & 0xFFF) | (1 << 11) | base);
+    lapic_base = (volatile uint32_t*)base;
+}
+
+bool lapic_present(void) {
+    return lapic_base != NULL;
+}
+
+void lapic_enable(void) {
+    if(!lapic_base) return;
+    
+    write_msr(MSR_APIC_BASE, read_msr(MSR_APIC_BASE) | (1 << 11));
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_base ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+void lapic_eoi(void) {
+    if(lapic_base) lapic_write(LAPIC_EOI, 0);
+}
+
+// Writing the low half sends; wait until the APIC has taken the last one
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    if(!lapic_base) return;
+    
+    uint64_t flags = irq_save();
+    while(lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        __asm__ __volatile__ ("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    irq_restore(flags);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    if(!lapic_base) return;
+    
+    lapic_write(LAPIC_ESR, 0);
+    lapic_send(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+}
+
+// The target starts in real mode at page << 12
+void lapic_send_startup(uint32_t apic_id, uint8_t page) {
+    lapic_send(apic_id, ICR_STARTUP | page);
+}
+
+void lapic_timer_setup(uint32_t mode) {
+    if(!lapic_base) return;
+    
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, mode | LAPIC_TIMER_VECTOR);
+}
+
+void lapic_timer_start(uint32_t count) {
+    if(lapic_base) lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_remaining(void) {
+    return lapic_base ? lapic_read(LAPIC_TIMER_CURRENT) : 0;
+}
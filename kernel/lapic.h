@@ -0,0 +1,68 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC in xAPIC mode, through its MMIO page. Every CPU sees its own
+// APIC at the same address.
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+// Register offsets
+#define LAPIC_ID       0x020
+#define LAPIC_VERSION  0x030
+#define LAPIC_TPR      0x080
+#define LAPIC_EOI      0x0B0
+#define LAPIC_SVR      0x0F0
+#define LAPIC_ESR      0x280
+#define LAPIC_ICR_LOW  0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+
+// Interrupt command register
+#define ICR_INIT      0x00000500
+#define ICR_STARTUP   0x00000600
+#define ICR_PENDING   0x00001000 // Delivery status: not yet accepted
+#define ICR_ASSERT    0x00004000
+#define ICR_LEVEL     0x00008000
+
+// Timer local vector table entry
+#define LVT_MASKED             0x00010000
+#define LVT_TIMER_ONESHOT      0x00000000
+#define LVT_TIMER_TSC_DEADLINE 0x00040000 // Fires when the TSC reaches MSR_TSC_DEADLINE
+
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+// Vectors the kernel takes from the local APIC
+#define SCHED_IPI_VECTOR   0xF0 // Wakes a CPU to look at its run queue
+#define LAPIC_TIMER_VECTOR 0xF1
+#define TLB_SHOOTDOWN_VECTOR 0xF2 // Another CPU changed page tables this one may cache
+#define SPURIOUS_VECTOR    0xFF // Must not be acknowledged
+
+// Map the APIC page; called once, on the BSP
+void lapic_init(uint64_t base);
+bool lapic_present(void);
+
+// Per CPU: software-enable this CPU's APIC
+void lapic_enable(void);
+
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t page);
+
+// This CPU's timer, counting down at the bus clock / 16 unless in
+// TSC-deadline mode. Starting it with a count of 0 stops it.
+void lapic_timer_setup(uint32_t mode);
+void lapic_timer_start(uint32_t count);
+uint32_t lapic_timer_remaining(void);
+
+#endif
@@ -7,17 +7,30 @@
 #include "gui.h"
 #include "network.h"
 #include "security.h"
+#include "kbench.h"
+#include "reclaim.h"
+#include "smp.h"
+#include "clock.h"
+#include "vdso.h"
 
 // Kernel entry point called from bootloader
 void kernel_main(void) {
+    // Per-CPU data first: anything may ask which CPU it runs on. Then the
+    // clock, since anything may ask the time.
+    smp_early_init();
+    clock_init();
+    
     // Initialize core subsystems
     memory_init();
+    vdso_init();
     interrupt_init();
     process_init(); // New multi-process management
+    kswapd_init();  // Background reclaim thread
     
     // Initialize hardware drivers
     driver_init();
     setup_scheduler_timer(); // Start preemption
+    smp_init();              // Bring up the other CPUs' scheduler loops
     
     // Initialize file system
     fs_init();
@@ -28,6 +41,11 @@ void kernel_main(void) {
     
     // Initialize GUI system
     gui_init();
+
+#ifdef CONFIG_KBENCH
+    // Run boot-time microbenchmarks before any user load exists
+    kbench_run_all();
+#endif
     
     // Start system processes
     start_system_processes();
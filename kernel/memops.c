@@ -0,0 +1,198 @@
+#include "memory.h"
+#include "kernel.h"
+#include "cpu.h"
+
+// Block copy and fill primitives. The kernel is built without SSE, so the
+// fast paths are string instructions and 8-byte general-purpose moves. The
+// strategy is picked once from CPUID in memory_ops_init(); until then the
+// conservative paths are used, which is what early boot runs on.
+
+// Below this size an unrolled 8-byte loop beats the startup cost of rep
+// movs on CPUs without fast short rep movsb
+#define COPY_SMALL_MAX 128
+
+// Copies this large would evict the whole cache for data that is written
+// once (framebuffer blits, bulk buffers); stream them past the cache
+#define COPY_STREAM_MIN (1024 * 1024)
+
+// CPUID.(EAX=7,ECX=0)
+#define CPUID_EBX_ERMS (1 << 9) // Enhanced rep movsb/stosb
+#define CPUID_EDX_FSRM (1 << 4) // Fast short rep movsb
+
+// Stop GCC from turning the fallback loops back into calls to memcpy/memset
+#define NO_LOOP_CALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+static bool has_erms;
+static size_t rep_min = COPY_SMALL_MAX;
+
+void memory_ops_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if(eax >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        has_erms = ebx & CPUID_EBX_ERMS;
+        
+        // With FSRM even short copies are cheapest as a single rep movsb
+        if(has_erms && (edx & CPUID_EDX_FSRM)) rep_min = 16;
+    }
+    
+    kprintf("memops: %s, rep threshold %lu bytes, streaming from %u KB\n",
+            has_erms ? "ERMS rep movsb/stosb" : "rep movsq/stosq",
+            (uint64_t)rep_min, COPY_STREAM_MIN / 1024);
+}
+
+static NO_LOOP_CALLS void copy_small(uint8_t* d, const uint8_t* s, size_t size) {
+    while(size >= 8) {
+        *(unaligned_u64*)d = *(const unaligned_u64*)s;
+        d += 8;
+        s += 8;
+        size -= 8;
+    }
+    while(size--) *d++ = *s++;
+}
+
+static inline void copy_rep(uint8_t* d, const uint8_t* s, size_t size) {
+    if(has_erms) {
+        __asm__ __volatile__ ("rep movsb"
+                              : "+D"(d), "+S"(s), "+c"(size)
+                              : : "memory");
+        return;
+    }
+    
+    size_t qwords = size / 8;
+    __asm__ __volatile__ ("rep movsq"
+                          : "+D"(d), "+S"(s), "+c"(qwords)
+                          : : "memory");
+    copy_small(d, s, size & 7);
+}
+
+// Non-temporal 8-byte stores (movnti only needs general-purpose registers)
+// write-combine straight to memory instead of filling the cache
+static NO_LOOP_CALLS void copy_stream(uint8_t* d, const uint8_t* s, size_t size) {
+    size_t head = (8 - ((uint64_t)d & 7)) & 7;
+    copy_small(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    
+    while(size >= 32) {
+        uint64_t a = ((const unaligned_u64*)s)[0];
+        uint64_t b = ((const unaligned_u64*)s)[1];
+        uint64_t c = ((const unaligned_u64*)s)[2];
+        uint64_t e = ((const unaligned_u64*)s)[3];
+        __asm__ __volatile__ ("movnti %1, 0(%0)\n\t"
+                              "movnti %2, 8(%0)\n\t"
+                              "movnti %3, 16(%0)\n\t"
+                              "movnti %4, 24(%0)"
+                              : : "r"(d), "r"(a), "r"(b), "r"(c), "r"(e)
+                              : "memory");
+        d += 32;
+        s += 32;
+        size -= 32;
+    }
+    
+    __asm__ __volatile__ ("sfence" : : : "memory");
+    copy_small(d, s, size);
+}
+
+void memory_copy(void* dest, const void* src, size_t size) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    
+    if(size < rep_min) {
+        copy_small(d, s, size);
+    } else if(size >= COPY_STREAM_MIN) {
+        copy_stream(d, s, size);
+    } else {
+        copy_rep(d, s, size);
+    }
+}
+
+static NO_LOOP_CALLS void set_small(uint8_t* p, uint64_t pattern, size_t size) {
+    while(size >= 8) {
+        *(unaligned_u64*)p = pattern;
+        p += 8;
+        size -= 8;
+    }
+    while(size--) *p++ = (uint8_t)pattern;
+}
+
+static NO_LOOP_CALLS void set_stream(uint8_t* p, uint64_t pattern, size_t size) {
+    size_t head = (8 - ((uint64_t)p & 7)) & 7;
+    set_small(p, pattern, head);
+    p += head;
+    size -= head;
+    
+    while(size >= 32) {
+        __asm__ __volatile__ ("movnti %1, 0(%0)\n\t"
+                              "movnti %1, 8(%0)\n\t"
+                              "movnti %1, 16(%0)\n\t"
+                              "movnti %1, 24(%0)"
+                              : : "r"(p), "r"(pattern)
+                              : "memory");
+        p += 32;
+        size -= 32;
+    }
+    
+    __asm__ __volatile__ ("sfence" : : : "memory");
+    set_small(p, pattern, size);
+}
+
+void memory_set(void* ptr, uint8_t value, size_t size) {
+    uint8_t* p = (uint8_t*)ptr;
+    uint64_t pattern = value * 0x0101010101010101ULL;
+    
+    if(size < rep_min) {
+        set_small(p, pattern, size);
+    } else if(size >= COPY_STREAM_MIN) {
+        set_stream(p, pattern, size);
+    } else if(has_erms) {
+        __asm__ __volatile__ ("rep stosb"
+                              : "+D"(p), "+c"(size)
+                              : "a"(value)
+                              : "memory");
+    } else {
+        size_t qwords = size / 8;
+        __asm__ __volatile__ ("rep stosq"
+                              : "+D"(p), "+c"(qwords)
+                              : "a"(pattern)
+                              : "memory");
+        set_small(p, pattern, size & 7);
+    }
+}
+
+// The compiler and the network/driver code expect the C names to exist
+void* memcpy(void* dest, const void* src, size_t size) {
+    memory_copy(dest, src, size);
+    return dest;
+}
+
+void* memset(void* ptr, int value, size_t size) {
+    memory_set(ptr, (uint8_t)value, size);
+    return ptr;
+}
+
+void* memmove(void* dest, const void* src, size_t size) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    
+    if(d <= s || d >= s + size) {
+        memory_copy(dest, src, size);
+        return dest;
+    }
+    
+    // Overlapping with dest above src: copy backwards. Every other string
+    // instruction in the kernel assumes DF is clear, so no interrupt may
+    // run while it is set.
+    d += size - 1;
+    s += size - 1;
+    uint64_t flags = irq_save();
+    __asm__ __volatile__ ("std; rep movsb; cld"
+                          : "+D"(d), "+S"(s), "+c"(size)
+                          : : "memory");
+    irq_restore(flags);
+    return dest;
+}
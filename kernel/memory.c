@@ -1,27 +1,91 @@
 #include "memory.h"
+#include "reclaim.h"
+#include "filemap.h"
+#include "acpi.h"
+#include "numa.h"
+#include "kmemprof.h"
 #include "kernel.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "smp.h"
 
 static memory_map_entry_t* memory_map;
 static uint32_t memory_map_entries;
 static uint64_t total_memory;
 static uint64_t available_memory;
 
-// Physical memory bitmap
-static uint8_t* physical_bitmap;
+// Physical memory bitmap (one bit per page, set = used)
+static uint64_t* physical_bitmap;
 static uint64_t bitmap_size;
+static uint64_t physical_pages;
+static uint64_t free_physical_page_count;
+
+// Summary levels: a set bit means the word below it still has a free page
+static uint64_t phys_summary_l1[PHYS_L1_WORDS];
+static uint64_t phys_summary_l2[PHYS_L2_WORDS];
+static uint64_t phys_alloc_hint;
+
+static void phys_mark_range(uint64_t start_page, uint64_t end_page, bool used);
+static void phys_update_summary(uint64_t word);
+static uint64_t phys_find_free_word(uint64_t from);
 
 // Virtual memory structures
 static page_table_t* kernel_page_table;
-static uint64_t next_virtual_address = 0xFFFF800000000000;
+static uint64_t identity_map_top; // setup_kernel_paging maps [0, this) one to one
+
+// vmalloc address space
+static vmap_range_t* vmap_free_root;
+static vmap_range_t* vmap_lazy_list;
+static uint64_t vmap_lazy_bytes;
+static uint64_t vmap_purges;
+static uint32_t vmap_seed = 0x2545F491;
+static vm_area_t* vm_areas[VMALLOC_BUCKETS];
+static slab_cache_t* vmap_range_cache;
+static slab_cache_t* vm_area_cache;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
 
 // Buddy allocator for physical pages
-static buddy_block_t* buddy_blocks[MAX_BUDDY_ORDER];
+static page_t* frame_table;
+static buddy_node_t buddy_nodes[MAX_NUMA_NODES];
+static uint64_t* free_bitmaps[MAX_BUDDY_ORDER]; // Bit (pfn >> order) set while that block is free, any node
+static uint64_t buddy_free_pages; // Pages on all free lists, for watermark checks
+static spinlock_t buddy_lock = SPINLOCK_INIT;
+
+// Per-CPU caches of single pages in front of the buddy allocator
+static page_cache_t page_caches[MAX_CPUS];
+
+// Pages zeroed ahead of time by idle CPUs, linked through page_t.next
+static page_t* zero_pool;
+static uint32_t zero_pool_count;
+static uint64_t zero_pool_hits;
+static uint64_t zero_pool_misses;
+static spinlock_t zero_pool_lock = SPINLOCK_INIT;
+
+static void* buddy_alloc_block(uint32_t order, uint32_t node);
+static void buddy_free_block(uint64_t pfn, uint32_t order);
+static page_table_t* alloc_page_table(void);
 
 // Slab allocator for kernel objects
 static slab_cache_t slab_caches[MAX_SLAB_CACHES];
 static uint32_t slab_cache_count = 0;
+static shrinker_t slab_shrinker;
+
+// Backing cache for magazines; it runs without a magazine layer itself
+static slab_cache_t* magazine_cache;
+
+// kmalloc size-class caches
+static slab_cache_t* kmalloc_caches[MAX_NUMA_NODES][KMALLOC_CLASS_COUNT];
+static const char* kmalloc_names[KMALLOC_CLASS_COUNT] = {
+    "kmalloc-16", "kmalloc-24", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256", "kmalloc-384",
+    "kmalloc-512", "kmalloc-768", "kmalloc-1024", "kmalloc-1536", "kmalloc-2048",
+    "kmalloc-3072", "kmalloc-4096", "kmalloc-6144", "kmalloc-8192"
+};
 
 void memory_init(void) {
+    // Pick copy/fill strategies before the allocators start using them
+    memory_ops_init();
+    
     // Parse memory map from bootloader
     parse_memory_map();
     
@@ -31,12 +95,23 @@ void memory_init(void) {
     // Setup kernel page tables
     setup_kernel_paging();
     
+    // Node layout from the firmware, before the buddy allocator splits by it
+    acpi_init();
+    numa_init();
+    
     // Initialize buddy allocator
     init_buddy_allocator();
     
     // Initialize slab allocator
     init_slab_allocator();
     
+    // Initialize vmalloc address space
+    vmalloc_init();
+    
+    // Watermarks scale with what the buddy allocator manages
+    reclaim_init(buddy_free_pages);
+    register_shrinker(&slab_shrinker);
+    
     kprintf("Memory initialized: %lu MB total, %lu MB available\n", 
             total_memory / (1024*1024), available_memory / (1024*1024));
 }
@@ -61,64 +136,319 @@ void parse_memory_map(void) {
 }
 
 void init_physical_bitmap(void) {
-    bitmap_size = (total_memory / PAGE_SIZE) / 8;
-    physical_bitmap = (uint8_t*)0x200000; // Place after kernel
+    // Size the bitmap by the highest usable address, not the sum of lengths
+    uint64_t highest = 0;
+    for(uint32_t i = 0; i < memory_map_entries; i++) {
+        if(memory_map[i].type == 1 && memory_map[i].base + memory_map[i].length > highest) {
+            highest = memory_map[i].base + memory_map[i].length;
+        }
+    }
+    
+    physical_pages = highest / PAGE_SIZE;
+    if(physical_pages > MAX_PHYSICAL_PAGES) physical_pages = MAX_PHYSICAL_PAGES;
+    
+    bitmap_size = (physical_pages + 63) / 64;
+    physical_bitmap = (uint64_t*)PHYS_BITMAP_BASE; // Place after kernel
+    free_physical_page_count = 0;
+    phys_alloc_hint = 0;
     
     // Mark all memory as used initially
     for(uint64_t i = 0; i < bitmap_size; i++) {
-        physical_bitmap[i] = 0xFF;
+        physical_bitmap[i] = ~0ULL;
     }
     
     // Mark available regions as free
     for(uint32_t i = 0; i < memory_map_entries; i++) {
         if(memory_map[i].type == 1) {
-            uint64_t start_page = memory_map[i].base / PAGE_SIZE;
+            uint64_t start_page = (memory_map[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
             uint64_t end_page = (memory_map[i].base + memory_map[i].length) / PAGE_SIZE;
             
-            for(uint64_t page = start_page; page < end_page; page++) {
-                clear_bit(physical_bitmap, page);
+            if(end_page > physical_pages) end_page = physical_pages;
+            if(start_page < end_page) {
+                phys_mark_range(start_page, end_page, false);
             }
         }
     }
     
     // Mark kernel and bootloader areas as used
-    for(uint64_t page = 0; page < 0x300000 / PAGE_SIZE; page++) {
-        set_bit(physical_bitmap, page);
+    phys_mark_range(0, 0x300000 / PAGE_SIZE, true);
+}
+
+// Set or clear a run of page bits, then refresh the summaries it touched
+static void phys_mark_range(uint64_t start_page, uint64_t end_page, bool used) {
+    if(end_page > physical_pages) end_page = physical_pages;
+    
+    uint64_t page = start_page;
+    while(page < end_page) {
+        uint64_t word = page / 64;
+        uint64_t bit = page % 64;
+        uint64_t count = 64 - bit;
+        if(count > end_page - page) count = end_page - page;
+        
+        uint64_t mask = (count == 64) ? ~0ULL : ((1ULL << count) - 1) << bit;
+        uint64_t changed = used ? (~physical_bitmap[word] & mask) : (physical_bitmap[word] & mask);
+        
+        if(used) {
+            physical_bitmap[word] |= mask;
+            free_physical_page_count -= __builtin_popcountll(changed);
+        } else {
+            physical_bitmap[word] &= ~mask;
+            free_physical_page_count += __builtin_popcountll(changed);
+        }
+        
+        phys_update_summary(word);
+        page += count;
+    }
+}
+
+static void phys_update_summary(uint64_t word) {
+    uint64_t l1 = word / 64;
+    
+    if(physical_bitmap[word] != ~0ULL) {
+        phys_summary_l1[l1] |= 1ULL << (word % 64);
+    } else {
+        phys_summary_l1[l1] &= ~(1ULL << (word % 64));
+    }
+    
+    if(phys_summary_l1[l1]) {
+        phys_summary_l2[l1 / 64] |= 1ULL << (l1 % 64);
+    } else {
+        phys_summary_l2[l1 / 64] &= ~(1ULL << (l1 % 64));
+    }
+}
+
+// Find the first bitmap word at or after 'from' that has a free page.
+// Walks the summaries top-down, so the cost is bounded by PHYS_L2_WORDS
+// no matter how full memory is.
+static uint64_t phys_find_free_word(uint64_t from) {
+    if(from >= bitmap_size) return bitmap_size;
+    
+    uint64_t l1 = from / 64;
+    uint64_t bits = phys_summary_l1[l1] & (~0ULL << (from % 64));
+    if(bits) return l1 * 64 + __builtin_ctzll(bits);
+    
+    l1++;
+    for(uint64_t l2 = l1 / 64; l2 < (bitmap_size + 4095) / 4096; l2++) {
+        bits = phys_summary_l2[l2];
+        if(l2 == l1 / 64) bits &= ~0ULL << (l1 % 64);
+        if(!bits) continue;
+        
+        uint64_t found = l2 * 64 + __builtin_ctzll(bits);
+        return found * 64 + __builtin_ctzll(phys_summary_l1[found]);
     }
+    
+    return bitmap_size;
 }
 
 uint64_t alloc_physical_page(void) {
-    for(uint64_t i = 0; i < bitmap_size * 8; i++) {
-        if(!test_bit(physical_bitmap, i)) {
-            set_bit(physical_bitmap, i);
-            return i * PAGE_SIZE;
-        }
+    uint64_t word = phys_find_free_word(phys_alloc_hint);
+    if(word >= bitmap_size) {
+        // Pages may have been freed behind the hint
+        word = phys_find_free_word(0);
+        if(word >= bitmap_size) return 0; // Out of memory
+    }
+    
+    uint64_t bit = __builtin_ctzll(~physical_bitmap[word]);
+    physical_bitmap[word] |= 1ULL << bit;
+    free_physical_page_count--;
+    
+    if(physical_bitmap[word] == ~0ULL) {
+        phys_update_summary(word);
     }
-    return 0; // Out of memory
+    
+    phys_alloc_hint = word;
+    return (word * 64 + bit) * PAGE_SIZE;
 }
 
 void free_physical_page(uint64_t address) {
     uint64_t page = address / PAGE_SIZE;
-    clear_bit(physical_bitmap, page);
+    if(page >= physical_pages) return;
+    
+    uint64_t word = page / 64;
+    uint64_t mask = 1ULL << (page % 64);
+    if(!(physical_bitmap[word] & mask)) return; // Double free
+    
+    bool was_full = physical_bitmap[word] == ~0ULL;
+    physical_bitmap[word] &= ~mask;
+    free_physical_page_count++;
+    
+    if(was_full) {
+        phys_update_summary(word);
+    }
+}
+
+// First-fit search for 'count' contiguous free pages. Full words are skipped
+// through the summaries and every candidate word is visited once, carrying
+// the current run across word boundaries instead of restarting the scan.
+uint64_t alloc_physical_pages(uint32_t count) {
+    if(count == 0) return 0;
+    if(count == 1) return alloc_physical_page();
+    
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    
+    for(uint64_t word = phys_find_free_word(0); word < bitmap_size;
+        word = phys_find_free_word(word + 1)) {
+        uint64_t free_bits = ~physical_bitmap[word];
+        uint64_t pos = 0;
+        
+        while(pos < 64) {
+            uint64_t rest = free_bits >> pos;
+            if(!rest) break;
+            
+            // Skip used pages, then measure the free run that follows
+            uint64_t skip = __builtin_ctzll(rest);
+            pos += skip;
+            rest >>= skip;
+            uint64_t length = ~rest ? (uint64_t)__builtin_ctzll(~rest) : 64 - pos;
+            
+            uint64_t page = word * 64 + pos;
+            if(run_start + run_length != page) {
+                run_start = page;
+                run_length = 0;
+            }
+            run_length += length;
+            
+            if(run_length >= count) {
+                phys_mark_range(run_start, run_start + count, true);
+                return run_start * PAGE_SIZE;
+            }
+            
+            pos += length;
+        }
+    }
+    
+    return 0; // No run long enough
+}
+
+void free_physical_pages(uint64_t address, uint32_t count) {
+    uint64_t page = address / PAGE_SIZE;
+    phys_mark_range(page, page + count, false);
+}
+
+uint64_t get_free_physical_pages(void) {
+    return free_physical_page_count;
 }
 
 void setup_kernel_paging(void) {
     // Allocate page table
-    kernel_page_table = (page_table_t*)alloc_physical_page();
+    kernel_page_table = alloc_page_table();
     
-    // Identity map first 16MB for kernel
-    for(uint64_t addr = 0; addr < 0x1000000; addr += PAGE_SIZE) {
-        map_page(kernel_page_table, addr, addr, PAGE_PRESENT | PAGE_WRITABLE);
-    }
+    // Cover all of RAM, rounded up to a large page so the tail is not
+    // forced down to 4K mappings
+    uint64_t ram_top = physical_pages * PAGE_SIZE;
+    if(ram_top < 0x1000000) ram_top = 0x1000000;
+    ram_top = (ram_top + LARGE_PAGE_SIZE - 1) & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
     
-    // Map kernel to higher half
-    for(uint64_t addr = 0; addr < 0x1000000; addr += PAGE_SIZE) {
-        map_page(kernel_page_table, 0xFFFF800000000000 + addr, addr, 
-                PAGE_PRESENT | PAGE_WRITABLE);
-    }
+    // Identity map RAM; physical addresses are still dereferenced directly
+    map_range(kernel_page_table, 0, 0, ram_top, PAGE_PRESENT | PAGE_WRITABLE);
+    identity_map_top = ram_top;
+    
+    // Higher-half direct map of all RAM
+    map_range(kernel_page_table, PHYS_MAP_BASE, 0, ram_top,
+              PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL);
     
     // Load new page table
     write_cr3((uint64_t)kernel_page_table);
+    
+    // Kernel writes to copy-on-write user pages must fault as well
+    write_cr0(read_cr0() | CR0_WP);
+}
+
+page_table_t* get_kernel_page_table(void) {
+    return kernel_page_table;
+}
+
+static bool cpu_has_huge_pages(void) {
+    static int supported = -1;
+    
+    if(supported < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+        supported = 0;
+        if(eax >= 0x80000001) {
+            cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+            supported = (edx >> 26) & 1; // Page1GB
+        }
+    }
+    
+    return supported;
+}
+
+static page_table_t* alloc_page_table(void) {
+    page_table_t* table;
+    
+    // The low bitmap serves page tables until the buddy allocator is up
+    if(frame_table) {
+        table = (page_table_t*)alloc_page(ALLOC_ZERO);
+    } else {
+        table = (page_table_t*)alloc_physical_page();
+        if(table) clear_page(table);
+    }
+    
+    if(!table) kernel_panic("Out of memory for page tables");
+    return table;
+}
+
+static void free_table_page(page_table_t* table) {
+    if((uint64_t)table < BUDDY_BASE) {
+        free_physical_page((uint64_t)table);
+    } else {
+        free_page(table);
+    }
+}
+
+// Return the table an entry points to, creating it if missing. A large page
+// found on the way down is split into 512 entries of the next size so the
+// rest of its range stays mapped. entry_size is what one entry at this
+// level covers.
+static page_table_t* get_next_table(page_table_t* table, uint64_t index, uint64_t flags,
+                                    uint64_t entry_size) {
+    uint64_t entry = table->entries[index];
+    
+    if(!(entry & PAGE_PRESENT)) {
+        page_table_t* next = alloc_page_table();
+        table->entries[index] = (uint64_t)next | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+        return next;
+    }
+    
+    if(entry & PAGE_SIZE_FLAG) {
+        page_table_t* next = alloc_page_table();
+        
+        // A 1GB entry splits into 2MB entries, a 2MB entry into 4K ones
+        uint64_t step = entry_size / 512;
+        uint64_t base = entry & PAGE_ADDR_MASK & ~(entry_size - 1);
+        uint64_t attrs = entry & (0xFFF | PAGE_NO_EXECUTE);
+        if(step == PAGE_SIZE) attrs &= ~(uint64_t)PAGE_SIZE_FLAG;
+        
+        for(int i = 0; i < 512; i++) {
+            next->entries[i] = (base + i * step) | attrs;
+        }
+        
+        table->entries[index] = (uint64_t)next | PAGE_PRESENT | PAGE_WRITABLE | (entry & PAGE_USER);
+        smp_flush_tlb_all();
+        return next;
+    }
+    
+    if((flags & PAGE_USER) && !(entry & PAGE_USER)) {
+        table->entries[index] = entry | PAGE_USER;
+    }
+    
+    return (page_table_t*)(entry & PAGE_ADDR_MASK);
+}
+
+// Free a page table and everything below it. level 1 is a PT.
+static void free_page_table(page_table_t* table, int level) {
+    if(level > 1) {
+        for(int i = 0; i < 512; i++) {
+            uint64_t entry = table->entries[i];
+            if((entry & PAGE_PRESENT) && !(entry & PAGE_SIZE_FLAG)) {
+                free_page_table((page_table_t*)(entry & PAGE_ADDR_MASK), level - 1);
+            }
+        }
+    }
+    
+    free_table_page(table);
 }
 
 void map_page(page_table_t* pml4, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
@@ -127,185 +457,2459 @@ void map_page(page_table_t* pml4, uint64_t virtual_addr, uint64_t physical_addr,
     uint64_t pd_index = (virtual_addr >> 21) & 0x1FF;
     uint64_t pt_index = (virtual_addr >> 12) & 0x1FF;
     
-    // Get or create PDPT
-    if(!(pml4->entries[pml4_index] & PAGE_PRESENT)) {
-        uint64_t pdpt_phys = alloc_physical_page();
-        pml4->entries[pml4_index] = pdpt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        page_table_t* pdpt = (page_table_t*)pdpt_phys;
-        for(int i = 0; i < 512; i++) pdpt->entries[i] = 0;
+    page_table_t* pdpt = get_next_table(pml4, pml4_index, flags, 0);
+    page_table_t* pd = get_next_table(pdpt, pdpt_index, flags, HUGE_PAGE_SIZE);
+    page_table_t* pt = get_next_table(pd, pd_index, flags, LARGE_PAGE_SIZE);
+    
+    // Map the page
+    pt->entries[pt_index] = physical_addr | (flags & ~(uint64_t)PAGE_SIZE_FLAG);
+}
+
+// Map a large entry at the PDPT (1GB) or PD (2MB) level, releasing any
+// page table it replaces
+static void map_large_entry(page_table_t* table, uint64_t index, uint64_t physical_addr,
+                            uint64_t flags, int level) {
+    uint64_t old = table->entries[index];
+    
+    table->entries[index] = physical_addr | flags | PAGE_SIZE_FLAG;
+    
+    if((old & PAGE_PRESENT) && !(old & PAGE_SIZE_FLAG)) {
+        smp_flush_tlb_all();
+        free_page_table((page_table_t*)(old & PAGE_ADDR_MASK), level - 1);
     }
+}
+
+void map_range(page_table_t* pml4, uint64_t virtual_addr, uint64_t physical_addr, uint64_t size, uint64_t flags) {
+    uint64_t end = virtual_addr + size;
+    bool huge = cpu_has_huge_pages();
     
-    page_table_t* pdpt = (page_table_t*)(pml4->entries[pml4_index] & ~0xFFF);
+    flags &= ~(uint64_t)PAGE_SIZE_FLAG;
     
-    // Get or create PD
-    if(!(pdpt->entries[pdpt_index] & PAGE_PRESENT)) {
-        uint64_t pd_phys = alloc_physical_page();
-        pdpt->entries[pdpt_index] = pd_phys | PAGE_PRESENT | PAGE_WRITABLE;
+    while(virtual_addr < end) {
+        uint64_t remaining = end - virtual_addr;
+        uint64_t alignment = virtual_addr | physical_addr;
+        
+        page_table_t* pdpt = get_next_table(pml4, (virtual_addr >> 39) & 0x1FF, flags, 0);
+        
+        // Use the largest page the alignment and remaining size allow
+        if(huge && !(alignment & (HUGE_PAGE_SIZE - 1)) && remaining >= HUGE_PAGE_SIZE) {
+            map_large_entry(pdpt, (virtual_addr >> 30) & 0x1FF, physical_addr, flags, 3);
+            virtual_addr += HUGE_PAGE_SIZE;
+            physical_addr += HUGE_PAGE_SIZE;
+            continue;
+        }
         
-        page_table_t* pd = (page_table_t*)pd_phys;
-        for(int i = 0; i < 512; i++) pd->entries[i] = 0;
+        page_table_t* pd = get_next_table(pdpt, (virtual_addr >> 30) & 0x1FF, flags, HUGE_PAGE_SIZE);
+        
+        if(!(alignment & (LARGE_PAGE_SIZE - 1)) && remaining >= LARGE_PAGE_SIZE) {
+            map_large_entry(pd, (virtual_addr >> 21) & 0x1FF, physical_addr, flags, 2);
+            virtual_addr += LARGE_PAGE_SIZE;
+            physical_addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+        
+        page_table_t* pt = get_next_table(pd, (virtual_addr >> 21) & 0x1FF, flags, LARGE_PAGE_SIZE);
+        pt->entries[(virtual_addr >> 12) & 0x1FF] = physical_addr | flags;
+        virtual_addr += PAGE_SIZE;
+        physical_addr += PAGE_SIZE;
     }
+}
+
+// Clear a 4K mapping and return the frame it pointed at, leaving the TLB
+// flush to the caller
+static uint64_t unmap_page_noflush(page_table_t* pml4, uint64_t virtual_addr) {
+    uint64_t entry = pml4->entries[(virtual_addr >> 39) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return 0;
+    
+    // Unmapping 4K out of a large page splits it first
+    uint64_t flags = entry & PAGE_USER;
+    page_table_t* pdpt = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    if(!(pdpt->entries[(virtual_addr >> 30) & 0x1FF] & PAGE_PRESENT)) return 0;
+    
+    page_table_t* pd = get_next_table(pdpt, (virtual_addr >> 30) & 0x1FF, flags, HUGE_PAGE_SIZE);
+    if(!(pd->entries[(virtual_addr >> 21) & 0x1FF] & PAGE_PRESENT)) return 0;
+    
+    page_table_t* pt = get_next_table(pd, (virtual_addr >> 21) & 0x1FF, flags, LARGE_PAGE_SIZE);
+    uint64_t* pte = &pt->entries[(virtual_addr >> 12) & 0x1FF];
+    uint64_t phys = (*pte & PAGE_PRESENT) ? (*pte & PAGE_ADDR_MASK) : 0;
+    *pte = 0;
     
-    page_table_t* pd = (page_table_t*)(pdpt->entries[pdpt_index] & ~0xFFF);
+    return phys;
+}
+
+void unmap_page(page_table_t* pml4, uint64_t virtual_addr) {
+    unmap_page_noflush(pml4, virtual_addr);
+    smp_flush_tlb_page(virtual_addr);
+}
+
+static bool table_is_empty(page_table_t* table) {
+    for(int i = 0; i < 512; i++) {
+        if(table->entries[i]) return false;
+    }
+    return true;
+}
+
+// Clear what 'table' maps of [start, end), splitting a large page that
+// straddles an end, and free the PDs and PTs left empty. PDPTs stay: their
+// kernel PML4 entries may be copied into other address spaces. Addresses
+// are 48-bit, without the sign extension. level 1 is a PT.
+static void unmap_table_range(page_table_t* table, int level, uint64_t base, uint64_t start, uint64_t end) {
+    uint64_t entry_size = (uint64_t)PAGE_SIZE << (9 * (level - 1));
     
-    // Get or create PT
-    if(!(pd->entries[pd_index] & PAGE_PRESENT)) {
-        uint64_t pt_phys = alloc_physical_page();
-        pd->entries[pd_index] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE;
+    for(uint64_t i = 0; i < 512; i++) {
+        uint64_t entry_start = base + i * entry_size;
+        uint64_t entry_end = entry_start + entry_size;
+        if(entry_end <= start || entry_start >= end) continue;
+        if(!(table->entries[i] & PAGE_PRESENT)) continue;
+        
+        bool whole = start <= entry_start && entry_end <= end;
+        if(level == 1 || (table->entries[i] & PAGE_SIZE_FLAG)) {
+            if(whole) {
+                table->entries[i] = 0;
+                continue;
+            }
+            get_next_table(table, i, 0, entry_size);
+        }
         
-        page_table_t* pt = (page_table_t*)pt_phys;
-        for(int i = 0; i < 512; i++) pt->entries[i] = 0;
+        page_table_t* next = (page_table_t*)(table->entries[i] & PAGE_ADDR_MASK);
+        unmap_table_range(next, level - 1, entry_start, start, end);
+        if(level <= 3 && table_is_empty(next)) {
+            table->entries[i] = 0;
+            free_table_page(next);
+        }
+    }
+}
+
+// Undo map_range(): the frames are the caller's, only the mappings and
+// the page tables that held them go
+void unmap_range(page_table_t* pml4, uint64_t virtual_addr, uint64_t size) {
+    uint64_t start = virtual_addr & 0x0000FFFFFFFFFFFFULL;
+    unmap_table_range(pml4, 4, 0, start, start + size);
+    smp_flush_tlb_range(virtual_addr, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+uint64_t get_physical_address(page_table_t* pml4, uint64_t virtual_addr) {
+    uint64_t entry = pml4->entries[(virtual_addr >> 39) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return 0;
+    
+    page_table_t* pdpt = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    entry = pdpt->entries[(virtual_addr >> 30) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return 0;
+    if(entry & PAGE_SIZE_FLAG) {
+        return (entry & PAGE_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1)) | (virtual_addr & (HUGE_PAGE_SIZE - 1));
+    }
+    
+    page_table_t* pd = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    entry = pd->entries[(virtual_addr >> 21) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return 0;
+    if(entry & PAGE_SIZE_FLAG) {
+        return (entry & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1)) | (virtual_addr & (LARGE_PAGE_SIZE - 1));
     }
     
-    page_table_t* pt = (page_table_t*)(pd->entries[pd_index] & ~0xFFF);
+    page_table_t* pt = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    entry = pt->entries[(virtual_addr >> 12) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return 0;
     
-    // Map the page
-    pt->entries[pt_index] = physical_addr | flags;
+    return (entry & PAGE_ADDR_MASK) | (virtual_addr & (PAGE_SIZE - 1));
 }
 
-void init_buddy_allocator(void) {
-    // Initialize buddy block lists
-    for(int i = 0; i < MAX_BUDDY_ORDER; i++) {
-        buddy_blocks[i] = NULL;
+// vmalloc
+
+static inline uint64_t vmap_max(vmap_range_t* node) {
+    return node ? node->max_size : 0;
+}
+
+static void vmap_update(vmap_range_t* node) {
+    uint64_t max = node->size;
+    if(vmap_max(node->left) > max) max = vmap_max(node->left);
+    if(vmap_max(node->right) > max) max = vmap_max(node->right);
+    node->max_size = max;
+}
+
+// Split into ranges starting below 'start' and the rest
+static void vmap_split(vmap_range_t* node, uint64_t start, vmap_range_t** left, vmap_range_t** right) {
+    if(!node) {
+        *left = *right = NULL;
+    } else if(node->start < start) {
+        vmap_split(node->right, start, &node->right, right);
+        vmap_update(node);
+        *left = node;
+    } else {
+        vmap_split(node->left, start, left, &node->left);
+        vmap_update(node);
+        *right = node;
     }
+}
+
+// Every range in left lies below every range in right
+static vmap_range_t* vmap_merge(vmap_range_t* left, vmap_range_t* right) {
+    if(!left) return right;
+    if(!right) return left;
     
-    // Add available memory regions to buddy allocator
-    for(uint32_t i = 0; i < memory_map_entries; i++) {
-        if(memory_map[i].type == 1 && memory_map[i].base >= 0x1000000) {
-            add_buddy_block(memory_map[i].base, memory_map[i].length);
-        }
+    if(left->priority > right->priority) {
+        left->right = vmap_merge(left->right, right);
+        vmap_update(left);
+        return left;
     }
+    
+    right->left = vmap_merge(left, right->left);
+    vmap_update(right);
+    return right;
 }
 
-void* buddy_alloc(uint32_t order) {
-    if(order >= MAX_BUDDY_ORDER) return NULL;
+// Lowest-addressed free range of at least 'size' bytes
+static vmap_range_t* vmap_find_fit(uint64_t size) {
+    vmap_range_t* node = vmap_free_root;
     
-    // Find available block
-    for(uint32_t current_order = order; current_order < MAX_BUDDY_ORDER; current_order++) {
-        if(buddy_blocks[current_order]) {
-            buddy_block_t* block = buddy_blocks[current_order];
-            buddy_blocks[current_order] = block->next;
-            
-            // Split block if necessary
-            while(current_order > order) {
-                current_order--;
-                uint64_t buddy_addr = block->address + (1ULL << (current_order + 12));
-                add_buddy_block(buddy_addr, 1ULL << (current_order + 12));
-            }
-            
-            return (void*)block->address;
-        }
+    while(node) {
+        if(vmap_max(node->left) >= size) node = node->left;
+        else if(node->size >= size) return node;
+        else if(vmap_max(node->right) >= size) node = node->right;
+        else return NULL;
     }
     
-    return NULL; // No memory available
+    return NULL;
 }
 
-void buddy_free(void* ptr, uint32_t order) {
-    uint64_t address = (uint64_t)ptr;
+// Detach the range starting at 'start' from the tree
+static vmap_range_t* vmap_remove(uint64_t start) {
+    vmap_range_t *left, *middle, *right;
     
-    // Try to coalesce with buddy
-    while(order < MAX_BUDDY_ORDER - 1) {
-        uint64_t buddy_addr = address ^ (1ULL << (order + 12));
-        
-        // Find and remove buddy from free list
-        buddy_block_t** current = &buddy_blocks[order];
-        bool found_buddy = false;
-        
-        while(*current) {
-            if((*current)->address == buddy_addr) {
-                buddy_block_t* buddy = *current;
-                *current = buddy->next;
-                found_buddy = true;
-                break;
-            }
-            current = &(*current)->next;
-        }
-        
-        if(!found_buddy) break;
-        
-        // Coalesce
-        if(buddy_addr < address) address = buddy_addr;
-        order++;
+    vmap_split(vmap_free_root, start, &left, &right);
+    vmap_split(right, start + 1, &middle, &right);
+    vmap_free_root = vmap_merge(left, right);
+    
+    return middle;
+}
+
+// Return a range to the tree, coalescing with free neighbours
+static void vmap_insert(vmap_range_t* range) {
+    vmap_range_t *left, *right, *neighbour;
+    
+    vmap_split(vmap_free_root, range->start, &left, &right);
+    
+    neighbour = left;
+    while(neighbour && neighbour->right) neighbour = neighbour->right;
+    if(neighbour && neighbour->start + neighbour->size == range->start) {
+        vmap_range_t* rest;
+        vmap_split(left, neighbour->start, &left, &rest);
+        range->start = neighbour->start;
+        range->size += neighbour->size;
+        slab_free(vmap_range_cache, neighbour);
+    }
+    
+    neighbour = right;
+    while(neighbour && neighbour->left) neighbour = neighbour->left;
+    if(neighbour && neighbour->start == range->start + range->size) {
+        vmap_range_t* rest;
+        vmap_split(right, neighbour->start + 1, &rest, &right);
+        range->size += neighbour->size;
+        slab_free(vmap_range_cache, neighbour);
     }
     
-    // Add coalesced block to free list
-    add_buddy_block(address, 1ULL << (order + 12));
+    vmap_seed ^= vmap_seed << 13;
+    vmap_seed ^= vmap_seed >> 17;
+    vmap_seed ^= vmap_seed << 5;
+    
+    range->priority = vmap_seed;
+    range->left = range->right = NULL;
+    range->max_size = range->size;
+    vmap_free_root = vmap_merge(vmap_merge(left, range), right);
 }
 
-void init_slab_allocator(void) {
-    slab_cache_count = 0;
+// Flush every TLB once for all the ranges freed since the last purge and
+// make their address space available again. vmalloc mappings are global,
+// so this takes a global flush. Callers hold vmalloc_lock.
+static void vmap_purge_lazy(void) {
+    if(!vmap_lazy_list) return;
     
-    // Create common object caches
-    create_slab_cache("process", sizeof(process_t), 64);
-    create_slab_cache("file_desc", sizeof(file_descriptor_t), 128);
-    create_slab_cache("driver", sizeof(driver_t), 32);
+    smp_flush_tlb_all();
+    
+    while(vmap_lazy_list) {
+        vmap_range_t* range = vmap_lazy_list;
+        vmap_lazy_list = range->right;
+        vmap_insert(range);
+    }
+    
+    vmap_lazy_bytes = 0;
+    vmap_purges++;
 }
 
-slab_cache_t* create_slab_cache(const char* name, size_t object_size, uint32_t objects_per_slab) {
-    if(slab_cache_count >= MAX_SLAB_CACHES) return NULL;
+static inline uint32_t vm_area_bucket(uint64_t address) {
+    return (uint32_t)((address >> 12) % VMALLOC_BUCKETS);
+}
+
+void vmalloc_init(void) {
+    vmap_range_cache = create_slab_cache("vmap_range", sizeof(vmap_range_t), 64);
+    vm_area_cache = create_slab_cache("vm_area", sizeof(vm_area_t), 64);
     
-    slab_cache_t* cache = &slab_caches[slab_cache_count++];
-    strncpy(cache->name, name, 63);
-    cache->object_size = object_size;
-    cache->objects_per_slab = objects_per_slab;
-    cache->slabs = NULL;
+    // Populate the PML4 slot now so address spaces cloned from the kernel
+    // table see every later vmalloc mapping
+    get_next_table(kernel_page_table, (VMALLOC_START >> 39) & 0x1FF, 0, 0);
     
-    return cache;
+    vmap_range_t* range = (vmap_range_t*)slab_alloc(vmap_range_cache);
+    range->start = VMALLOC_START;
+    range->size = VMALLOC_END - VMALLOC_START;
+    vmap_insert(range);
 }
 
-void* slab_alloc(slab_cache_t* cache) {
-    // Find slab with free objects
-    slab_t* slab = cache->slabs;
-    while(slab && slab->free_objects == 0) {
-        slab = slab->next;
+bool is_vmalloc_address(const void* ptr) {
+    return (uint64_t)ptr >= VMALLOC_START && (uint64_t)ptr < VMALLOC_END;
+}
+
+// Tear down the first 'mapped' bytes of an area and queue its address
+// space, guard page included, for the next lazy purge. Callers hold
+// vmalloc_lock.
+static void vmalloc_release(uint64_t address, uint64_t mapped, uint64_t reserved, vmap_range_t* range) {
+    for(uint64_t offset = 0; offset < mapped; offset += PAGE_SIZE) {
+        uint64_t phys = unmap_page_noflush(kernel_page_table, address + offset);
+        if(phys) free_page((void*)phys);
     }
     
-    // Allocate new slab if needed
-    if(!slab) {
-        slab = create_slab(cache);
-        if(!slab) return NULL;
+    range->start = address;
+    range->size = reserved;
+    range->right = vmap_lazy_list;
+    vmap_lazy_list = range;
+    vmap_lazy_bytes += reserved;
+    
+    if(vmap_lazy_bytes > VMALLOC_LAZY_MAX) vmap_purge_lazy();
+}
+
+static void* vmalloc_pages(size_t size, uint32_t alloc_flags) {
+    if(size == 0) return NULL;
+    
+    uint64_t mapped = ((uint64_t)size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t reserved = mapped + PAGE_SIZE; // Unmapped guard page after each area
+    
+    vm_area_t* area = (vm_area_t*)slab_alloc(vm_area_cache);
+    vmap_range_t* spare = (vmap_range_t*)slab_alloc(vmap_range_cache);
+    if(!area || !spare) {
+        if(area) slab_free(vm_area_cache, area);
+        if(spare) slab_free(vmap_range_cache, spare);
+        return NULL;
+    }
+    
+    uint64_t flags = irq_save();
+    spin_lock(&vmalloc_lock);
+    
+    vmap_range_t* range = vmap_find_fit(reserved);
+    if(!range) {
+        vmap_purge_lazy();
+        range = vmap_find_fit(reserved);
     }
     
-    // Allocate object from slab
-    for(uint32_t i = 0; i < cache->objects_per_slab; i++) {
-        if(!test_bit(slab->bitmap, i)) {
-            set_bit(slab->bitmap, i);
-            slab->free_objects--;
-            return (void*)((uint64_t)slab->objects + i * cache->object_size);
+    if(!range) {
+        spin_unlock(&vmalloc_lock);
+        irq_restore(flags);
+        slab_free(vm_area_cache, area);
+        slab_free(vmap_range_cache, spare);
+        return NULL;
+    }
+    
+    // Carve the area off the front of the range
+    uint64_t address = range->start;
+    range = vmap_remove(address);
+    if(range->size > reserved) {
+        range->start += reserved;
+        range->size -= reserved;
+        vmap_insert(range);
+    } else {
+        slab_free(vmap_range_cache, range);
+    }
+    
+    // Back it with whatever frames are free; they need not be contiguous
+    for(uint64_t offset = 0; offset < mapped; offset += PAGE_SIZE) {
+        void* page = alloc_page(alloc_flags);
+        if(!page) {
+            vmalloc_release(address, offset, reserved, spare);
+            spin_unlock(&vmalloc_lock);
+            irq_restore(flags);
+            slab_free(vm_area_cache, area);
+            return NULL;
         }
+        
+        map_page(kernel_page_table, address + offset, (uint64_t)page,
+                 PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL | PAGE_NO_EXECUTE);
     }
     
-    return NULL;
+    uint32_t bucket = vm_area_bucket(address);
+    area->address = address;
+    area->size = mapped;
+    area->next = vm_areas[bucket];
+    vm_areas[bucket] = area;
+    
+    spin_unlock(&vmalloc_lock);
+    irq_restore(flags);
+    
+    slab_free(vmap_range_cache, spare);
+    return (void*)address;
 }
 
-void slab_free(slab_cache_t* cache, void* ptr) {
-    // Find which slab contains this object
-    slab_t* slab = cache->slabs;
-    while(slab) {
-        uint64_t slab_start = (uint64_t)slab->objects;
-        uint64_t slab_end = slab_start + cache->objects_per_slab * cache->object_size;
-        
-        if((uint64_t)ptr >= slab_start && (uint64_t)ptr < slab_end) {
-            uint32_t index = ((uint64_t)ptr - slab_start) / cache->object_size;
-            clear_bit(slab->bitmap, index);
-            slab->free_objects++;
-            return;
+void* vmalloc(size_t size) {
+    return vmalloc_pages(size, 0);
+}
+
+// Zeroed pages come from the idle-filled pool, so no memset here
+void* vzalloc(size_t size) {
+    return vmalloc_pages(size, ALLOC_ZERO);
+}
+
+void vfree(void* ptr) {
+    if(!ptr) return;
+    
+    vmap_range_t* range = (vmap_range_t*)slab_alloc(vmap_range_cache);
+    
+    uint64_t flags = irq_save();
+    spin_lock(&vmalloc_lock);
+    
+    vm_area_t** link = &vm_areas[vm_area_bucket((uint64_t)ptr)];
+    while(*link && (*link)->address != (uint64_t)ptr) {
+        link = &(*link)->next;
+    }
+    
+    vm_area_t* area = *link;
+    bool released = false;
+    if(area && range) {
+        *link = area->next;
+        vmalloc_release(area->address, area->size, area->size + PAGE_SIZE, range);
+        released = true;
+    }
+    
+    spin_unlock(&vmalloc_lock);
+    irq_restore(flags);
+    
+    if(released) {
+        slab_free(vm_area_cache, area);
+    } else if(range) {
+        slab_free(vmap_range_cache, range);
+    }
+}
+
+// Mapped size of the area starting at ptr, or 0 if there is none
+static uint64_t vmalloc_size(const void* ptr) {
+    uint64_t flags = irq_save();
+    spin_lock(&vmalloc_lock);
+    
+    vm_area_t* area = vm_areas[vm_area_bucket((uint64_t)ptr)];
+    while(area && area->address != (uint64_t)ptr) area = area->next;
+    uint64_t size = area ? area->size : 0;
+    
+    spin_unlock(&vmalloc_lock);
+    irq_restore(flags);
+    return size;
+}
+
+static void vmap_collect_stats(vmap_range_t* node, vmalloc_stats_t* stats) {
+    if(!node) return;
+    
+    stats->free_ranges++;
+    vmap_collect_stats(node->left, stats);
+    vmap_collect_stats(node->right, stats);
+}
+
+void get_vmalloc_stats(vmalloc_stats_t* stats) {
+    uint64_t flags = irq_save();
+    spin_lock(&vmalloc_lock);
+    
+    stats->allocations = 0;
+    stats->mapped_bytes = 0;
+    for(uint32_t i = 0; i < VMALLOC_BUCKETS; i++) {
+        for(vm_area_t* area = vm_areas[i]; area; area = area->next) {
+            stats->allocations++;
+            stats->mapped_bytes += area->size;
         }
-        
-        slab = slab->next;
     }
+    
+    stats->free_ranges = 0;
+    vmap_collect_stats(vmap_free_root, stats);
+    stats->largest_free = vmap_max(vmap_free_root);
+    stats->lazy_bytes = vmap_lazy_bytes;
+    stats->purges = vmap_purges;
+    
+    spin_unlock(&vmalloc_lock);
+    irq_restore(flags);
 }
 
-// Utility functions
-void set_bit(uint8_t* bitmap, uint64_t bit) {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+// Copy-on-write
+
+// ref_count is the number of page table entries mapping a frame. Frames
+// mapped only once may still read 0, so 0 and 1 both mean sole owner.
+void get_page(uint64_t address) {
+    if(address / PAGE_SIZE >= physical_pages) return;
+    
+    page_t* page = phys_to_page(address);
+    if(page->ref_count == 0) page->ref_count = 1;
+    __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
 }
 
-void clear_bit(uint8_t* bitmap, uint64_t bit) {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+void put_page(uint64_t address) {
+    if(address / PAGE_SIZE >= physical_pages) return;
+    
+    page_t* page = phys_to_page(address);
+    if(page->ref_count > 1 && __atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    
+    // Only plain page allocator frames are ours to free; slab, kmalloc and
+    // reserved memory mapped into user space belongs to someone else
+    page->ref_count = 0;
+    if((page->flags & ~(PG_MOVABLE | PG_ISOLATED)) == 0) free_page((void*)address);
 }
 
-bool test_bit(uint8_t* bitmap, uint64_t bit) {
-    return bitmap[bit / 8] & (1 << (bit % 8));
-}
\ No newline at end of file
+// Share every user page of parent with child read-only. Writable pages are
+// tagged PAGE_COW in both tables and copied by the fault handler on the
+// first write, so fork costs page tables only, not resident memory.
+// PAGE_SHARED mappings are shared as they are, large pages included.
+void copy_page_tables_cow(page_table_t* parent, page_table_t* child) {
+    for(uint64_t i = 0; i < 256; i++) {
+        uint64_t pml4e = parent->entries[i];
+        if(!(pml4e & PAGE_PRESENT)) continue;
+        
+        page_table_t* pdpt = (page_table_t*)(pml4e & PAGE_ADDR_MASK);
+        page_table_t* child_pdpt = get_next_table(child, i, pml4e, 0);
+        
+        for(uint64_t j = 0; j < 512; j++) {
+            uint64_t pdpte = pdpt->entries[j];
+            if(!(pdpte & PAGE_PRESENT)) continue;
+            
+            // Large user pages are split so COW works on 4K frames
+            page_table_t* pd = get_next_table(pdpt, j, pdpte, HUGE_PAGE_SIZE);
+            page_table_t* child_pd = get_next_table(child_pdpt, j, pdpte, 0);
+            
+            for(uint64_t k = 0; k < 512; k++) {
+                uint64_t pde = pd->entries[k];
+                if(!(pde & PAGE_PRESENT)) continue;
+                
+                if((pde & PAGE_SIZE_FLAG) && (pde & PAGE_SHARED)) {
+                    uint64_t base = pde & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+                    for(uint64_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+                        get_page(base + offset);
+                    }
+                    child_pd->entries[k] = pde;
+                    continue;
+                }
+                
+                page_table_t* pt = get_next_table(pd, k, pde, LARGE_PAGE_SIZE);
+                page_table_t* child_pt = get_next_table(child_pd, k, pde, 0);
+                
+                for(uint64_t l = 0; l < 512; l++) {
+                    uint64_t pte = pt->entries[l];
+                    if(!(pte & PAGE_PRESENT)) continue;
+                    
+                    if((pte & PAGE_WRITABLE) && !(pte & PAGE_SHARED)) {
+                        pte = (pte & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+                        pt->entries[l] = pte;
+                    }
+                    
+                    get_page(pte & PAGE_ADDR_MASK);
+                    child_pt->entries[l] = pte;
+                }
+            }
+        }
+    }
+    
+    // The parent lost write access to pages it may have cached
+    smp_flush_tlb_all();
+}
+
+// Release every user mapping and the tables holding them
+void free_user_page_tables(page_table_t* pml4) {
+    for(uint64_t i = 0; i < 256; i++) {
+        uint64_t pml4e = pml4->entries[i];
+        if(!(pml4e & PAGE_PRESENT)) continue;
+        
+        page_table_t* pdpt = (page_table_t*)(pml4e & PAGE_ADDR_MASK);
+        for(uint64_t j = 0; j < 512; j++) {
+            uint64_t pdpte = pdpt->entries[j];
+            if(!(pdpte & PAGE_PRESENT)) continue;
+            
+            if(pdpte & PAGE_SIZE_FLAG) {
+                uint64_t base = pdpte & PAGE_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1);
+                for(uint64_t offset = 0; offset < HUGE_PAGE_SIZE; offset += PAGE_SIZE) {
+                    put_page(base + offset);
+                }
+                continue;
+            }
+            
+            page_table_t* pd = (page_table_t*)(pdpte & PAGE_ADDR_MASK);
+            for(uint64_t k = 0; k < 512; k++) {
+                uint64_t pde = pd->entries[k];
+                if(!(pde & PAGE_PRESENT)) continue;
+                
+                if(pde & PAGE_SIZE_FLAG) {
+                    uint64_t base = pde & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+                    for(uint64_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+                        put_page(base + offset);
+                    }
+                    continue;
+                }
+                
+                page_table_t* pt = (page_table_t*)(pde & PAGE_ADDR_MASK);
+                for(uint64_t l = 0; l < 512; l++) {
+                    if(pt->entries[l] & PAGE_PRESENT) {
+                        put_page(pt->entries[l] & PAGE_ADDR_MASK);
+                    }
+                }
+                
+                free_table_page(pt);
+            }
+            
+            free_table_page(pd);
+        }
+        
+        free_table_page(pdpt);
+        pml4->entries[i] = 0;
+    }
+    
+    smp_flush_tlb_all();
+}
+
+// Drop the user mappings in [start, end) and the frame references they
+// hold. A large page wholly inside the range goes in one step; one that
+// straddles an edge is split first. Emptied page tables stay in place.
+void unmap_user_range(page_table_t* pml4, uint64_t start, uint64_t end) {
+    uint64_t address = start;
+    
+    while(address < end) {
+        uint64_t pml4e = pml4->entries[(address >> 39) & 0x1FF];
+        if(!(pml4e & PAGE_PRESENT)) {
+            address = (address | ((1ULL << 39) - 1)) + 1;
+            continue;
+        }
+        
+        page_table_t* pdpt = (page_table_t*)(pml4e & PAGE_ADDR_MASK);
+        uint64_t pdpt_index = (address >> 30) & 0x1FF;
+        if(!(pdpt->entries[pdpt_index] & PAGE_PRESENT)) {
+            address = (address | (HUGE_PAGE_SIZE - 1)) + 1;
+            continue;
+        }
+        
+        page_table_t* pd = get_next_table(pdpt, pdpt_index, PAGE_USER, HUGE_PAGE_SIZE);
+        uint64_t pd_index = (address >> 21) & 0x1FF;
+        uint64_t pde = pd->entries[pd_index];
+        if(!(pde & PAGE_PRESENT)) {
+            address = (address | (LARGE_PAGE_SIZE - 1)) + 1;
+            continue;
+        }
+        
+        if((pde & PAGE_SIZE_FLAG) && !(address & (LARGE_PAGE_SIZE - 1)) &&
+           end - address >= LARGE_PAGE_SIZE) {
+            uint64_t base = pde & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+            for(uint64_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+                put_page(base + offset);
+            }
+            pd->entries[pd_index] = 0;
+            address += LARGE_PAGE_SIZE;
+            continue;
+        }
+        
+        page_table_t* pt = get_next_table(pd, pd_index, PAGE_USER, LARGE_PAGE_SIZE);
+        uint64_t* pte = &pt->entries[(address >> 12) & 0x1FF];
+        if(*pte & PAGE_PRESENT) {
+            put_page(*pte & PAGE_ADDR_MASK);
+            *pte = 0;
+        }
+        address += PAGE_SIZE;
+    }
+    
+    smp_flush_tlb_range(start, (end - start) / PAGE_SIZE);
+}
+
+// Resident set size: user pages currently mapped, shared ones included
+uint64_t count_user_pages(page_table_t* pml4) {
+    uint64_t pages = 0;
+    
+    for(uint64_t i = 0; i < 256; i++) {
+        if(!(pml4->entries[i] & PAGE_PRESENT)) continue;
+        
+        page_table_t* pdpt = (page_table_t*)(pml4->entries[i] & PAGE_ADDR_MASK);
+        for(uint64_t j = 0; j < 512; j++) {
+            uint64_t pdpte = pdpt->entries[j];
+            if(!(pdpte & PAGE_PRESENT)) continue;
+            if(pdpte & PAGE_SIZE_FLAG) {
+                pages += HUGE_PAGE_SIZE / PAGE_SIZE;
+                continue;
+            }
+            
+            page_table_t* pd = (page_table_t*)(pdpte & PAGE_ADDR_MASK);
+            for(uint64_t k = 0; k < 512; k++) {
+                uint64_t pde = pd->entries[k];
+                if(!(pde & PAGE_PRESENT)) continue;
+                if(pde & PAGE_SIZE_FLAG) {
+                    pages += LARGE_PAGE_SIZE / PAGE_SIZE;
+                    continue;
+                }
+                
+                page_table_t* pt = (page_table_t*)(pde & PAGE_ADDR_MASK);
+                for(uint64_t l = 0; l < 512; l++) {
+                    if(pt->entries[l] & PAGE_PRESENT) pages++;
+                }
+            }
+        }
+    }
+    
+    return pages;
+}
+
+// The 4K entry mapping an address, or NULL if no page table reaches it or
+// a large page covers it. Nothing is created or split.
+uint64_t* get_pte(page_table_t* pml4, uint64_t virtual_addr) {
+    uint64_t entry = pml4->entries[(virtual_addr >> 39) & 0x1FF];
+    if(!(entry & PAGE_PRESENT)) return NULL;
+    
+    page_table_t* pdpt = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    entry = pdpt->entries[(virtual_addr >> 30) & 0x1FF];
+    if(!(entry & PAGE_PRESENT) || (entry & PAGE_SIZE_FLAG)) return NULL;
+    
+    page_table_t* pd = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    entry = pd->entries[(virtual_addr >> 21) & 0x1FF];
+    if(!(entry & PAGE_PRESENT) || (entry & PAGE_SIZE_FLAG)) return NULL;
+    
+    page_table_t* pt = (page_table_t*)(entry & PAGE_ADDR_MASK);
+    return &pt->entries[(virtual_addr >> 12) & 0x1FF];
+}
+
+// A fault on such a page is retried rather than handled: compaction is
+// about to map it again
+bool page_is_migrating(page_table_t* pml4, uint64_t virtual_addr) {
+    uint64_t* pte = get_pte(pml4, virtual_addr);
+    return pte && (__atomic_load_n(pte, __ATOMIC_ACQUIRE) & PAGE_MIGRATING);
+}
+
+// Resolve a write fault on a COW page. Returns false if the fault was not
+// a copy-on-write one, or no page was available for the copy.
+bool handle_cow_fault(page_table_t* pml4, uint64_t virtual_addr) {
+    uint64_t* pte = get_pte(pml4, virtual_addr);
+    if(!pte || (*pte & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW)) return false;
+    
+    uint64_t old_phys = *pte & PAGE_ADDR_MASK;
+    uint64_t flags = (*pte & ~PAGE_ADDR_MASK & ~(uint64_t)PAGE_COW) | PAGE_WRITABLE;
+    
+    // Last sharer keeps the frame and just gets write access back
+    if(old_phys / PAGE_SIZE < physical_pages && phys_to_page(old_phys)->ref_count <= 1) {
+        *pte = old_phys | flags;
+        smp_flush_tlb_page(virtual_addr);
+        return true;
+    }
+    
+    void* copy = alloc_page(ALLOC_MOVABLE);
+    if(!copy) return false;
+    
+    memory_copy(copy, (void*)old_phys, PAGE_SIZE);
+    *pte = (uint64_t)copy | flags;
+    smp_flush_tlb_page(virtual_addr);
+    
+    put_page(old_phys);
+    return true;
+}
+
+// Hand a usable range to the buddy allocator in pieces that each lie on a
+// single node, so no block can straddle two
+static void add_buddy_range(uint64_t start, uint64_t end) {
+    while(start < end) {
+        uint32_t node = frame_table[start / PAGE_SIZE].node;
+        uint64_t split = start + PAGE_SIZE;
+        while(split < end && frame_table[split / PAGE_SIZE].node == node) split += PAGE_SIZE;
+        
+        buddy_node_t* buddy = &buddy_nodes[node];
+        if(start / PAGE_SIZE < buddy->start_pfn) buddy->start_pfn = start / PAGE_SIZE;
+        if(split / PAGE_SIZE > buddy->end_pfn) buddy->end_pfn = split / PAGE_SIZE;
+        buddy->present_pages += (split - start) / PAGE_SIZE;
+        
+        add_buddy_block(start, split - start);
+        start = split;
+    }
+}
+
+void init_buddy_allocator(void) {
+    // Frame table plus one free bitmap per order, carved from the first
+    // region above BUDDY_BASE that can hold it
+    uint64_t meta_size = physical_pages * sizeof(page_t);
+    for(int i = 0; i < MAX_BUDDY_ORDER; i++) {
+        meta_size += (((physical_pages >> i) + 64) / 64) * sizeof(uint64_t);
+    }
+    meta_size = (meta_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    
+    uint64_t meta_base = 0;
+    for(uint32_t i = 0; i < memory_map_entries && !meta_base; i++) {
+        if(memory_map[i].type != 1) continue;
+        
+        uint64_t start = memory_map[i].base < BUDDY_BASE ? BUDDY_BASE : memory_map[i].base;
+        uint64_t end = memory_map[i].base + memory_map[i].length;
+        start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        
+        if(end > start && end - start >= meta_size) {
+            meta_base = start;
+        }
+    }
+    
+    if(!meta_base) kernel_panic("No room for the page frame table");
+    
+    // Make sure the identity map reaches the metadata before the first
+    // write to it, whatever setup_kernel_paging covered. Page tables still
+    // come from the low bitmap, as frame_table is not set yet.
+    uint64_t meta_end = (meta_base + meta_size + LARGE_PAGE_SIZE - 1) & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
+    if(meta_end > identity_map_top) {
+        uint64_t map_start = meta_base & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
+        if(map_start < identity_map_top) map_start = identity_map_top;
+        map_range(kernel_page_table, map_start, map_start, meta_end - map_start,
+                  PAGE_PRESENT | PAGE_WRITABLE);
+    }
+    
+    frame_table = (page_t*)meta_base;
+    uint64_t* bitmap_words = (uint64_t*)(meta_base + physical_pages * sizeof(page_t));
+    
+    for(uint64_t pfn = 0; pfn < physical_pages; pfn++) {
+        frame_table[pfn].flags = PG_RESERVED;
+        frame_table[pfn].order = 0;
+        frame_table[pfn].ref_count = 0;
+        frame_table[pfn].next = NULL;
+        frame_table[pfn].prev = NULL;
+        frame_table[pfn].slab_cache = NULL;
+        frame_table[pfn].mapping = NULL;
+        frame_table[pfn].node = 0;
+    }
+    
+    const numa_range_t* ranges;
+    uint32_t range_count = numa_get_ranges(&ranges);
+    for(uint32_t i = 0; i < range_count; i++) {
+        uint64_t end = ranges[i].end / PAGE_SIZE;
+        if(end > physical_pages) end = physical_pages;
+        
+        for(uint64_t pfn = ranges[i].base / PAGE_SIZE; pfn < end; pfn++) {
+            frame_table[pfn].node = ranges[i].node;
+        }
+    }
+    
+    // Initialize per-node free lists and the shared per-order bitmaps
+    for(uint32_t node = 0; node < MAX_NUMA_NODES; node++) {
+        for(int i = 0; i < MAX_BUDDY_ORDER; i++) {
+            buddy_nodes[node].free_areas[i].free_list = NULL;
+            buddy_nodes[node].free_areas[i].free_count = 0;
+        }
+        buddy_nodes[node].start_pfn = physical_pages;
+        buddy_nodes[node].end_pfn = 0;
+    }
+    
+    for(int i = 0; i < MAX_BUDDY_ORDER; i++) {
+        uint64_t words = ((physical_pages >> i) + 64) / 64;
+        
+        free_bitmaps[i] = bitmap_words;
+        for(uint64_t w = 0; w < words; w++) bitmap_words[w] = 0;
+        bitmap_words += words;
+    }
+    
+    // Add available memory above the bitmap's range to the buddy allocator.
+    // The page bitmap keeps the low window for page tables and early boot.
+    for(uint32_t i = 0; i < memory_map_entries; i++) {
+        if(memory_map[i].type != 1) continue;
+        
+        uint64_t start = memory_map[i].base < BUDDY_BASE ? BUDDY_BASE : memory_map[i].base;
+        uint64_t end = memory_map[i].base + memory_map[i].length;
+        start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if(end > physical_pages * PAGE_SIZE) end = physical_pages * PAGE_SIZE;
+        if(start == meta_base) start += meta_size;
+        
+        if(end > start) {
+            add_buddy_range(start, end);
+            phys_mark_range(start / PAGE_SIZE, end / PAGE_SIZE, true);
+        }
+    }
+    
+    phys_mark_range(meta_base / PAGE_SIZE, (meta_base + meta_size) / PAGE_SIZE, true);
+    
+    set_page_cache_watermarks(PAGE_CACHE_HIGH, PAGE_CACHE_LOW);
+}
+
+page_t* phys_to_page(uint64_t address) {
+    return &frame_table[address / PAGE_SIZE];
+}
+
+uint64_t page_to_phys(page_t* page) {
+    return (uint64_t)(page - frame_table) * PAGE_SIZE;
+}
+
+uint32_t get_order(uint64_t size) {
+    uint32_t order = 0;
+    while(((uint64_t)PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+static inline bool buddy_is_free(uint64_t pfn, uint32_t order) {
+    uint64_t bit = pfn >> order;
+    return free_bitmaps[order][bit / 64] & (1ULL << (bit % 64));
+}
+
+static void buddy_list_add(page_t* page, uint32_t order) {
+    free_area_t* area = &buddy_nodes[page->node].free_areas[order];
+    uint64_t bit = (uint64_t)(page - frame_table) >> order;
+    
+    page->flags = PG_BUDDY;
+    page->order = order;
+    page->prev = NULL;
+    page->next = area->free_list;
+    if(area->free_list) area->free_list->prev = page;
+    area->free_list = page;
+    
+    free_bitmaps[order][bit / 64] |= 1ULL << (bit % 64);
+    area->free_count++;
+    buddy_nodes[page->node].free_pages += 1ULL << order;
+    buddy_free_pages += 1ULL << order;
+}
+
+static void buddy_list_del(page_t* page, uint32_t order) {
+    free_area_t* area = &buddy_nodes[page->node].free_areas[order];
+    uint64_t bit = (uint64_t)(page - frame_table) >> order;
+    
+    if(page->prev) page->prev->next = page->next;
+    else area->free_list = page->next;
+    if(page->next) page->next->prev = page->prev;
+    
+    page->flags &= ~PG_BUDDY;
+    page->next = NULL;
+    page->prev = NULL;
+    
+    free_bitmaps[order][bit / 64] &= ~(1ULL << (bit % 64));
+    area->free_count--;
+    buddy_nodes[page->node].free_pages -= 1ULL << order;
+    buddy_free_pages -= 1ULL << order;
+}
+
+void add_buddy_block(uint64_t address, uint64_t size) {
+    uint64_t pfn = (address + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = (address + size) / PAGE_SIZE;
+    
+    // Release the range as the largest naturally aligned blocks that fit
+    while(pfn < end) {
+        uint32_t order = 0;
+        while(order + 1 < MAX_BUDDY_ORDER &&
+              !(pfn & ((1ULL << (order + 1)) - 1)) &&
+              pfn + (1ULL << (order + 1)) <= end) {
+            order++;
+        }
+        
+        for(uint64_t i = 0; i < (1ULL << order); i++) {
+            frame_table[pfn + i].flags = 0;
+        }
+        
+        buddy_free_block(pfn, order);
+        pfn += 1ULL << order;
+    }
+}
+
+// Callers hold buddy_lock
+static page_t* buddy_alloc_from(buddy_node_t* buddy, uint32_t order) {
+    // Find the smallest order with a free block
+    uint32_t current_order = order;
+    while(current_order < MAX_BUDDY_ORDER && !buddy->free_areas[current_order].free_list) {
+        current_order++;
+    }
+    
+    if(current_order == MAX_BUDDY_ORDER) return NULL; // Node is out of memory
+    
+    page_t* page = buddy->free_areas[current_order].free_list;
+    buddy_list_del(page, current_order);
+    
+    // Split block if necessary, returning upper halves to the free lists
+    while(current_order > order) {
+        current_order--;
+        buddy_list_add(page + (1ULL << current_order), current_order);
+    }
+    
+    page->order = order;
+    return page;
+}
+
+// Callers hold buddy_lock. Try 'node' first, NUMA_NO_NODE meaning this
+// CPU's, then the others nearest first.
+static void* buddy_alloc_block(uint32_t order, uint32_t node) {
+    if(node == NUMA_NO_NODE) node = numa_node_id();
+    
+    const uint32_t* fallback = numa_fallback(node);
+    for(uint32_t i = 0; i < numa_node_count(); i++) {
+        buddy_node_t* buddy = &buddy_nodes[fallback[i]];
+        page_t* page = buddy_alloc_from(buddy, order);
+        if(!page) continue;
+        
+        if(i == 0) buddy->preferred_allocs++;
+        else buddy->fallback_allocs++;
+        return (void*)page_to_phys(page);
+    }
+    
+    return NULL;
+}
+
+static void buddy_free_block(uint64_t pfn, uint32_t order) {
+    // Coalesce while the buddy block is free at the same order
+    while(order < MAX_BUDDY_ORDER - 1) {
+        uint64_t buddy_pfn = pfn ^ (1ULL << order);
+        
+        if(buddy_pfn >= physical_pages || !buddy_is_free(buddy_pfn, order)) break;
+        if(frame_table[buddy_pfn].node != frame_table[pfn].node) break;
+        
+        buddy_list_del(&frame_table[buddy_pfn], order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    
+    buddy_list_add(&frame_table[pfn], order);
+}
+
+static inline bool node_is_local(uint32_t node) {
+    return node == NUMA_NO_NODE || node == numa_node_id();
+}
+
+// For callers holding locks, such as create_slab() with its cache locked:
+// never reclaims or compacts. The per-CPU cache only holds local pages, so
+// a single page for another node comes straight off that node's lists.
+static void* buddy_alloc_atomic(uint32_t order, uint32_t node) {
+    if(order == 0 && node_is_local(node)) return alloc_page(ALLOC_ATOMIC);
+    
+    uint64_t flags = irq_save();
+    spin_lock(&buddy_lock);
+    void* block = buddy_alloc_block(order, node);
+    uint64_t free_pages = buddy_free_pages;
+    spin_unlock(&buddy_lock);
+    irq_restore(flags);
+    
+    if(block && order == 0) phys_to_page((uint64_t)block)->ref_count = 1;
+    
+    reclaim_check(free_pages);
+    return block;
+}
+
+// kmalloc retries after reclaiming itself
+static void* do_buddy_alloc(uint32_t order, uint32_t node) {
+    if(order >= MAX_BUDDY_ORDER) return NULL;
+    if(order == 0 && node_is_local(node)) return alloc_page(0);
+    
+    // With enough pages free in total a high-order failure is
+    // fragmentation, not a shortage; move pages out of a sparse region and
+    // try once more
+    void* block = buddy_alloc_atomic(order, node);
+    if(!block && order > 0 && buddy_free_pages >= (1ULL << order) && compact_memory(order)) {
+        block = buddy_alloc_atomic(order, node);
+    }
+    return block;
+}
+
+void* buddy_alloc_node(uint32_t order, uint32_t node) {
+    void* block = do_buddy_alloc(order, node);
+    kmemprof_alloc(KMEMPROF_BUDDY, block, (uint64_t)PAGE_SIZE << order);
+    return block;
+}
+
+void* buddy_alloc(uint32_t order) {
+    void* block = do_buddy_alloc(order, NUMA_NO_NODE);
+    kmemprof_alloc(KMEMPROF_BUDDY, block, (uint64_t)PAGE_SIZE << order);
+    return block;
+}
+
+static void do_buddy_free(void* ptr, uint32_t order) {
+    if(order == 0) {
+        free_page(ptr);
+        return;
+    }
+    
+    uint64_t flags = irq_save();
+    spin_lock(&buddy_lock);
+    buddy_free_block((uint64_t)ptr / PAGE_SIZE, order);
+    spin_unlock(&buddy_lock);
+    irq_restore(flags);
+}
+
+void buddy_free(void* ptr, uint32_t order) {
+    kmemprof_free(ptr);
+    do_buddy_free(ptr, order);
+}
+
+// Per-CPU page caches
+
+static void page_cache_push(page_cache_t* cache, page_t* page, bool cold) {
+    if(cold) {
+        page->next = NULL;
+        page->prev = cache->tail;
+        if(cache->tail) cache->tail->next = page;
+        else cache->head = page;
+        cache->tail = page;
+    } else {
+        page->prev = NULL;
+        page->next = cache->head;
+        if(cache->head) cache->head->prev = page;
+        else cache->tail = page;
+        cache->head = page;
+    }
+    cache->count++;
+}
+
+static page_t* page_cache_pop(page_cache_t* cache, bool cold) {
+    page_t* page = cold ? cache->tail : cache->head;
+    if(!page) return NULL;
+    
+    if(page->prev) page->prev->next = page->next;
+    else cache->head = page->next;
+    if(page->next) page->next->prev = page->prev;
+    else cache->tail = page->prev;
+    
+    page->next = NULL;
+    page->prev = NULL;
+    cache->count--;
+    return page;
+}
+
+// Pull up to 'low' pages from the buddy allocator in one lock hold
+static void page_cache_refill(page_cache_t* cache) {
+    uint32_t want = cache->low ? cache->low : 1;
+    
+    spin_lock(&buddy_lock);
+    for(uint32_t i = 0; i < want; i++) {
+        void* block = buddy_alloc_block(0, NUMA_NO_NODE);
+        if(!block) break;
+        page_cache_push(cache, phys_to_page((uint64_t)block), true);
+    }
+    spin_unlock(&buddy_lock);
+    
+    cache->refills++;
+}
+
+// Return the coldest pages until only 'low' remain
+static void page_cache_drain(page_cache_t* cache) {
+    spin_lock(&buddy_lock);
+    while(cache->count > cache->low) {
+        page_t* page = page_cache_pop(cache, true);
+        buddy_free_block((uint64_t)(page - frame_table), 0);
+    }
+    spin_unlock(&buddy_lock);
+    
+    cache->drains++;
+}
+
+static page_t* zero_pool_pop(void) {
+    uint64_t flags = irq_save();
+    spin_lock(&zero_pool_lock);
+    
+    page_t* page = zero_pool;
+    if(page) {
+        zero_pool = page->next;
+        page->next = NULL;
+        zero_pool_count--;
+    }
+    
+    spin_unlock(&zero_pool_lock);
+    irq_restore(flags);
+    return page;
+}
+
+void* alloc_page(uint32_t flags) {
+    page_t* page = NULL;
+    
+    if(flags & ALLOC_ZERO) {
+        page = zero_pool_pop();
+        if(page) {
+            __atomic_add_fetch(&zero_pool_hits, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&zero_pool_misses, 1, __ATOMIC_RELAXED);
+        }
+    }
+    
+    for(int attempt = 0; !page && attempt < 2; attempt++) {
+        uint64_t irq_flags = irq_save();
+        page_cache_t* cache = &page_caches[cpu_id()];
+        bool refilled = false;
+        
+        if(cache->count) {
+            cache->hits++;
+        } else {
+            page_cache_refill(cache);
+            refilled = true;
+        }
+        
+        page = page_cache_pop(cache, flags & ALLOC_COLD);
+        irq_restore(irq_flags);
+        
+        // Only the trip to the buddy allocator can cross a watermark
+        if(refilled) reclaim_check(buddy_free_pages);
+        
+        if(page && (flags & ALLOC_ZERO)) {
+            clear_page((void*)page_to_phys(page));
+        }
+        
+        // Zeroed pages are still free memory; hand them out under pressure
+        if(!page) page = zero_pool_pop();
+        
+        // Nothing free anywhere: shrink caches and try once more
+        if(!page && ((flags & ALLOC_ATOMIC) || !reclaim_direct(1))) break;
+    }
+    
+    if(!page) return NULL;
+    page->flags = (flags & ALLOC_MOVABLE) ? PG_MOVABLE : 0;
+    page->order = 0;
+    page->ref_count = 1;
+    page->mapping = NULL;
+    return (void*)page_to_phys(page);
+}
+
+static void page_cache_free(void* ptr, bool cold) {
+    page_t* page = phys_to_page((uint64_t)ptr);
+    
+    // A free frame is never movable; compaction relies on that. One it has
+    // isolated is only marked, and compaction frees it.
+    uint32_t page_flags = __atomic_load_n(&page->flags, __ATOMIC_ACQUIRE);
+    while(1) {
+        uint32_t next = (page_flags & PG_ISOLATED) ? page_flags | PG_RELEASED : 0;
+        if(__atomic_compare_exchange_n(&page->flags, &page_flags, next, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+    }
+    if(page_flags & PG_ISOLATED) return;
+    
+    uint64_t irq_flags = irq_save();
+    page_cache_t* cache = &page_caches[cpu_id()];
+    
+    // Keep the cache node-local: another node's page goes straight back
+    if(page->node != numa_node_id()) {
+        spin_lock(&buddy_lock);
+        buddy_free_block((uint64_t)(page - frame_table), 0);
+        spin_unlock(&buddy_lock);
+        irq_restore(irq_flags);
+        return;
+    }
+    
+    page_cache_push(cache, page, cold);
+    if(cache->count > cache->high) {
+        page_cache_drain(cache);
+    }
+    
+    irq_restore(irq_flags);
+}
+
+void free_page(void* ptr) {
+    page_cache_free(ptr, false);
+}
+
+void free_page_cold(void* ptr) {
+    page_cache_free(ptr, true);
+}
+
+void clear_page(void* page) {
+    uint64_t count = PAGE_SIZE / 8;
+    __asm__ __volatile__ ("rep stosq"
+                          : "+D"(page), "+c"(count)
+                          : "a"(0ULL)
+                          : "memory");
+}
+
+// Zero one cold free page into the pool. Called from the idle loop;
+// returns false once the pool is full or memory is short.
+bool zero_pool_refill(void) {
+    if(__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) >= ZERO_POOL_TARGET) return false;
+    
+    // Don't take pages kswapd is trying to win back
+    watermarks_t marks;
+    get_watermarks(&marks);
+    if(buddy_free_pages < marks.high) return false;
+    
+    void* ptr = alloc_page(ALLOC_COLD);
+    if(!ptr) return false;
+    
+    clear_page(ptr);
+    
+    page_t* page = phys_to_page((uint64_t)ptr);
+    uint64_t flags = irq_save();
+    spin_lock(&zero_pool_lock);
+    page->next = zero_pool;
+    zero_pool = page;
+    zero_pool_count++;
+    spin_unlock(&zero_pool_lock);
+    irq_restore(flags);
+    
+    return true;
+}
+
+void set_page_cache_watermarks(uint32_t high, uint32_t low) {
+    if(low > high) low = high;
+    
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint64_t flags = irq_save();
+        page_caches[cpu].high = high;
+        page_caches[cpu].low = low;
+        irq_restore(flags);
+    }
+}
+
+// Compaction
+//
+// High-order allocations fail once free memory is scattered across 2 MB
+// regions that each hold a few pages still in use. Compaction scans up from
+// the bottom of memory for regions where every used frame is movable and
+// few are in use, copies those frames into holes found scanning down from
+// the top, repoints their PTEs and page cache entry, and hands the whole
+// region back as one block. The run ends where the two scanners meet.
+// Frames keep no reverse mapping, so the PTEs are found by walking every
+// address space once per region.
+//
+// Other CPUs keep running in the address spaces a run walks, and may free
+// the frames it is moving. Each frame is isolated first, so a free from its
+// owner is left to compaction; then its PTEs are marked not present and
+// shot down from every TLB, and only if the references still add up once
+// nothing can reach it through a PTE is it copied. A fault on a marked
+// page waits until the remap brings it back, pointing at the new frame.
+// Interrupts are off for one region at a time.
+
+static compact_stats_t compact_stats;
+static spinlock_t compact_lock = SPINLOCK_INIT; // Guards compact_stats
+static bool compact_running; // One run at a time; the rest give up
+
+// Per-frame state for the region being emptied, indexed by offset
+static uint64_t compact_target[COMPACT_REGION_PAGES]; // New frame, 0 if not moving
+static uint32_t compact_mapcount[COMPACT_REGION_PAGES];
+static bool compact_isolated[COMPACT_REGION_PAGES]; // Moving frame pinned with PG_ISOLATED
+static bool compact_owned[COMPACT_REGION_PAGES];    // Free frame taken off the free lists
+static uint64_t compact_free_pfn; // Region the free scanner is taking targets from
+
+typedef enum {
+    COMPACT_COUNT,  // Count each frame's mappings
+    COMPACT_UNMAP,  // Hold them not present for the copy
+    COMPACT_REMAP,  // Point them at the targets, present again
+} compact_pass_t;
+
+typedef struct {
+    uint64_t start; // Physical bounds of the region
+    uint64_t end;
+    compact_pass_t pass;
+    bool restore;   // COMPACT_REMAP back to the old frames: the move was abandoned
+} compact_walk_t;
+
+static void compact_visit(page_table_t* pml4, void* arg) {
+    compact_walk_t* walk = (compact_walk_t*)arg;
+    
+    for(uint64_t i = 0; i < 256; i++) {
+        if(!(pml4->entries[i] & PAGE_PRESENT)) continue;
+        
+        page_table_t* pdpt = (page_table_t*)(pml4->entries[i] & PAGE_ADDR_MASK);
+        for(uint64_t j = 0; j < 512; j++) {
+            uint64_t pdpte = pdpt->entries[j];
+            if(!(pdpte & PAGE_PRESENT) || (pdpte & PAGE_SIZE_FLAG)) continue;
+            
+            page_table_t* pd = (page_table_t*)(pdpte & PAGE_ADDR_MASK);
+            for(uint64_t k = 0; k < 512; k++) {
+                uint64_t pde = pd->entries[k];
+                if(!(pde & PAGE_PRESENT) || (pde & PAGE_SIZE_FLAG)) continue;
+                
+                page_table_t* pt = (page_table_t*)(pde & PAGE_ADDR_MASK);
+                for(uint64_t l = 0; l < 512; l++) {
+                    uint64_t pte = pt->entries[l];
+                    uint64_t phys = pte & PAGE_ADDR_MASK;
+                    if(!(pte & (PAGE_PRESENT | PAGE_MIGRATING))) continue;
+                    if(phys < walk->start || phys >= walk->end) continue;
+                    
+                    uint64_t index = (phys - walk->start) / PAGE_SIZE;
+                    if(walk->pass == COMPACT_COUNT) {
+                        compact_mapcount[index]++;
+                    } else if(walk->pass == COMPACT_UNMAP) {
+                        if(pte & PAGE_PRESENT) pt->entries[l] = (pte & ~(uint64_t)PAGE_PRESENT) | PAGE_MIGRATING;
+                    } else if(pte & PAGE_MIGRATING) {
+                        uint64_t frame = walk->restore ? phys : compact_target[index];
+                        pte &= ~PAGE_ADDR_MASK & ~(uint64_t)PAGE_MIGRATING;
+                        pt->entries[l] = frame | pte | PAGE_PRESENT;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Callers hold buddy_lock. A region qualifies if it lies on one node, each
+// frame is either on a free list or movable, and at most COMPACT_SPARSE_MAX
+// of them are in use.
+static uint32_t compact_scan_region(uint64_t start_pfn) {
+    uint32_t node = frame_table[start_pfn].node;
+    uint32_t movable = 0;
+    
+    for(uint64_t pfn = start_pfn; pfn < start_pfn + COMPACT_REGION_PAGES; ) {
+        page_t* page = &frame_table[pfn];
+        if(page->node != node) return 0;
+        
+        if((page->flags & PG_BUDDY) && buddy_is_free(pfn, page->order)) {
+            // Already free as a whole, nothing to gain here
+            if(page->order >= COMPACT_REGION_ORDER) return 0;
+            pfn += 1ULL << page->order;
+            continue;
+        }
+        
+        if(!(page->flags & PG_MOVABLE)) return 0;
+        if(++movable > COMPACT_SPARSE_MAX) return 0;
+        pfn++;
+    }
+    
+    return movable;
+}
+
+// Take the region's free blocks off the free lists so neither the targets
+// nor anyone else can be given them
+static void compact_isolate_region(uint64_t start_pfn) {
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) compact_owned[i] = false;
+    
+    for(uint64_t pfn = start_pfn; pfn < start_pfn + COMPACT_REGION_PAGES; ) {
+        page_t* page = &frame_table[pfn];
+        
+        if((page->flags & PG_BUDDY) && buddy_is_free(pfn, page->order)) {
+            uint32_t order = page->order;
+            buddy_list_del(page, order);
+            for(uint64_t i = 0; i < (1ULL << order); i++) compact_owned[pfn - start_pfn + i] = true;
+            pfn += 1ULL << order;
+        } else {
+            pfn++;
+        }
+    }
+}
+
+// Callers hold buddy_lock. Take a free frame on 'node' for a migration
+// target from the highest region above 'floor_pfn' that has a hole. Wholly
+// free regions are left alone; filling them would undo the work.
+static uint64_t compact_alloc_target(uint64_t floor_pfn, uint32_t node) {
+    while(compact_free_pfn > floor_pfn) {
+        for(uint64_t pfn = compact_free_pfn; pfn < compact_free_pfn + COMPACT_REGION_PAGES; ) {
+            page_t* page = &frame_table[pfn];
+            
+            if(!(page->flags & PG_BUDDY) || !buddy_is_free(pfn, page->order) || page->node != node) {
+                pfn++;
+                continue;
+            }
+            
+            uint32_t order = page->order;
+            if(order >= COMPACT_REGION_ORDER) break;
+            
+            // Keep the first frame, return the rest as its split halves
+            buddy_list_del(page, order);
+            while(order > 0) {
+                order--;
+                buddy_list_add(page + (1ULL << order), order);
+            }
+            return pfn * PAGE_SIZE;
+        }
+        
+        compact_free_pfn -= COMPACT_REGION_PAGES;
+    }
+    
+    return 0;
+}
+
+// Put back what compact_isolate_region() took and the targets, once the
+// region is abandoned. Only frames compaction took are freed; one its owner
+// freed meanwhile is on that CPU's page cache already.
+static void compact_release_region(uint64_t start_pfn) {
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) {
+        if(compact_target[i]) {
+            buddy_free_block(compact_target[i] / PAGE_SIZE, 0);
+            compact_target[i] = 0;
+        }
+        if(compact_owned[i]) buddy_free_block(start_pfn + i, 0);
+    }
+}
+
+// Pin a movable frame against its owner freeing it. Fails if it was freed
+// or is no longer movable.
+static bool compact_isolate_page(page_t* page) {
+    uint32_t flags = __atomic_load_n(&page->flags, __ATOMIC_ACQUIRE);
+    while((flags & (PG_MOVABLE | PG_ISOLATED)) == PG_MOVABLE) {
+        if(__atomic_compare_exchange_n(&page->flags, &flags, flags | PG_ISOLATED, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return true;
+    }
+    return false;
+}
+
+// Unpin after an abandoned move. A frame its owner freed meanwhile is freed
+// here, the free it was spared.
+static void compact_putback_region(uint64_t start_pfn) {
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) {
+        if(!compact_isolated[i]) continue;
+        compact_isolated[i] = false;
+        
+        page_t* page = &frame_table[start_pfn + i];
+        uint32_t flags = __atomic_fetch_and(&page->flags, ~(uint32_t)(PG_ISOLATED | PG_RELEASED),
+                                            __ATOMIC_ACQ_REL);
+        if(flags & PG_RELEASED) free_page((void*)page_to_phys(page));
+    }
+}
+
+// Empty one region, already isolated. Callers hold interrupts off. Returns
+// false, with everything put back as it was, if a frame has references no
+// PTE or cache entry accounts for (the kernel is using it right now), its
+// owner freed it, or the free scanner ran out of room above the region.
+static bool compact_region(uint64_t start_pfn) {
+    compact_walk_t walk = {
+        .start = start_pfn * PAGE_SIZE,
+        .end = (start_pfn + COMPACT_REGION_PAGES) * PAGE_SIZE,
+        .pass = COMPACT_COUNT,
+        .restore = false,
+    };
+    
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) {
+        compact_target[i] = 0;
+        compact_mapcount[i] = 0;
+        compact_isolated[i] = false;
+    }
+    
+    spin_lock(&buddy_lock);
+    bool ok = true;
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES && ok; i++) {
+        if(compact_owned[i]) continue;
+        
+        // Anything not on a free list when the region was scanned must
+        // still be a movable frame in use
+        ok = compact_isolate_page(&frame_table[start_pfn + i]);
+        compact_isolated[i] = ok;
+        if(!ok) break;
+        
+        compact_target[i] = compact_alloc_target(start_pfn, frame_table[start_pfn].node);
+        ok = compact_target[i] != 0;
+    }
+    spin_unlock(&buddy_lock);
+    
+    // Nothing reaches the frames through a PTE once they are marked and shot
+    // down, so the references counted after that stay counted
+    if(ok) {
+        walk.pass = COMPACT_UNMAP;
+        for_each_address_space(compact_visit, &walk);
+        smp_flush_tlb_all();
+        
+        walk.pass = COMPACT_COUNT;
+        for_each_address_space(compact_visit, &walk);
+        
+        for(uint32_t i = 0; i < COMPACT_REGION_PAGES && ok; i++) {
+            if(!compact_target[i]) continue;
+            
+            page_t* page = &frame_table[start_pfn + i];
+            uint32_t refs = page->ref_count ? page->ref_count : 1;
+            if(__atomic_load_n(&page->flags, __ATOMIC_ACQUIRE) & PG_RELEASED) ok = false;
+            if(compact_mapcount[i] + (page->mapping ? 1 : 0) != refs) ok = false;
+        }
+    }
+    
+    if(!ok) {
+        walk.pass = COMPACT_REMAP;
+        walk.restore = true;
+        for_each_address_space(compact_visit, &walk);
+        compact_putback_region(start_pfn);
+        
+        spin_lock(&buddy_lock);
+        compact_release_region(start_pfn);
+        spin_unlock(&buddy_lock);
+        return false;
+    }
+    
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) {
+        if(!compact_target[i]) continue;
+        
+        uint64_t old_phys = (start_pfn + i) * PAGE_SIZE;
+        page_t* old_page = &frame_table[start_pfn + i];
+        page_t* new_page = phys_to_page(compact_target[i]);
+        
+        memory_copy((void*)compact_target[i], (void*)old_phys, PAGE_SIZE);
+        new_page->flags = PG_MOVABLE;
+        new_page->order = 0;
+        new_page->mapping = NULL;
+        
+        if(old_page->mapping) filemap_migrate_page(old_phys, compact_target[i]);
+    }
+    
+    walk.pass = COMPACT_REMAP;
+    for_each_address_space(compact_visit, &walk);
+    
+    // The old frames belong to the region now. If an owner let go of one
+    // after all, the free lands on the copy instead.
+    for(uint32_t i = 0; i < COMPACT_REGION_PAGES; i++) {
+        if(!compact_target[i]) continue;
+        
+        page_t* old_page = &frame_table[start_pfn + i];
+        page_t* new_page = phys_to_page(compact_target[i]);
+        new_page->ref_count = old_page->ref_count;
+        
+        uint32_t flags = __atomic_exchange_n(&old_page->flags, 0, __ATOMIC_ACQ_REL);
+        old_page->ref_count = 0;
+        compact_isolated[i] = false;
+        if(flags & PG_RELEASED) free_page((void*)compact_target[i]);
+    }
+    
+    spin_lock(&buddy_lock);
+    buddy_free_block(start_pfn, COMPACT_REGION_ORDER);
+    spin_unlock(&buddy_lock);
+    
+    return true;
+}
+
+static bool buddy_has_order(uint32_t order) {
+    for(uint32_t node = 0; node < numa_node_count(); node++) {
+        for(uint32_t o = order; o < MAX_BUDDY_ORDER; o++) {
+            if(buddy_nodes[node].free_areas[o].free_list) return true;
+        }
+    }
+    return false;
+}
+
+// Run both scanners over one node until a free block of 'order' exists
+// somewhere, or 'budget' regions have been tried. Migration never leaves
+// the node.
+static bool compact_node(uint32_t node, uint32_t order, uint32_t* budget) {
+    buddy_node_t* buddy = &buddy_nodes[node];
+    uint64_t first = buddy->start_pfn < BUDDY_BASE / PAGE_SIZE ? BUDDY_BASE / PAGE_SIZE : buddy->start_pfn;
+    first = (first + COMPACT_REGION_PAGES - 1) & ~(uint64_t)(COMPACT_REGION_PAGES - 1);
+    
+    compact_free_pfn = buddy->end_pfn & ~(uint64_t)(COMPACT_REGION_PAGES - 1);
+    if(compact_free_pfn < first + COMPACT_REGION_PAGES) return false;
+    compact_free_pfn -= COMPACT_REGION_PAGES;
+    
+    bool done = false;
+    for(uint64_t pfn = first; !done && *budget && pfn < compact_free_pfn; pfn += COMPACT_REGION_PAGES) {
+        uint64_t flags = irq_save();
+        spin_lock(&buddy_lock);
+        uint32_t movable = compact_scan_region(pfn);
+        if(movable) compact_isolate_region(pfn);
+        spin_unlock(&buddy_lock);
+        
+        bool freed = movable && compact_region(pfn);
+        if(freed) done = buddy_has_order(order);
+        
+        spin_lock(&compact_lock);
+        compact_stats.regions_scanned++;
+        if(freed) {
+            compact_stats.regions_freed++;
+            compact_stats.pages_migrated += movable;
+        } else if(movable) {
+            compact_stats.regions_aborted++;
+        }
+        spin_unlock(&compact_lock);
+        irq_restore(flags);
+        
+        if(movable) (*budget)--;
+    }
+    
+    return done;
+}
+
+// Empty sparse regions until a free block of 'order' exists, this CPU's
+// node first. Called when a high-order allocation fails, or on demand with
+// MAX_BUDDY_ORDER - 1 to defragment as far as possible; either way a run
+// tries at most COMPACT_RUN_REGIONS regions. Returns true if such a block is
+// free, false as well if another CPU's run is in progress.
+bool compact_memory(uint32_t order) {
+    if(order == 0 || order >= MAX_BUDDY_ORDER) return false;
+    if(__atomic_exchange_n(&compact_running, true, __ATOMIC_ACQUIRE)) return false;
+    
+    uint64_t start_cycles = rdtsc();
+    
+    // Frames parked in this CPU's page cache or the zero pool look in use;
+    // give them back so their regions can qualify
+    uint64_t flags = irq_save();
+    page_cache_t* cache = &page_caches[cpu_id()];
+    spin_lock(&buddy_lock);
+    while(cache->count) {
+        page_t* page = page_cache_pop(cache, true);
+        buddy_free_block((uint64_t)(page - frame_table), 0);
+    }
+    spin_unlock(&buddy_lock);
+    irq_restore(flags);
+    
+    page_t* page;
+    while((page = zero_pool_pop())) {
+        flags = irq_save();
+        spin_lock(&buddy_lock);
+        buddy_free_block((uint64_t)(page - frame_table), 0);
+        spin_unlock(&buddy_lock);
+        irq_restore(flags);
+    }
+    
+    uint32_t budget = COMPACT_RUN_REGIONS;
+    bool done = buddy_has_order(order);
+    const uint32_t* fallback = numa_fallback(numa_node_id());
+    for(uint32_t i = 0; !done && budget && i < numa_node_count(); i++) {
+        done = compact_node(fallback[i], order, &budget);
+    }
+    
+    flags = irq_save();
+    spin_lock(&compact_lock);
+    compact_stats.runs++;
+    if(done) compact_stats.successes++;
+    compact_stats.cycles += rdtsc() - start_cycles;
+    spin_unlock(&compact_lock);
+    irq_restore(flags);
+    
+    __atomic_store_n(&compact_running, false, __ATOMIC_RELEASE);
+    return done;
+}
+
+void get_compact_stats(compact_stats_t* stats) {
+    uint64_t flags = irq_save();
+    spin_lock(&compact_lock);
+    *stats = compact_stats;
+    spin_unlock(&compact_lock);
+    irq_restore(flags);
+}
+
+void init_slab_allocator(void) {
+    slab_cache_count = 0;
+    magazine_cache = NULL;
+    magazine_cache = create_slab_cache("slab_magazine", sizeof(slab_magazine_t), 32);
+    
+    // Create common object caches
+    create_slab_cache("process", sizeof(process_t), 64);
+    create_slab_cache("file_desc", sizeof(file_descriptor_t), 128);
+    create_slab_cache("driver", sizeof(driver_t), 32);
+    
+    // kmalloc classes: 16, 24, 32, 48, ... 6144, 8192, one set per node so
+    // objects come from memory near the CPU that asked
+    for(uint32_t node = 0; node < numa_node_count(); node++) {
+        for(uint32_t i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+            uint64_t size = (i % 2) ? (3ULL << (i / 2 + 3)) : (1ULL << (i / 2 + 4));
+            
+            // Aim for at least eight objects per slab
+            slab_cache_t* cache = create_slab_cache(kmalloc_names[i], size, size >= 1024 ? 8 : PAGE_SIZE / size);
+            if(cache && numa_node_count() > 1) cache->node = node;
+            kmalloc_caches[node][i] = cache;
+        }
+    }
+}
+
+slab_cache_t* create_slab_cache(const char* name, size_t object_size, uint32_t objects_per_slab) {
+    if(slab_cache_count >= MAX_SLAB_CACHES) return NULL;
+    
+    // Free objects carry the freelist pointer, so they must hold one
+    if(object_size < sizeof(void*)) object_size = sizeof(void*);
+    object_size = (object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    
+    uint32_t first_object = (sizeof(slab_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    uint32_t order = get_order(first_object + (uint64_t)objects_per_slab * object_size);
+    if(order >= MAX_BUDDY_ORDER) return NULL;
+    
+    slab_cache_t* cache = &slab_caches[slab_cache_count++];
+    strncpy(cache->name, name, 63);
+    cache->name[63] = '\0';
+    cache->object_size = object_size;
+    cache->slab_order = order;
+    cache->first_object = first_object;
+    cache->node = NUMA_NO_NODE;
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    
+    // Use the whole slab, not just what the caller asked for
+    cache->objects_per_slab = (((uint64_t)PAGE_SIZE << order) - first_object) / object_size;
+    
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->empty_count = 0;
+    
+    cache->active_objects = 0;
+    cache->slab_count = 0;
+    cache->alloc_count = 0;
+    cache->free_count = 0;
+    cache->sample_time = get_system_time();
+    cache->sample_allocs = 0;
+    
+    cache->use_magazines = magazine_cache != NULL;
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
+    cache->depot_full_count = 0;
+    cache->depot_limit = SLAB_DEPOT_SIZE;
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cache->cpu[cpu].loaded = NULL;
+        cache->cpu[cpu].previous = NULL;
+        cache->cpu[cpu].alloc_hits = 0;
+        cache->cpu[cpu].free_hits = 0;
+        cache->cpu[cpu].misses = 0;
+    }
+    
+    return cache;
+}
+
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_del(slab_t** list, slab_t* slab) {
+    if(slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void destroy_slab(slab_cache_t* cache, slab_t* slab) {
+    page_t* page = phys_to_page((uint64_t)slab);
+    for(uint32_t i = 0; i < (1U << cache->slab_order); i++) {
+        page[i].flags &= ~PG_SLAB;
+        page[i].slab_cache = NULL;
+    }
+    
+    cache->slab_count--;
+    do_buddy_free(slab, cache->slab_order);
+}
+
+slab_t* create_slab(slab_cache_t* cache) {
+    slab_t* slab = (slab_t*)buddy_alloc_atomic(cache->slab_order, cache->node);
+    if(!slab) return NULL;
+    
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+    
+    // Tag every page so kfree can find the cache from any object
+    page_t* page = phys_to_page((uint64_t)slab);
+    for(uint32_t i = 0; i < (1U << cache->slab_order); i++) {
+        page[i].flags |= PG_SLAB;
+        page[i].slab_cache = cache;
+    }
+    
+    // Thread the freelist through the objects in address order
+    uint8_t* object = (uint8_t*)slab + cache->first_object;
+    slab->freelist = object;
+    for(uint32_t i = 0; i + 1 < cache->objects_per_slab; i++) {
+        *(void**)object = object + cache->object_size;
+        object += cache->object_size;
+    }
+    *(void**)object = NULL;
+    
+    cache->slab_count++;
+    return slab;
+}
+
+static void* slab_alloc_object(slab_cache_t* cache) {
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    
+    // Prefer partial slabs, then empty ones, then a fresh slab
+    slab_t* slab = cache->partial;
+    if(!slab && cache->empty) {
+        slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        slab_list_add(&cache->partial, slab);
+        cache->empty_count--;
+    }
+    if(!slab) {
+        slab = create_slab(cache);
+        if(!slab) {
+            spin_unlock(&cache->lock);
+            irq_restore(flags);
+            return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    void* object = slab->freelist;
+    slab->freelist = *(void**)object;
+    slab->in_use++;
+    
+    if(!slab->freelist) {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    
+    cache->active_objects++;
+    cache->alloc_count++;
+    
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+    return object;
+}
+
+static void slab_free_object(slab_cache_t* cache, void* ptr) {
+    slab_t* slab = (slab_t*)((uint64_t)ptr & ~(((uint64_t)PAGE_SIZE << cache->slab_order) - 1));
+    
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    
+    bool was_full = slab->freelist == NULL;
+    *(void**)ptr = slab->freelist;
+    slab->freelist = ptr;
+    slab->in_use--;
+    
+    if(was_full) {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    if(slab->in_use == 0) {
+        slab_list_del(&cache->partial, slab);
+        
+        if(cache->empty_count < SLAB_MAX_EMPTY) {
+            slab_list_add(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            destroy_slab(cache, slab);
+        }
+    }
+    
+    cache->active_objects--;
+    cache->free_count++;
+    
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+}
+
+// Magazine layer
+
+static void magazine_destroy(slab_cache_t* cache, slab_magazine_t* magazine) {
+    while(magazine->rounds) {
+        slab_free_object(cache, magazine->objects[--magazine->rounds]);
+    }
+    slab_free_object(magazine_cache, magazine);
+}
+
+// Called with interrupts off on the owning CPU
+static void* magazine_alloc(slab_cache_t* cache, slab_cpu_cache_t* cpu) {
+    if(cpu->loaded && cpu->loaded->rounds) {
+        cpu->alloc_hits++;
+        return cpu->loaded->objects[--cpu->loaded->rounds];
+    }
+    
+    if(cpu->previous && cpu->previous->rounds) {
+        slab_magazine_t* swap = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = swap;
+        cpu->alloc_hits++;
+        return cpu->loaded->objects[--cpu->loaded->rounds];
+    }
+    
+    // Both magazines are empty: trade one for a full magazine from the depot
+    spin_lock(&cache->lock);
+    slab_magazine_t* full = cache->depot_full;
+    if(!full) {
+        spin_unlock(&cache->lock);
+        cpu->misses++;
+        return NULL;
+    }
+    
+    cache->depot_full = full->next;
+    cache->depot_full_count--;
+    if(cpu->previous) {
+        cpu->previous->next = cache->depot_empty;
+        cache->depot_empty = cpu->previous;
+    }
+    spin_unlock(&cache->lock);
+    
+    cpu->previous = cpu->loaded;
+    cpu->loaded = full;
+    cpu->alloc_hits++;
+    return full->objects[--full->rounds];
+}
+
+// Called with interrupts off on the owning CPU
+static bool magazine_free(slab_cache_t* cache, slab_cpu_cache_t* cpu, void* ptr) {
+    if(cpu->loaded && cpu->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+        cpu->loaded->objects[cpu->loaded->rounds++] = ptr;
+        cpu->free_hits++;
+        return true;
+    }
+    
+    if(cpu->previous && cpu->previous->rounds == 0) {
+        slab_magazine_t* swap = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = swap;
+        cpu->loaded->objects[cpu->loaded->rounds++] = ptr;
+        cpu->free_hits++;
+        return true;
+    }
+    
+    // Both magazines are full (or missing): park one in the depot and load
+    // an empty one, unless the depot is already at its limit
+    spin_lock(&cache->lock);
+    if(cache->depot_full_count >= cache->depot_limit) {
+        spin_unlock(&cache->lock);
+        cpu->misses++;
+        return false;
+    }
+    
+    slab_magazine_t* empty = cache->depot_empty;
+    if(empty) cache->depot_empty = empty->next;
+    spin_unlock(&cache->lock);
+    
+    if(!empty) {
+        empty = (slab_magazine_t*)slab_alloc_object(magazine_cache);
+        if(!empty) {
+            cpu->misses++;
+            return false;
+        }
+    }
+    empty->rounds = 0;
+    
+    if(cpu->previous) {
+        spin_lock(&cache->lock);
+        cpu->previous->next = cache->depot_full;
+        cache->depot_full = cpu->previous;
+        cache->depot_full_count++;
+        spin_unlock(&cache->lock);
+    }
+    
+    cpu->previous = cpu->loaded;
+    cpu->loaded = empty;
+    empty->objects[empty->rounds++] = ptr;
+    cpu->free_hits++;
+    return true;
+}
+
+static void* do_slab_alloc(slab_cache_t* cache) {
+    if(cache->use_magazines) {
+        uint64_t flags = irq_save();
+        void* object = magazine_alloc(cache, &cache->cpu[cpu_id()]);
+        irq_restore(flags);
+        
+        if(object) return object;
+    }
+    
+    return slab_alloc_object(cache);
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    void* object = do_slab_alloc(cache);
+    kmemprof_alloc(KMEMPROF_SLAB, object, cache->object_size);
+    return object;
+}
+
+static void do_slab_free(slab_cache_t* cache, void* ptr) {
+    if(!ptr) return;
+    
+    slab_t* slab = (slab_t*)((uint64_t)ptr & ~(((uint64_t)PAGE_SIZE << cache->slab_order) - 1));
+    if(slab->cache != cache) return; // Not ours
+    
+    if(cache->use_magazines) {
+        uint64_t flags = irq_save();
+        bool cached = magazine_free(cache, &cache->cpu[cpu_id()], ptr);
+        irq_restore(flags);
+        
+        if(cached) return;
+    }
+    
+    slab_free_object(cache, ptr);
+}
+
+void slab_free(slab_cache_t* cache, void* ptr) {
+    kmemprof_free(ptr);
+    do_slab_free(cache, ptr);
+}
+
+void slab_cache_set_depot_size(slab_cache_t* cache, uint32_t full_magazines) {
+    slab_magazine_t* excess = NULL;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    
+    cache->depot_limit = full_magazines;
+    while(cache->depot_full_count > full_magazines) {
+        slab_magazine_t* magazine = cache->depot_full;
+        cache->depot_full = magazine->next;
+        cache->depot_full_count--;
+        magazine->next = excess;
+        excess = magazine;
+    }
+    
+    spin_unlock(&cache->lock);
+    
+    while(excess) {
+        slab_magazine_t* next = excess->next;
+        magazine_destroy(cache, excess);
+        excess = next;
+    }
+    
+    irq_restore(flags);
+}
+
+// Return every magazine this CPU and the depot hold to the slabs
+static void magazine_flush(slab_cache_t* cache) {
+    uint64_t flags = irq_save();
+    slab_cpu_cache_t* cpu = &cache->cpu[cpu_id()];
+    
+    if(cpu->loaded) magazine_destroy(cache, cpu->loaded);
+    if(cpu->previous) magazine_destroy(cache, cpu->previous);
+    cpu->loaded = NULL;
+    cpu->previous = NULL;
+    
+    spin_lock(&cache->lock);
+    slab_magazine_t* full = cache->depot_full;
+    slab_magazine_t* empty = cache->depot_empty;
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
+    cache->depot_full_count = 0;
+    spin_unlock(&cache->lock);
+    
+    while(full) {
+        slab_magazine_t* next = full->next;
+        magazine_destroy(cache, full);
+        full = next;
+    }
+    while(empty) {
+        slab_magazine_t* next = empty->next;
+        magazine_destroy(cache, empty);
+        empty = next;
+    }
+    
+    irq_restore(flags);
+}
+
+// Give every empty slab back to the buddy allocator, returning pages freed
+uint32_t slab_cache_shrink(slab_cache_t* cache) {
+    uint32_t pages = 0;
+    
+    // Flushed magazines free their own slabs too
+    if(cache->use_magazines) {
+        magazine_flush(cache);
+        pages += slab_cache_shrink(magazine_cache);
+    }
+    
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    
+    while(cache->empty) {
+        slab_t* slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        cache->empty_count--;
+        
+        destroy_slab(cache, slab);
+        pages += 1U << cache->slab_order;
+    }
+    
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+    
+    return pages;
+}
+
+// Empty slabs are pure cache; give them back under memory pressure
+static uint64_t slab_shrinker_count(void) {
+    uint64_t pages = 0;
+    for(uint32_t i = 0; i < slab_cache_count; i++) {
+        pages += (uint64_t)slab_caches[i].empty_count << slab_caches[i].slab_order;
+    }
+    return pages;
+}
+
+static uint64_t slab_shrinker_scan(uint64_t pages) {
+    uint64_t freed = 0;
+    for(uint32_t i = 0; i < slab_cache_count && freed < pages; i++) {
+        if(slab_caches[i].empty_count) freed += slab_cache_shrink(&slab_caches[i]);
+    }
+    return freed;
+}
+
+static shrinker_t slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrinker_count,
+    .scan = slab_shrinker_scan,
+    .seeks = 1,
+};
+
+void get_slab_stats(slab_cache_t* cache, slab_stats_t* stats) {
+    uint64_t flags = irq_save();
+    spin_lock(&cache->lock);
+    
+    strcpy(stats->name, cache->name);
+    stats->node = cache->node;
+    stats->object_size = cache->object_size;
+    
+    // Objects parked in magazines are free to callers but busy to the slabs
+    uint64_t cached = (uint64_t)cache->depot_full_count * SLAB_MAGAZINE_SIZE;
+    uint64_t alloc_hits = 0;
+    uint64_t free_hits = 0;
+    uint64_t misses = 0;
+    
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if(cache->cpu[cpu].loaded) cached += cache->cpu[cpu].loaded->rounds;
+        if(cache->cpu[cpu].previous) cached += cache->cpu[cpu].previous->rounds;
+        alloc_hits += cache->cpu[cpu].alloc_hits;
+        free_hits += cache->cpu[cpu].free_hits;
+        misses += cache->cpu[cpu].misses;
+    }
+    
+    stats->magazine_objects = cached;
+    stats->magazine_hits = alloc_hits + free_hits;
+    stats->magazine_misses = misses;
+    stats->magazine_hit_rate = stats->magazine_hits + misses ?
+        stats->magazine_hits * 100 / (stats->magazine_hits + misses) : 0;
+    
+    stats->active_objects = cache->active_objects - cached;
+    stats->total_objects = cache->slab_count * cache->objects_per_slab;
+    stats->slabs = cache->slab_count;
+    stats->empty_slabs = cache->empty_count;
+    stats->alloc_count = cache->alloc_count + alloc_hits;
+    stats->free_count = cache->free_count + free_hits;
+    
+    // Rate over the interval since the last snapshot (system time is in ms)
+    uint64_t now = get_system_time();
+    uint64_t elapsed = now - cache->sample_time;
+    stats->alloc_rate = elapsed ? (stats->alloc_count - cache->sample_allocs) * 1000 / elapsed : 0;
+    cache->sample_time = now;
+    cache->sample_allocs = stats->alloc_count;
+    
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+}
+
+uint32_t get_slab_cache_count(void) {
+    return slab_cache_count;
+}
+
+slab_cache_t* get_slab_cache(uint32_t index) {
+    return index < slab_cache_count ? &slab_caches[index] : NULL;
+}
+
+// Kernel memory allocation
+
+// Map a size to its class: sizes in (2^b, 2^(b+1)] use 3 * 2^(b-1) when it
+// fits, otherwise 2^(b+1)
+static uint32_t kmalloc_index(size_t size) {
+    if(size <= KMALLOC_MIN_SIZE) return 0;
+    
+    uint32_t bits = 63 - __builtin_clzll(size - 1);
+    if(size <= (3ULL << (bits - 1))) return 2 * (bits - 4) + 1;
+    return 2 * (bits - 3);
+}
+
+// Allocate from 'node', or the calling CPU's node for NUMA_NO_NODE. Other
+// nodes are only used once the preferred one has nothing left.
+static void* do_kmalloc(size_t size, uint32_t node) {
+    if(size == 0) return NULL;
+    if(node != NUMA_NO_NODE && node >= numa_node_count()) node = NUMA_NO_NODE;
+    
+    if(size <= KMALLOC_MAX_SIZE) {
+        uint32_t set = node == NUMA_NO_NODE ? numa_node_id() : node;
+        slab_cache_t* cache = kmalloc_caches[set][kmalloc_index(size)];
+        void* object = do_slab_alloc(cache);
+        if(!object && reclaim_direct(1U << cache->slab_order)) object = do_slab_alloc(cache);
+        return object;
+    }
+    
+    uint32_t order = get_order(size);
+    void* block = do_buddy_alloc(order, node);
+    if(!block && reclaim_direct(1ULL << order)) block = do_buddy_alloc(order, node);
+    if(!block) return NULL;
+    
+    phys_to_page((uint64_t)block)->flags |= PG_LARGE;
+    return block;
+}
+
+void* kmalloc_node(size_t size, uint32_t node) {
+    void* ptr = do_kmalloc(size, node);
+    kmemprof_alloc(KMEMPROF_KMALLOC, ptr, size);
+    return ptr;
+}
+
+void* kmalloc(size_t size) {
+    void* ptr = do_kmalloc(size, NUMA_NO_NODE);
+    kmemprof_alloc(KMEMPROF_KMALLOC, ptr, size);
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if(!ptr) return;
+    
+    if(is_vmalloc_address(ptr)) {
+        vfree(ptr);
+        return;
+    }
+    
+    page_t* page = phys_to_page((uint64_t)ptr);
+    
+    if(page->flags & PG_SLAB) {
+        kmemprof_free(ptr);
+        do_slab_free(page->slab_cache, ptr);
+    } else if(page->flags & PG_LARGE) {
+        kmemprof_free(ptr);
+        page->flags &= ~PG_LARGE;
+        do_buddy_free(ptr, page->order);
+    }
+}
+
+// Extend a large allocation in place by absorbing the free buddies above it.
+// Only possible while the block is the lower half at each order it grows to.
+static bool buddy_grow_in_place(page_t* page, uint32_t new_order) {
+    uint64_t pfn = (uint64_t)(page - frame_table);
+    uint32_t order = page->order;
+    bool grown = false;
+    
+    if(new_order >= MAX_BUDDY_ORDER || (pfn & ((1ULL << new_order) - 1))) return false;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&buddy_lock);
+    
+    uint32_t check = order;
+    while(check < new_order && buddy_is_free(pfn + (1ULL << check), check) &&
+          frame_table[pfn + (1ULL << check)].node == page->node) {
+        check++;
+    }
+    
+    if(check == new_order) {
+        for(uint32_t o = order; o < new_order; o++) {
+            buddy_list_del(&frame_table[pfn + (1ULL << o)], o);
+        }
+        page->order = new_order;
+        grown = true;
+    }
+    
+    spin_unlock(&buddy_lock);
+    irq_restore(flags);
+    
+    return grown;
+}
+
+void* krealloc(void* ptr, size_t new_size) {
+    if(!ptr) {
+        ptr = do_kmalloc(new_size, NUMA_NO_NODE);
+        kmemprof_alloc(KMEMPROF_KMALLOC, ptr, new_size);
+        return ptr;
+    }
+    if(new_size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+    
+    // vmalloc areas have no frame table entry; grow into a new area
+    if(is_vmalloc_address(ptr)) {
+        size_t old_size = vmalloc_size(ptr);
+        if(!old_size) return NULL; // Not a vmalloc area
+        if(new_size <= old_size) return ptr;
+        
+        void* new_ptr = vmalloc(new_size);
+        if(!new_ptr) return NULL;
+        
+        memory_copy(new_ptr, ptr, old_size);
+        vfree(ptr);
+        return new_ptr;
+    }
+    
+    page_t* page = phys_to_page((uint64_t)ptr);
+    size_t old_size;
+    
+    if(page->flags & PG_SLAB) {
+        old_size = page->slab_cache->object_size;
+    } else if(page->flags & PG_LARGE) {
+        old_size = (uint64_t)PAGE_SIZE << page->order;
+        
+        if(new_size > old_size && buddy_grow_in_place(page, get_order(new_size))) {
+            kmemprof_free(ptr);
+            kmemprof_alloc(KMEMPROF_KMALLOC, ptr, new_size);
+            return ptr;
+        }
+    } else {
+        return NULL; // Not a kmalloc pointer
+    }
+    
+    if(new_size <= old_size) return ptr;
+    
+    void* new_ptr = do_kmalloc(new_size, NUMA_NO_NODE);
+    if(!new_ptr) return NULL;
+    kmemprof_alloc(KMEMPROF_KMALLOC, new_ptr, new_size);
+    
+    memory_copy(new_ptr, ptr, old_size);
+    kfree(ptr);
+    return new_ptr;
+}
+
+void* kcalloc(size_t count, size_t size) {
+    if(size && count > (size_t)-1 / size) return NULL;
+    
+    void* ptr = do_kmalloc(count * size, NUMA_NO_NODE);
+    kmemprof_alloc(KMEMPROF_KMALLOC, ptr, count * size);
+    if(ptr) memory_set(ptr, 0, count * size);
+    return ptr;
+}
+
+// Memory statistics
+void get_memory_stats(memory_stats_t* stats) {
+    stats->total_memory = total_memory;
+    stats->available_memory = get_free_memory();
+    stats->used_memory = get_used_memory();
+    stats->cached_memory = 0;
+    stats->buffer_memory = 0;
+    
+    for(int i = 0; i < MAX_BUDDY_ORDER; i++) {
+        stats->free_blocks[i] = 0;
+        for(uint32_t node = 0; node < numa_node_count(); node++) {
+            stats->free_blocks[i] += buddy_nodes[node].free_areas[i].free_count;
+        }
+    }
+    
+    stats->page_cache_pages = 0;
+    stats->page_cache_hits = 0;
+    stats->page_cache_refills = 0;
+    stats->page_cache_drains = 0;
+    
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        stats->page_cache_pages += page_caches[cpu].count;
+        stats->page_cache_hits += page_caches[cpu].hits;
+        stats->page_cache_refills += page_caches[cpu].refills;
+        stats->page_cache_drains += page_caches[cpu].drains;
+    }
+    
+    stats->zero_pool_pages = zero_pool_count;
+    stats->zero_pool_hits = zero_pool_hits;
+    stats->zero_pool_misses = zero_pool_misses;
+    
+    reclaim_stats_t reclaim;
+    get_reclaim_stats(&reclaim);
+    stats->reclaimable_memory = reclaim.reclaimable_pages * PAGE_SIZE;
+    stats->kswapd_wakeups = reclaim.kswapd_wakeups;
+    stats->kswapd_reclaimed = reclaim.kswapd_reclaimed;
+    stats->direct_reclaims = reclaim.direct_reclaims;
+    stats->direct_reclaimed = reclaim.direct_reclaimed;
+    stats->direct_failures = reclaim.direct_failures;
+}
+
+uint64_t get_free_memory(void) {
+    uint64_t free_pages = free_physical_page_count + buddy_free_pages;
+    
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        free_pages += page_caches[cpu].count;
+    }
+    
+    free_pages += zero_pool_count;
+    
+    return free_pages * PAGE_SIZE;
+}
+
+// Pages alloc_page() can hand out without reclaiming. Per-CPU caches are
+// left out, so this errs low.
+uint64_t get_buddy_free_pages(void) {
+    return buddy_free_pages + zero_pool_count;
+}
+
+void get_numa_stats(uint32_t node, numa_stats_t* stats) {
+    buddy_node_t* buddy = &buddy_nodes[node < numa_node_count() ? node : 0];
+    
+    uint64_t flags = irq_save();
+    spin_lock(&buddy_lock);
+    stats->total_pages = buddy->present_pages;
+    stats->free_pages = buddy->free_pages;
+    stats->preferred_allocs = buddy->preferred_allocs;
+    stats->fallback_allocs = buddy->fallback_allocs;
+    spin_unlock(&buddy_lock);
+    irq_restore(flags);
+}
+
+uint64_t get_used_memory(void) {
+    return available_memory - get_free_memory();
+}
+
+// Utility functions
+void set_bit(uint8_t* bitmap, uint64_t bit) {
+    bitmap[bit / 8] |= (1 << (bit % 8));
+}
+
+void clear_bit(uint8_t* bitmap, uint64_t bit) {
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+bool test_bit(uint8_t* bitmap, uint64_t bit) {
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+int memory_compare(const void* ptr1, const void* ptr2, size_t size) {
+    const uint8_t* a = (const uint8_t*)ptr1;
+    const uint8_t* b = (const uint8_t*)ptr2;
+    
+    for(size_t i = 0; i < size; i++) {
+        if(a[i] != b[i]) return a[i] - b[i];
+    }
+    return 0;
+}
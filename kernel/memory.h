@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "spinlock.h"
+#include "cpu.h"
+#include "numa.h"
 
 // Page flags
 #define PAGE_PRESENT    0x001
@@ -14,44 +17,244 @@
 #define PAGE_DIRTY      0x040
 #define PAGE_SIZE_FLAG  0x080
 #define PAGE_GLOBAL     0x100
+#define PAGE_COW        0x200 // Available bit: read-only share, copy on write
+#define PAGE_SHARED     0x400 // Available bit: shared memory, stays writable across fork
+#define PAGE_MIGRATING  0x800 // Available bit: held not present while compaction moves the frame
 #define PAGE_NO_EXECUTE 0x8000000000000000ULL
+#define PAGE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+// Virtual memory layout
+#define PHYS_MAP_BASE 0xFFFF800000000000 // Higher-half direct map of all RAM
+#define VMALLOC_START 0xFFFFC00000000000 // One PML4 slot, shared by every address space
+#define VMALLOC_END   0xFFFFC08000000000
+#define LARGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_SIZE  0x40000000
+
+// Physical page allocator constants
+#define PHYS_BITMAP_BASE   0x200000
+#define MAX_PHYSICAL_PAGES (8ULL * 1024 * 1024) // 32 GB, the 1 MB bitmap window
+#define PHYS_L0_WORDS      (MAX_PHYSICAL_PAGES / 64)
+#define PHYS_L1_WORDS      (PHYS_L0_WORDS / 64)
+#define PHYS_L2_WORDS      (PHYS_L1_WORDS / 64)
 
 // Buddy allocator constants
 #define MAX_BUDDY_ORDER 20
 #define MIN_BUDDY_SIZE  4096
+#define BUDDY_BASE      0x1000000 // Memory below this stays with the page bitmap
+
+// Page frame flags
+#define PG_RESERVED 0x0001 // Not managed by the buddy allocator
+#define PG_BUDDY    0x0002 // Head of a free buddy block
+#define PG_SLAB     0x0004 // Part of a slab, slab_cache says which
+#define PG_LARGE    0x0008 // Head of a kmalloc allocation served by the buddy allocator
+#define PG_MOVABLE  0x0010 // User or page cache data that compaction may relocate
+#define PG_ISOLATED 0x0020 // Being moved by compaction, which frees it if its owner does
+#define PG_RELEASED 0x0040 // Freed by its owner while isolated
+
+// Per-CPU page cache defaults
+#define PAGE_CACHE_HIGH 96 // Drain cold pages once a CPU holds more than this
+#define PAGE_CACHE_LOW  32 // Refill to, and drain down to, this many pages
+
+// Page allocation flags
+#define ALLOC_COLD 0x0001 // Caller doesn't need a cache-warm page (DMA targets)
+#define ALLOC_ZERO 0x0002 // Return a zeroed page, from the pre-zeroed pool when possible
+#define ALLOC_ATOMIC 0x0004 // Caller may hold locks: fail rather than reclaim
+#define ALLOC_MOVABLE 0x0008 // Only reached through PTEs and the page cache
+
+// Compaction works on 2 MB regions, the size of a large page
+#define COMPACT_REGION_ORDER 9
+#define COMPACT_REGION_PAGES (1U << COMPACT_REGION_ORDER)
+#define COMPACT_SPARSE_MAX   (COMPACT_REGION_PAGES / 4) // Most pages a region may hold and still be emptied
+#define COMPACT_RUN_REGIONS  64 // Most regions one run tries to empty
+
+// Pre-zeroed page pool, filled by idle CPUs
+#define ZERO_POOL_TARGET 512 // Pages kept zeroed ahead of demand (2 MB)
 
 // Slab allocator constants
-#define MAX_SLAB_CACHES 64
-#define MAX_SLABS_PER_CACHE 256
+#define MAX_SLAB_CACHES 128 // Room for a set of kmalloc caches per node
+#define SLAB_ALIGN 8
+#define SLAB_MAX_EMPTY 2 // Empty slabs kept per cache before pages go back
+#define SLAB_MAGAZINE_SIZE 14 // Objects per magazine, keeps a magazine at 128 bytes
+#define SLAB_DEPOT_SIZE    8  // Default full magazines a cache's depot may hold
+
+// kmalloc size classes: powers of two and the 3/4 points between them
+#define KMALLOC_MIN_SIZE    16
+#define KMALLOC_MAX_SIZE    8192 // Larger requests go to the buddy allocator
+#define KMALLOC_CLASS_COUNT 19
+
+// vmalloc constants
+#define VMALLOC_BUCKETS  256
+#define VMALLOC_LAZY_MAX (32ULL * 1024 * 1024) // Freed address space held back before one TLB flush
 
 // Page table structure
 typedef struct {
     uint64_t entries[512];
 } page_table_t;
 
-// Buddy allocator block
-typedef struct buddy_block {
-    uint64_t address;
-    uint64_t size;
-    struct buddy_block* next;
-} buddy_block_t;
+// Page frame descriptor, one per physical page
+typedef struct page {
+    uint32_t flags;
+    uint32_t order;
+    uint32_t ref_count;
+    uint32_t node; // NUMA node the frame belongs to
+    struct page* next;
+    struct page* prev;
+    struct slab_cache* slab_cache;
+    void* mapping; // Page cache entry holding this frame, if any
+} page_t;
+
+// Buddy free area for one order
+typedef struct {
+    page_t* free_list;
+    uint64_t free_count;
+} free_area_t;
+
+// Buddy free lists for one NUMA node. Blocks never span two nodes.
+typedef struct {
+    free_area_t free_areas[MAX_BUDDY_ORDER];
+    uint64_t free_pages;
+    uint64_t present_pages;   // Frames handed to the buddy allocator
+    uint64_t start_pfn;       // Span of the node's frames, holes included
+    uint64_t end_pfn;
+    uint64_t preferred_allocs; // Blocks taken from this node by callers that asked for it
+    uint64_t fallback_allocs;  // Blocks taken from this node because the preferred one was empty
+} buddy_node_t;
+
+typedef struct {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t preferred_allocs;
+    uint64_t fallback_allocs;
+} numa_stats_t;
+
+// Per-CPU page frame cache. Hot pages are taken from and freed to the
+// head, cold pages come from and go to the tail.
+typedef struct {
+    page_t* head;
+    page_t* tail;
+    uint32_t count;
+    uint32_t high;
+    uint32_t low;
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t drains;
+} __attribute__((aligned(64))) page_cache_t;
 
-// Slab structure
+// Slab header, stored at the start of the slab's own pages. Slabs are
+// naturally aligned buddy blocks, so masking an object pointer finds it.
 typedef struct slab {
-    void* objects;
-    uint8_t* bitmap;
-    uint32_t free_objects;
+    struct slab_cache* cache;
+    void* freelist; // Each free object holds a pointer to the next one
+    uint32_t in_use;
+    uint32_t reserved;
     struct slab* next;
+    struct slab* prev;
 } slab_t;
 
-// Slab cache
+// Magazine of recently freed objects, used LIFO so reuse stays cache-warm
+typedef struct slab_magazine {
+    struct slab_magazine* next; // Depot list link
+    uint64_t rounds;
+    void* objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+// Per-CPU magazine pair. Allocations and frees that hit here take no lock.
 typedef struct {
+    slab_magazine_t* loaded;
+    slab_magazine_t* previous;
+    uint64_t alloc_hits;
+    uint64_t free_hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) slab_cpu_cache_t;
+
+// Slab cache
+typedef struct slab_cache {
     char name[64];
     size_t object_size;
     uint32_t objects_per_slab;
-    slab_t* slabs;
+    uint32_t slab_order;
+    uint32_t first_object; // Offset of object 0 past the header
+    uint32_t node;         // Node slabs come from, NUMA_NO_NODE for the caller's
+    spinlock_t lock;
+    
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;
+    uint32_t empty_count;
+    
+    // Statistics
+    uint64_t active_objects;
+    uint64_t slab_count;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t sample_time;
+    uint64_t sample_allocs;
+    
+    // Magazine layer
+    bool use_magazines;
+    slab_magazine_t* depot_full;
+    slab_magazine_t* depot_empty;
+    uint32_t depot_full_count;
+    uint32_t depot_limit;
+    slab_cpu_cache_t cpu[MAX_CPUS];
 } slab_cache_t;
 
+// Slab cache statistics snapshot
+typedef struct {
+    char name[64];
+    uint32_t node;
+    uint64_t object_size;
+    uint64_t active_objects;
+    uint64_t total_objects;
+    uint64_t slabs;
+    uint64_t empty_slabs;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t alloc_rate; // Allocations per second since the previous snapshot
+    uint64_t magazine_objects;
+    uint64_t magazine_hits;
+    uint64_t magazine_misses;
+    uint32_t magazine_hit_rate; // Percent of alloc/free calls served per-CPU
+} slab_stats_t;
+
+// Free vmalloc address range. Free ranges form a treap keyed by start,
+// each node tracking the largest range in its subtree for first-fit.
+typedef struct vmap_range {
+    uint64_t start;
+    uint64_t size;
+    uint64_t max_size;
+    uint32_t priority;
+    struct vmap_range* left;
+    struct vmap_range* right; // Also links the lazy-free list
+} vmap_range_t;
+
+// Live vmalloc allocation
+typedef struct vm_area {
+    uint64_t address;
+    uint64_t size; // Mapped bytes, the guard page after them excluded
+    struct vm_area* next;
+} vm_area_t;
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t mapped_bytes;
+    uint64_t free_ranges;
+    uint64_t largest_free;
+    uint64_t lazy_bytes;
+    uint64_t purges;
+} vmalloc_stats_t;
+
+// Compaction statistics
+typedef struct {
+    uint64_t runs;
+    uint64_t successes;       // Runs that ended with a free block of the wanted order
+    uint64_t regions_scanned;
+    uint64_t regions_freed;
+    uint64_t regions_aborted; // Given up: a frame was pinned or targets ran out
+    uint64_t pages_migrated;
+    uint64_t cycles;          // TSC cycles spent in compaction
+} compact_stats_t;
+
 // Memory statistics
 typedef struct {
     uint64_t total_memory;
@@ -59,6 +262,26 @@ typedef struct {
     uint64_t used_memory;
     uint64_t cached_memory;
     uint64_t buffer_memory;
+    uint64_t free_blocks[MAX_BUDDY_ORDER];
+    
+    // Per-CPU page caches, summed over all CPUs
+    uint64_t page_cache_pages;
+    uint64_t page_cache_hits;
+    uint64_t page_cache_refills;
+    uint64_t page_cache_drains;
+    
+    // Pre-zeroed page pool
+    uint64_t zero_pool_pages;
+    uint64_t zero_pool_hits;
+    uint64_t zero_pool_misses;
+    
+    // Reclaim
+    uint64_t reclaimable_memory; // Bytes registered shrinkers could free now
+    uint64_t kswapd_wakeups;
+    uint64_t kswapd_reclaimed;   // Pages
+    uint64_t direct_reclaims;
+    uint64_t direct_reclaimed;   // Pages
+    uint64_t direct_failures;    // Direct reclaims that freed less than asked
 } memory_stats_t;
 
 // Function prototypes
@@ -72,19 +295,51 @@ uint64_t alloc_physical_page(void);
 void free_physical_page(uint64_t address);
 uint64_t alloc_physical_pages(uint32_t count);
 void free_physical_pages(uint64_t address, uint32_t count);
+uint64_t get_free_physical_pages(void);
 
 // Virtual memory management
 void map_page(page_table_t* pml4, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
+void map_range(page_table_t* pml4, uint64_t virtual_addr, uint64_t physical_addr, uint64_t size, uint64_t flags);
+page_table_t* get_kernel_page_table(void);
 void unmap_page(page_table_t* pml4, uint64_t virtual_addr);
+void unmap_range(page_table_t* pml4, uint64_t virtual_addr, uint64_t size);
 uint64_t get_physical_address(page_table_t* pml4, uint64_t virtual_addr);
+uint64_t* get_pte(page_table_t* pml4, uint64_t virtual_addr);
+void copy_page_tables_cow(page_table_t* parent, page_table_t* child);
+void free_user_page_tables(page_table_t* pml4);
+void unmap_user_range(page_table_t* pml4, uint64_t start, uint64_t end);
+bool handle_cow_fault(page_table_t* pml4, uint64_t virtual_addr);
+bool page_is_migrating(page_table_t* pml4, uint64_t virtual_addr);
+uint64_t count_user_pages(page_table_t* pml4);
+
+// Compaction
+bool compact_memory(uint32_t order);
+void get_compact_stats(compact_stats_t* stats);
+void for_each_address_space(void (*visit)(page_table_t* pml4, void* arg), void* arg);
+void get_page(uint64_t address);
+void put_page(uint64_t address);
 page_table_t* create_page_table(void);
 void destroy_page_table(page_table_t* pml4);
 
 // Buddy allocator
 void init_buddy_allocator(void);
 void* buddy_alloc(uint32_t order);
+void* buddy_alloc_node(uint32_t order, uint32_t node);
 void buddy_free(void* ptr, uint32_t order);
 void add_buddy_block(uint64_t address, uint64_t size);
+uint32_t get_order(uint64_t size);
+
+// Single pages through the per-CPU caches
+void* alloc_page(uint32_t flags);
+void free_page(void* ptr);
+void free_page_cold(void* ptr);
+void set_page_cache_watermarks(uint32_t high, uint32_t low);
+void clear_page(void* page);
+bool zero_pool_refill(void);
+
+// Page frame descriptors
+page_t* phys_to_page(uint64_t address);
+uint64_t page_to_phys(page_t* page);
 
 // Slab allocator
 void init_slab_allocator(void);
@@ -92,17 +347,32 @@ slab_cache_t* create_slab_cache(const char* name, size_t object_size, uint32_t o
 void* slab_alloc(slab_cache_t* cache);
 void slab_free(slab_cache_t* cache, void* ptr);
 slab_t* create_slab(slab_cache_t* cache);
+uint32_t slab_cache_shrink(slab_cache_t* cache);
+void slab_cache_set_depot_size(slab_cache_t* cache, uint32_t full_magazines);
+void get_slab_stats(slab_cache_t* cache, slab_stats_t* stats);
+uint32_t get_slab_cache_count(void);
+slab_cache_t* get_slab_cache(uint32_t index);
 
 // Kernel memory allocation
 void* kmalloc(size_t size);
+void* kmalloc_node(size_t size, uint32_t node);
 void kfree(void* ptr);
 void* krealloc(void* ptr, size_t new_size);
 void* kcalloc(size_t count, size_t size);
 
+// Virtually contiguous kernel memory built from scattered pages
+void vmalloc_init(void);
+void* vmalloc(size_t size);
+void* vzalloc(size_t size);
+void vfree(void* ptr);
+bool is_vmalloc_address(const void* ptr);
+void get_vmalloc_stats(vmalloc_stats_t* stats);
+
 // Memory utilities
 void set_bit(uint8_t* bitmap, uint64_t bit);
 void clear_bit(uint8_t* bitmap, uint64_t bit);
 bool test_bit(uint8_t* bitmap, uint64_t bit);
+void memory_ops_init(void);
 void memory_copy(void* dest, const void* src, size_t size);
 void memory_set(void* ptr, uint8_t value, size_t size);
 int memory_compare(const void* ptr1, const void* ptr2, size_t size);
@@ -110,6 +380,8 @@ int memory_compare(const void* ptr1, const void* ptr2, size_t size);
 // Memory statistics
 void get_memory_stats(memory_stats_t* stats);
 uint64_t get_free_memory(void);
+uint64_t get_buddy_free_pages(void);
+void get_numa_stats(uint32_t node, numa_stats_t* stats);
 uint64_t get_used_memory(void);
 
 // String functions
@@ -0,0 +1,175 @@
+#include <stddef.h>
+#include "mmap.h"
+#include "memory.h"
+#include "vma.h"
+#include "process.h"
+#include "fs.h"
+#include "kernel.h"
+
+// Round a length up to whole pages, rejecting one that wraps past the top
+// of the address space
+static uint64_t mmap_range_end(uint64_t address, uint64_t length) {
+    uint64_t end = (address + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if(length == 0 || end <= address || end > USER_SPACE_END) return 0;
+    return end;
+}
+
+uint64_t do_mmap(uint64_t address, uint64_t length, uint32_t prot, uint32_t flags, int fd, uint64_t offset) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table || length == 0) return MAP_FAILED;
+    if(offset & (PAGE_SIZE - 1)) return MAP_FAILED;
+    if(!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) return MAP_FAILED;
+    
+    length = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if(length == 0 || length > MMAP_LIMIT - MMAP_BASE) return MAP_FAILED;
+    
+    uint32_t inode_num = 0;
+    uint32_t type = VMA_ANON;
+    
+    if(flags & MAP_ANONYMOUS) {
+        // Shared anonymous memory is what shm_create is for
+        if(flags & MAP_SHARED) return MAP_FAILED;
+    } else {
+        uint32_t open_flags;
+        inode_num = fs_fd_inode(fd, &open_flags);
+        if(!inode_num) return MAP_FAILED;
+        
+        uint32_t mode = open_flags & (O_WRONLY | O_RDWR);
+        if(mode == O_WRONLY) return MAP_FAILED;
+        if((flags & MAP_SHARED) && (prot & PROT_WRITE) && mode != O_RDWR) return MAP_FAILED;
+        
+        type = (flags & MAP_SHARED) ? VMA_SHARED_FILE : VMA_FILE;
+    }
+    if(prot == PROT_NONE) type = VMA_GUARD;
+    
+    uint64_t vma_flags = 0;
+    if(prot & PROT_WRITE) vma_flags |= PAGE_WRITABLE;
+    if(!(prot & PROT_EXEC)) vma_flags |= PAGE_NO_EXECUTE;
+    
+    // MAP_FIXED replaces whatever is there; otherwise the address is only
+    // a hint, taken if the range is free
+    if(flags & MAP_FIXED) {
+        if((address & (PAGE_SIZE - 1)) || !mmap_range_end(address, length)) return MAP_FAILED;
+        if(do_munmap(address, length) != 0) return MAP_FAILED;
+    } else if(!address || (address & (PAGE_SIZE - 1)) ||
+              vma_find_free(proc->vmas, address, USER_SPACE_END, length, PAGE_SIZE) != address) {
+        address = vma_find_free(proc->vmas, MMAP_BASE, MMAP_LIMIT, length, PAGE_SIZE);
+        if(!address) return MAP_FAILED;
+    }
+    
+    vma_t* vma = vma_create(&proc->vmas, address, address + length, vma_flags, type);
+    if(!vma) return MAP_FAILED;
+    
+    if(inode_num) {
+        rfs_inode_t* inode = fs_get_inode(inode_num);
+        uint64_t file_bytes = inode && inode->size > offset ? inode->size - offset : 0;
+        
+        vma->inode_num = inode_num;
+        vma->file_offset = offset;
+        vma->file_end = address + (file_bytes < length ? file_bytes : length);
+        vma->ra_next = offset / PAGE_SIZE;
+    }
+    
+    return address;
+}
+
+// Unmap whole pages in [address, address + length), splitting VMAs that
+// reach past either end. Shared file pages are written back first.
+int do_munmap(uint64_t address, uint64_t length) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table || (address & (PAGE_SIZE - 1))) return -1;
+    
+    uint64_t end = mmap_range_end(address, length);
+    if(!end) return -1;
+    
+    // Shared memory objects only come apart through shm_unmap, and the
+    // vDSO stays for the life of the address space
+    for(vma_t* vma = proc->vmas; vma && vma->start < end; vma = vma->next) {
+        if(vma->end > address && (vma->type == VMA_SHM || vma->type == VMA_VDSO)) return -1;
+    }
+    
+    page_table_t* pml4 = (page_table_t*)proc->page_table;
+    vma_t** link = &proc->vmas;
+    
+    while(*link && (*link)->start < end) {
+        vma_t* vma = *link;
+        if(vma->end <= address) {
+            link = &vma->next;
+            continue;
+        }
+        
+        // Keep the part below the range, then trim the part above it
+        if(vma->start < address) {
+            if(!vma_split(vma, address)) return -1;
+            link = &vma->next;
+            continue;
+        }
+        if(vma->end > end && !vma_split(vma, end)) return -1;
+        
+        vma_sync(vma, pml4, vma->start, vma->end);
+        unmap_user_range(pml4, vma->start, vma->end);
+        vma_remove(&proc->vmas, vma);
+    }
+    
+    return 0;
+}
+
+int do_msync(uint64_t address, uint64_t length, uint32_t flags) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table || (address & (PAGE_SIZE - 1))) return -1;
+    if((flags & MS_ASYNC) && (flags & MS_SYNC)) return -1;
+    
+    uint64_t end = mmap_range_end(address, length);
+    if(!end) return -1;
+    
+    // The whole range has to be mapped
+    uint64_t covered = address;
+    for(vma_t* vma = proc->vmas; vma && covered < end; vma = vma->next) {
+        if(vma->end <= covered) continue;
+        if(vma->start > covered) return -1;
+        covered = vma->end;
+    }
+    if(covered < end) return -1;
+    
+    page_table_t* pml4 = (page_table_t*)proc->page_table;
+    for(vma_t* vma = proc->vmas; vma && vma->start < end; vma = vma->next) {
+        if(vma->end > address) vma_sync(vma, pml4, address, end);
+    }
+    
+    return 0;
+}
+
+// Move the program break. The heap is anonymous memory from heap_base up,
+// zero-filled on first touch; shrinking it unmaps the pages past the new
+// break. Returns the break, unchanged if the move is refused, so brk(0)
+// just reports it.
+uint64_t do_brk(uint64_t address) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table) return 0;
+    
+    uint64_t current = proc->heap_base + proc->heap_size;
+    if(address < proc->heap_base || address > MMAP_BASE) return current;
+    
+    uint64_t old_end = (current + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t new_end = (address + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    
+    if(new_end > old_end) {
+        // Refuse to run into a mapping above the heap
+        if(vma_find_free(proc->vmas, old_end, new_end, new_end - old_end, PAGE_SIZE) != old_end) {
+            return current;
+        }
+        
+        // Extend the heap VMA if it still ends at the break, else start one
+        vma_t* heap = old_end > proc->heap_base ? vma_find(proc->vmas, old_end - 1) : NULL;
+        if(heap && heap->type == VMA_ANON && heap->end == old_end) {
+            heap->end = new_end;
+        } else if(!vma_create(&proc->vmas, old_end, new_end, PAGE_WRITABLE | PAGE_NO_EXECUTE, VMA_ANON)) {
+            return current;
+        }
+    } else if(new_end < old_end && do_munmap(new_end, old_end - new_end) != 0) {
+        return current;
+    }
+    
+    proc->heap_size = address - proc->heap_base;
+    return address;
+}
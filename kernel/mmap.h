@@ -0,0 +1,35 @@
+#ifndef MMAP_H
+#define MMAP_H
+
+#include <stdint.h>
+
+// mmap, munmap, msync and brk for the current process. File pages come from the
+// page cache on first touch: MAP_SHARED maps the cached frames themselves
+// and writes them back on msync, munmap or exit; MAP_PRIVATE shares them
+// read-only and copies on write.
+
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MS_ASYNC      0x1 // Written back at once all the same
+#define MS_INVALIDATE 0x2 // Nothing to do: mappings are the cached pages
+#define MS_SYNC       0x4
+
+#define MAP_FAILED ((uint64_t)-1)
+
+#define MMAP_BASE  0x0000200000000000ULL // Where mappings go without a usable hint
+#define MMAP_LIMIT 0x0000700000000000ULL
+
+uint64_t do_mmap(uint64_t address, uint64_t length, uint32_t prot, uint32_t flags, int fd, uint64_t offset);
+int do_munmap(uint64_t address, uint64_t length);
+int do_msync(uint64_t address, uint64_t length, uint32_t flags);
+uint64_t do_brk(uint64_t address);
+
+#endif
@@ -0,0 +1,159 @@
+#include "numa.h"
+#include "acpi.h"
+#include "kernel.h"
+
+#define MAX_APIC_IDS 256 // xAPIC ids; larger x2APIC ids fall back to node 0
+
+static uint32_t node_count = 1;
+static uint32_t node_domain[MAX_NUMA_NODES]; // Proximity domain of each node
+
+static numa_range_t ranges[MAX_NUMA_RANGES];
+static uint32_t range_count;
+
+static uint8_t apic_node[MAX_APIC_IDS];
+static uint32_t cpu_node[MAX_CPUS];
+
+static uint8_t distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+static uint32_t fallback[MAX_NUMA_NODES][MAX_NUMA_NODES]; // Nodes nearest first
+
+// Node id for a proximity domain, allocating the next one the first time a
+// domain is seen. Domains past MAX_NUMA_NODES share node 0.
+static uint32_t domain_to_node(uint32_t domain) {
+    for(uint32_t node = 0; node < node_count; node++) {
+        if(node_domain[node] == domain) return node;
+    }
+    
+    if(node_count == MAX_NUMA_NODES) {
+        kprintf("NUMA: proximity domain %u folded into node 0\n", domain);
+        return 0;
+    }
+    
+    node_domain[node_count] = domain;
+    return node_count++;
+}
+
+static void numa_parse_srat(acpi_srat_t* srat) {
+    uint8_t* entry = (uint8_t*)srat + sizeof(acpi_srat_t);
+    uint8_t* end = (uint8_t*)srat + srat->header.length;
+    
+    // The first node is claimed by whichever domain comes first
+    node_count = 0;
+    
+    while(entry + sizeof(acpi_srat_entry_t) <= end) {
+        acpi_srat_entry_t* header = (acpi_srat_entry_t*)entry;
+        if(header->length == 0) break;
+        
+        if(header->type == SRAT_PROCESSOR_AFFINITY) {
+            acpi_srat_cpu_t* cpu = (acpi_srat_cpu_t*)entry;
+            uint32_t domain = cpu->proximity_low | (cpu->proximity_high[0] << 8) |
+                              (cpu->proximity_high[1] << 16) | (cpu->proximity_high[2] << 24);
+            if(cpu->flags & SRAT_ENABLED) apic_node[cpu->apic_id] = domain_to_node(domain);
+        } else if(header->type == SRAT_X2APIC_AFFINITY) {
+            acpi_srat_x2apic_t* cpu = (acpi_srat_x2apic_t*)entry;
+            if((cpu->flags & SRAT_ENABLED) && cpu->x2apic_id < MAX_APIC_IDS) {
+                apic_node[cpu->x2apic_id] = domain_to_node(cpu->proximity);
+            }
+        } else if(header->type == SRAT_MEMORY_AFFINITY) {
+            acpi_srat_memory_t* memory = (acpi_srat_memory_t*)entry;
+            if((memory->flags & SRAT_ENABLED) && memory->size && range_count < MAX_NUMA_RANGES) {
+                ranges[range_count].base = memory->base;
+                ranges[range_count].end = memory->base + memory->size;
+                ranges[range_count].node = domain_to_node(memory->proximity);
+                range_count++;
+            }
+        }
+        
+        entry += header->length;
+    }
+    
+    if(node_count == 0) node_count = 1;
+}
+
+static void numa_parse_slit(acpi_slit_t* slit) {
+    for(uint32_t from = 0; from < node_count; from++) {
+        for(uint32_t to = 0; to < node_count; to++) {
+            uint64_t row = node_domain[from];
+            uint64_t column = node_domain[to];
+            if(row < slit->localities && column < slit->localities) {
+                distance[from][to] = slit->distance[row * slit->localities + column];
+            }
+        }
+    }
+}
+
+// Order every node's fallback list by distance, the node itself first
+static void numa_build_fallback(void) {
+    for(uint32_t node = 0; node < node_count; node++) {
+        for(uint32_t i = 0; i < node_count; i++) fallback[node][i] = i;
+        
+        for(uint32_t i = 1; i < node_count; i++) {
+            uint32_t candidate = fallback[node][i];
+            uint32_t j = i;
+            while(j > 0 && distance[node][fallback[node][j - 1]] > distance[node][candidate]) {
+                fallback[node][j] = fallback[node][j - 1];
+                j--;
+            }
+            fallback[node][j] = candidate;
+        }
+    }
+}
+
+void numa_init(void) {
+    for(uint32_t from = 0; from < MAX_NUMA_NODES; from++) {
+        for(uint32_t to = 0; to < MAX_NUMA_NODES; to++) {
+            distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+    
+    acpi_srat_t* srat = (acpi_srat_t*)acpi_find_table("SRAT");
+    if(srat) numa_parse_srat(srat);
+    
+    acpi_slit_t* slit = (acpi_slit_t*)acpi_find_table("SLIT");
+    if(srat && slit) numa_parse_slit(slit);
+    
+    numa_build_fallback();
+    
+    // The boot CPU's own APIC id, from CPUID leaf 1
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    numa_set_cpu_apic(cpu_id(), ebx >> 24);
+    
+    kprintf("NUMA: %u node%s, %u memory range%s, boot CPU on node %u\n",
+            node_count, node_count == 1 ? "" : "s",
+            range_count, range_count == 1 ? "" : "s", numa_node_id());
+}
+
+uint32_t numa_node_count(void) {
+    return node_count;
+}
+
+uint32_t numa_get_ranges(const numa_range_t** out) {
+    *out = ranges;
+    return range_count;
+}
+
+// Memory the SRAT doesn't describe belongs to node 0
+uint32_t numa_phys_to_node(uint64_t address) {
+    for(uint32_t i = 0; i < range_count; i++) {
+        if(address >= ranges[i].base && address < ranges[i].end) return ranges[i].node;
+    }
+    return 0;
+}
+
+uint32_t numa_cpu_node(uint32_t cpu) {
+    return cpu < MAX_CPUS ? cpu_node[cpu] : 0;
+}
+
+// Called for each CPU as it comes up
+void numa_set_cpu_apic(uint32_t cpu, uint32_t apic_id) {
+    if(cpu < MAX_CPUS) cpu_node[cpu] = apic_id < MAX_APIC_IDS ? apic_node[apic_id] : 0;
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to) {
+    if(from >= node_count || to >= node_count) return NUMA_REMOTE_DISTANCE;
+    return distance[from][to];
+}
+
+const uint32_t* numa_fallback(uint32_t node) {
+    return fallback[node < node_count ? node : 0];
+}
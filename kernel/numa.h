@@ -0,0 +1,41 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+// NUMA topology from the ACPI SRAT and SLIT. Proximity domains are
+// renumbered into dense node ids in the order the SRAT lists them. Without
+// an SRAT everything is node 0.
+
+#define MAX_NUMA_NODES  4
+#define MAX_NUMA_RANGES 32
+#define NUMA_NO_NODE    0xFFFFFFFF // Let the allocator pick: the calling CPU's node
+
+#define NUMA_LOCAL_DISTANCE  10 // SLIT scale: 10 is local access
+#define NUMA_REMOTE_DISTANCE 20 // Assumed between nodes when there is no SLIT
+
+// A physical memory range on one node
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    uint32_t node;
+} numa_range_t;
+
+void numa_init(void);
+uint32_t numa_node_count(void);
+uint32_t numa_get_ranges(const numa_range_t** ranges);
+
+uint32_t numa_phys_to_node(uint64_t address);
+uint32_t numa_cpu_node(uint32_t cpu);
+void numa_set_cpu_apic(uint32_t cpu, uint32_t apic_id);
+uint32_t numa_distance(uint32_t from, uint32_t to);
+const uint32_t* numa_fallback(uint32_t node);
+
+// Node of the CPU we are running on
+static inline uint32_t numa_node_id(void) {
+    return numa_cpu_node(cpu_id());
+}
+
+#endif
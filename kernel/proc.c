@@ -1,11 +1,12 @@
 #include "proc.h"
 #include "memory.h"
 #include "kernel.h"
+#include "timer.h"
 #include <string.h>
 
 static process_t processes[MAX_PROCESSES];
 static uint32_t next_pid = 1;
-process_t* current_proc = NULL;
+static spinlock_t proc_table_lock = SPINLOCK_INIT;
 
 void proc_init(void) {
     for (int i = 0; i < MAX_PROCESSES; i++) {
@@ -13,27 +14,53 @@ void proc_init(void) {
     }
 }
 
-static process_t* alloc_proc(void) {
+// Claim a free slot; CPUs may create processes at the same time
+static process_t* claim_proc(void) {
+    uint64_t flags = irq_save();
+    spin_lock(&proc_table_lock);
+    
+    process_t* p = NULL;
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (processes[i].state == PROC_STATE_UNUSED) {
-            process_t* p = &processes[i];
+            p = &processes[i];
             p->pid = next_pid++;
             p->state = PROC_STATE_EMBRYO;
-            
-            // Allocate kernel stack
-            p->kstack = (uint64_t)kmalloc(KERNEL_STACK_SIZE);
-            memset((void*)p->kstack, 0, KERNEL_STACK_SIZE);
-            
-            // Prepare context at top of stack for return from context_switch
-            uint64_t sp = p->kstack + KERNEL_STACK_SIZE;
-            sp -= sizeof(context_t);
-            p->context = (context_t*)sp;
-            memset(p->context, 0, sizeof(context_t));
-            
-            return p;
+            break;
         }
     }
-    return NULL;
+    
+    spin_unlock(&proc_table_lock);
+    irq_restore(flags);
+    return p;
+}
+
+static process_t* alloc_proc(void) {
+    process_t* p = claim_proc();
+    if (!p) return NULL;
+    
+    p->priority = SCHED_DEFAULT_PRIORITY;
+    memset(&p->run_node, 0, sizeof(run_node_t));
+    p->cpu = SCHED_NO_CPU;
+    p->affinity = SCHED_ALL_CPUS;
+    p->last_ran = 0;
+    p->on_cpu = false;
+    memset(&p->wait, 0, sizeof(sched_wait_t));
+    
+    // Allocate kernel stack; zeroed pages come from the idle-filled
+    // pool and the area ends in a guard page
+    p->kstack = (uint64_t)vzalloc(KERNEL_STACK_SIZE);
+    if (!p->kstack) {
+        p->state = PROC_STATE_UNUSED;
+        return NULL;
+    }
+    
+    // Prepare context at top of stack for return from context_switch
+    uint64_t sp = p->kstack + KERNEL_STACK_SIZE;
+    sp -= sizeof(context_t);
+    p->context = (context_t*)sp;
+    memset(p->context, 0, sizeof(context_t));
+    
+    return p;
 }
 
 process_t* proc_create(const char* name) {
@@ -41,7 +68,7 @@ process_t* proc_create(const char* name) {
     if (!p) return NULL;
     
     strncpy(p->name, name, 255);
-    p->state = PROC_STATE_READY;
+    sched_make_ready(p);
     
     // Allocate page table (deep implementation would use vmm_create_address_space)
     // p->page_table = vmm_create_address_space();
@@ -57,3 +84,81 @@ void proc_exit(int status) {
         // scheduler_yield();
     }
 }
+
+process_t* proc_create_kthread(const char* name, void (*entry)(void)) {
+    process_t* p = alloc_proc();
+    if (!p) return NULL;
+    
+    strncpy(p->name, name, 255);
+    
+    // context_switch pops the callee-saved registers and returns into
+    // kthread_start, which enables interrupts and jumps to entry
+    p->context->r12 = (uint64_t)entry;
+    p->context->rip = (uint64_t)kthread_start;
+    sched_make_ready(p);
+    
+    return p;
+}
+
+// Block the current process until proc_wake()
+void proc_sleep(void) {
+    if (current_proc) {
+        current_proc->state = PROC_STATE_BLOCKED;
+        scheduler_yield();
+    }
+}
+
+static void proc_sleep_expired(ktimer_t* timer) {
+    proc_wake((process_t*)timer->data);
+}
+
+// Block for at least ns. The timer lives on this stack and on this CPU's
+// list, so an early proc_wake from elsewhere just sleeps again until it
+// has fired.
+void proc_sleep_ns(uint64_t ns) {
+    process_t* p = current_proc;
+    if (!p) return;
+    
+    ktimer_t timer = { .fn = proc_sleep_expired, .data = p };
+    uint64_t flags = irq_save();
+    timer_add(&timer, ns);
+    
+    while (1) {
+        __atomic_store_n(&p->state, PROC_STATE_BLOCKED, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&timer.pending, __ATOMIC_SEQ_CST)) {
+            scheduler_yield();
+            continue;
+        }
+        
+        // Fired: take the block back, unless a wakeup already queued us
+        proc_state_t blocked = PROC_STATE_BLOCKED;
+        if (!__atomic_compare_exchange_n(&p->state, &blocked, PROC_STATE_RUNNING, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            scheduler_yield();
+        }
+        break;
+    }
+    irq_restore(flags);
+}
+
+// Only one of several CPUs waking the same process gets to queue it
+void proc_wake(process_t* p) {
+    proc_state_t blocked = PROC_STATE_BLOCKED;
+    if (__atomic_compare_exchange_n(&p->state, &blocked, PROC_STATE_READY, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        sched_make_ready(p);
+    }
+}
+
+void proc_reap(process_t* p) {
+    if (p->state != PROC_STATE_ZOMBIE) return;
+    
+    // Its last switch away may still be running on another CPU
+    while (__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__ ("pause");
+    }
+    
+    vfree((void*)p->kstack);
+    p->kstack = 0;
+    p->state = PROC_STATE_UNUSED;
+}
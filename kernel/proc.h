@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "sched.h"
+#include "smp.h"
 
 #define MAX_PROCESSES 1024
 #define KERNEL_STACK_SIZE 16384
@@ -31,9 +33,19 @@ typedef struct process {
     uint64_t kstack;
     uint64_t ustack;
     uint64_t page_table;
+    struct vma* vmas;
     context_t* context;
     char name[256];
     
+    // Scheduling: 0 runs first, queued on run_node while ready
+    uint32_t priority;
+    run_node_t run_node;
+    uint32_t cpu;           // Last ran on, and queued on; SCHED_NO_CPU before it first runs
+    uint64_t affinity;      // Bit per CPU it may run on
+    uint64_t last_ran;      // TSC when it last stopped running
+    volatile bool on_cpu;   // Still switching away; no other CPU may resume it yet
+    sched_wait_t wait;      // Time spent queued before each run
+    
     // Parent/child relationship
     struct process* parent;
     
@@ -44,10 +56,33 @@ typedef struct process {
     int exit_status;
 } process_t;
 
+// The process running on this CPU, NULL in its scheduler loop
+#define current_proc (this_cpu()->current)
+
 void proc_init(void);
 process_t* proc_create(const char* name);
 void proc_exit(int status);
 int proc_fork(void);
 int proc_exec(const char* path, const char** argv);
 
+// Kernel threads run 'entry' on their own kernel stack and never return
+void kthread_start(void);
+process_t* proc_create_kthread(const char* name, void (*entry)(void));
+void proc_sleep(void);
+void proc_sleep_ns(uint64_t ns);
+void proc_wake(process_t* p);
+
+// Free a zombie's kernel stack and slot
+void proc_reap(process_t* p);
+
+void scheduler(void);
+void scheduler_yield(void);
+void sched_make_ready(process_t* p);
+void sched_set_priority(process_t* p, uint32_t priority);
+void sched_set_affinity(process_t* p, uint64_t affinity);
+
+// Run the best ready process until it yields or blocks; false if none was
+// ready
+bool scheduler_run_next(void);
+
 #endif
@@ -17,14 +17,6 @@ void* create_page_table(void) {
     return (void*)pml4;
 }
 
-uint64_t alloc_user_stack(void) {
-    // Allocate a block of pages for the user stack
-    void* stack = kmalloc(USER_STACK_SIZE);
-    // Map it into user space (implementation details would be in vmm.c)
-    // vmm_map_pages(current_pml4, USER_STACK_TOP - USER_STACK_SIZE, stack, USER_STACK_SIZE, VMM_USER | VMM_WRITE);
-    return (uint64_t)stack;
-}
-
 void destroy_page_table(void* pml4) {
     // Fully free all user-space page directories and tables
     // Then free the PML4 itself
@@ -1,14 +1,26 @@
 #include "process.h"
 #include "memory.h"
+#include "vma.h"
+#include "elf.h"
+#include "fs.h"
 #include "kernel.h"
+#include "timer.h"
+#include "vdso.h"
+#include "clock.h"
+#include "kmemprof.h"
+
+// scheduler.c, for the kernel threads proc.h manages
+extern bool scheduler_run_next(void);
 
 static process_t* process_list = NULL;
 static process_t* current_process = NULL;
 static uint32_t next_pid = 1;
 static uint32_t process_count = 0;
 
-// Scheduler queues
-static process_queue_t ready_queues[MAX_PRIORITY_LEVELS];
+// Scheduler queues: strict-priority processes run before fair ones
+static run_queue_t ready_queue;
+static fair_queue_t fair_queue;
+static const uint64_t priority_slice_ns[SCHED_PRIORITY_LEVELS] = SCHED_SLICES_NS;
 static process_queue_t blocked_queue;
 static process_queue_t zombie_queue;
 
@@ -23,11 +35,8 @@ void process_init(void) {
     }
     
     // Initialize scheduler queues
-    for(int i = 0; i < MAX_PRIORITY_LEVELS; i++) {
-        ready_queues[i].head = NULL;
-        ready_queues[i].tail = NULL;
-        ready_queues[i].count = 0;
-    }
+    run_queue_init(&ready_queue);
+    fair_queue_init(&fair_queue);
     
     blocked_queue.head = NULL;
     blocked_queue.tail = NULL;
@@ -64,9 +73,13 @@ uint32_t process_create(const char* path, uint32_t priority, uint32_t type) {
     proc->state = PROCESS_READY;
     proc->priority = priority;
     proc->type = type;
-    proc->time_slice = DEFAULT_TIME_SLICE;
+    proc->time_slice = 0;
     proc->cpu_time = 0;
     proc->start_time = get_system_time();
+    proc->sched_class = SCHED_CLASS_FAIR;
+    proc->run_node.queued = false;
+    fair_node_init(&fair_queue, &proc->fair_node, priority);
+    memset(&proc->wait, 0, sizeof(sched_wait_t));
     
     strncpy(proc->name, path, 255);
     proc->name[255] = '\0';
@@ -78,14 +91,14 @@ uint32_t process_create(const char* path, uint32_t priority, uint32_t type) {
         return 0;
     }
     
-    // Allocate stack
-    proc->stack_base = alloc_user_stack();
-    proc->stack_size = USER_STACK_SIZE;
-    
-    // Load executable
-    if(!load_executable(proc, path)) {
+    // Reserve the stack, map the vDSO and load the executable; pages are
+    // only backed when first touched
+    proc->vmas = NULL;
+    if(!setup_user_stack(proc) || !vdso_map(&proc->vmas, (page_table_t*)proc->page_table) ||
+       !load_executable(proc, path)) {
+        vma_destroy_all(&proc->vmas);
+        free_user_page_tables((page_table_t*)proc->page_table);
         destroy_page_table(proc->page_table);
-        free_user_stack(proc->stack_base);
         process_slots[slot] = false;
         return 0;
     }
@@ -120,48 +133,80 @@ void scheduler_start(void) {
     schedule();
 }
 
-bool load_executable(process_t* proc, const char* path) {
-    int fd = fs_open(path, 0);
-    if (fd < 0) return false;
-    
-    fs_stat_t st;
-    fs_fstat(fd, &st);
-    
-    void* buffer = kmalloc(st.size);
-    fs_read(fd, buffer, st.size);
-    fs_close(fd);
-    
-    elf64_header_t* elf_header = (elf64_header_t*)buffer;
-    if (elf_header->magic != ELF_MAGIC) {
-        kfree(buffer);
-        return false;
+// The one consumer of the ready queues. A process still running goes back
+// on its queue, so it keeps the CPU only if nothing is ahead of it; one that
+// blocked or exited has already been moved elsewhere by its caller.
+void schedule(void) {
+    process_t* prev = current_process;
+    if(prev && prev->state == PROCESS_RUNNING) {
+        prev->state = PROCESS_READY;
+        add_to_ready_queue(prev);
     }
     
-    elf64_phdr_t* phdr = (elf64_phdr_t*)((uint8_t*)buffer + elf_header->phoff);
-    for (int i = 0; i < elf_header->phnum; i++) {
-        if (phdr[i].type == 1) { // PT_LOAD
-            // Allocate and map memory for the segment
-            // For now, simplify by copying into kernel space (incorrect but illustrative)
-            // vmm_map_user_pages(proc->page_table, phdr[i].vaddr, phdr[i].memsz);
-            memcpy((void*)phdr[i].vaddr, (uint8_t*)buffer + phdr[i].offset, phdr[i].filesz);
-            memset((void*)(phdr[i].vaddr + phdr[i].filesz), 0, phdr[i].memsz - phdr[i].filesz);
+    // No user process ready: run kernel threads, which is the only place
+    // the BSP does, then the same idle work as scheduler(), else wait for an
+    // interrupt to wake something
+    process_t* next = select_next_process();
+    while(!next) {
+        if(!scheduler_run_next() && !zero_pool_refill() && !kmemprof_drain()) {
+            __asm__ __volatile__ ("sti; hlt; cli");
         }
+        next = select_next_process();
     }
     
-    proc->entry_point = elf_header->entry;
-    kfree(buffer);
+    context_switch(prev, next);
+    next->state = PROCESS_RUNNING;
+    current_process = next;
+}
+
+bool load_executable(process_t* proc, const char* path) {
+    uint32_t inode_num = path_to_inode(path);
+    if (inode_num == 0) return false;
+    
+    // Segments are mapped from the page cache and faulted in on demand, so
+    // only the pages a program actually runs are ever read
+    if(!elf_map_image(inode_num, &proc->vmas, &proc->entry_point)) return false;
+    
+    // The heap starts empty on the first page past the segments; brk grows it
+    proc->heap_base = 0;
+    for(vma_t* vma = proc->vmas; vma; vma = vma->next) {
+        if(vma->type == VMA_FILE && vma->end > proc->heap_base) proc->heap_base = vma->end;
+    }
+    proc->heap_size = 0;
     return true;
 }
 
+// Strict-priority processes get the fixed slice of their level; fair ones
+// their weighted share of the latency target
+uint64_t calculate_time_slice(process_t* proc) {
+    if(proc->sched_class == SCHED_CLASS_PRIORITY) {
+        return priority_slice_ns[proc->priority];
+    }
+    return fair_slice_ns(&fair_queue, &proc->fair_node);
+}
+
 // Unified Context Switch using ISR stack frame
 void context_switch(process_t* from, process_t* to) {
+    // Charge the process leaving for what it actually ran, which is less
+    // than its slice if it blocked
+    uint64_t now = clock_monotonic_ns();
     if (from) {
         // State is saved on the stack during the timer interrupt
+        uint64_t ran = now - from->run_start;
+        from->cpu_time += ran;
+        if(from->sched_class == SCHED_CLASS_FAIR) {
+            fair_charge(&fair_queue, &from->fair_node, ran);
+        }
     }
     
     // Switch address space
     __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (to->page_table));
     
+    // The timer stays quiet until this slice is over
+    to->run_start = now;
+    to->time_slice = calculate_time_slice(to);
+    timer_set_slice(to->time_slice);
+    
     // We don't return directly; we return via the interrupt return path
     // which will pop registers of 'to' from its kernel stack
 }
@@ -252,7 +297,9 @@ int process_exec(const char* path, char* const argv[], char* const envp[]) {
     clear_address_space(current_process);
     
     // Load new executable
-    if(!load_executable(current_process, path)) {
+    if(!setup_user_stack(current_process) ||
+       !vdso_map(&current_process->vmas, (page_table_t*)current_process->page_table) ||
+       !load_executable(current_process, path)) {
         process_exit(-1);
         return -1;
     }
@@ -328,7 +375,7 @@ void process_kill(uint32_t pid, int signal) {
             // Wake up parent
             wake_waiting_parent(proc);
             break;
-            
+        
         case SIGSTOP:
             if(proc->state == PROCESS_RUNNING || proc->state == PROCESS_READY) {
                 proc->state = PROCESS_BLOCKED;
@@ -336,7 +383,7 @@ void process_kill(uint32_t pid, int signal) {
                 add_to_blocked_queue(proc);
             }
             break;
-            
+        
         case SIGCONT:
             if(proc->state == PROCESS_BLOCKED) {
                 proc->state = PROCESS_READY;
@@ -382,29 +429,112 @@ void add_to_ready_queue(process_t* proc) {
         proc->priority = MAX_PRIORITY_LEVELS - 1;
     }
     
-    enqueue_process(&ready_queues[proc->priority], proc);
+    sched_wait_begin(&proc->wait);
+    if(proc->sched_class == SCHED_CLASS_PRIORITY) {
+        run_queue_add(&ready_queue, &proc->run_node, proc->priority);
+        return;
+    }
+    
+    // The weight follows the priority, which may have changed since
+    proc->fair_node.weight = fair_weight(proc->priority);
+    fair_queue_add(&fair_queue, &proc->fair_node);
 }
 
+// Safe to call whether or not the process is queued
 void remove_from_ready_queue(process_t* proc) {
-    process_queue_t* queue = &ready_queues[proc->priority];
+    run_queue_remove(&ready_queue, &proc->run_node);
+    fair_queue_remove(&fair_queue, &proc->fair_node);
+    sched_wait_end(&proc->wait, false);
+}
+
+// Any strict-priority process, highest level first, then the fair process
+// furthest behind; taken off its queue, or NULL
+process_t* select_next_process(void) {
+    process_t* proc = NULL;
+    
+    run_node_t* node = run_queue_pop(&ready_queue);
+    if(node) {
+        proc = run_node_entry(node, process_t, run_node);
+    } else {
+        fair_node_t* fair = fair_queue_pop(&fair_queue);
+        if(fair) proc = run_node_entry(fair, process_t, fair_node);
+    }
     
-    if(queue->head == proc) {
-        dequeue_process(queue);
-        return;
+    if(proc) sched_wait_end(&proc->wait, true);
+    return proc;
+}
+
+// Move a process between classes, requeueing it if it is waiting to run.
+// Back in the fair class it starts level with the queue.
+void set_process_class(process_t* proc, uint32_t sched_class) {
+    if(proc->sched_class == sched_class) return;
+    
+    // Its wait carries on across the move
+    bool queued = proc->run_node.queued || proc->fair_node.queued;
+    run_queue_remove(&ready_queue, &proc->run_node);
+    fair_queue_remove(&fair_queue, &proc->fair_node);
+    
+    proc->sched_class = sched_class;
+    if(sched_class == SCHED_CLASS_FAIR) {
+        fair_node_init(&fair_queue, &proc->fair_node, proc->priority);
     }
     
-    process_t* current = queue->head;
-    while(current && current->next != proc) {
-        current = current->next;
+    if(queued) add_to_ready_queue(proc);
+}
+
+// Address space management
+void copy_address_space(process_t* parent, process_t* child) {
+    // Drop what process_create set up for the child, then share the
+    // parent's pages copy-on-write. Nothing is copied until one side writes,
+    // so fork+exec no longer scales with the parent's resident size.
+    free_user_page_tables((page_table_t*)child->page_table);
+    vma_destroy_all(&child->vmas);
+    
+    copy_page_tables_cow((page_table_t*)parent->page_table, (page_table_t*)child->page_table);
+    child->vmas = vma_copy_all(parent->vmas);
+    
+    child->registers = parent->registers;
+    child->stack_base = parent->stack_base;
+    child->stack_size = parent->stack_size;
+    child->heap_base = parent->heap_base;
+    child->heap_size = parent->heap_size;
+    child->entry_point = parent->entry_point;
+}
+
+void clear_address_space(process_t* proc) {
+    // Drops this process's references; pages shared with a forked parent
+    // become sole-owned again and stop taking copy faults. Shared file
+    // mappings are written back first.
+    vma_sync_all(proc->vmas, (page_table_t*)proc->page_table);
+    free_user_page_tables((page_table_t*)proc->page_table);
+    vma_destroy_all(&proc->vmas);
+}
+
+void free_process_memory(process_t* proc) {
+    clear_address_space(proc);
+}
+
+// Reserve the user stack below USER_STACK_TOP with an unmapped guard page
+// under it. Nothing is allocated until the stack is touched.
+bool setup_user_stack(process_t* proc) {
+    proc->stack_size = USER_STACK_SIZE;
+    proc->stack_base = USER_STACK_TOP - USER_STACK_SIZE;
+    
+    if(!vma_create(&proc->vmas, proc->stack_base - PAGE_SIZE, proc->stack_base, 0, VMA_GUARD)) {
+        return false;
     }
     
-    if(current) {
-        current->next = proc->next;
-        if(queue->tail == proc) {
-            queue->tail = current;
+    return vma_create(&proc->vmas, proc->stack_base, USER_STACK_TOP,
+                      PAGE_WRITABLE | PAGE_NO_EXECUTE, VMA_STACK) != NULL;
+}
+
+// Visit every live user address space. Compaction uses this to find the
+// PTEs of a frame it moves, since frames keep no reverse mapping.
+void for_each_address_space(void (*visit)(page_table_t* pml4, void* arg), void* arg) {
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(process_slots[i] && process_table[i].page_table) {
+            visit((page_table_t*)process_table[i].page_table, arg);
         }
-        queue->count--;
-        proc->next = NULL;
     }
 }
 
@@ -422,6 +552,10 @@ uint32_t get_current_pid(void) {
     return current_process ? current_process->pid : 0;
 }
 
+process_t* get_current_process(void) {
+    return current_process;
+}
+
 void get_process_list(process_info_t* list, uint32_t* count) {
     uint32_t index = 0;
     
@@ -434,6 +568,9 @@ void get_process_list(process_info_t* list, uint32_t* count) {
             list[index].state = proc->state;
             list[index].priority = proc->priority;
             list[index].cpu_time = proc->cpu_time;
+            list[index].wait_time = proc->wait.total_ns;
+            list[index].max_wait = proc->wait.max_ns;
+            list[index].rss = count_user_pages((page_table_t*)proc->page_table);
             strncpy(list[index].name, proc->name, 255);
             
             index++;
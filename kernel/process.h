@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "sched.h"
 
 // Process states
 #define PROCESS_READY    0
@@ -10,14 +11,15 @@
 #define PROCESS_BLOCKED  2
 #define PROCESS_ZOMBIE   3
 
-// Process priorities
-#define MAX_PRIORITY_LEVELS 8
-#define DEFAULT_PRIORITY 4
-#define DEFAULT_TIME_SLICE 10 // milliseconds
+// Process priorities: the level in the priority class, the weight (nice
+// level) in the fair class every process starts in
+#define MAX_PRIORITY_LEVELS SCHED_PRIORITY_LEVELS
+#define DEFAULT_PRIORITY SCHED_DEFAULT_PRIORITY
 
 // Process limits
 #define MAX_FDS_PER_PROCESS 256
-#define USER_STACK_SIZE (1024 * 1024) // 1MB
+#define USER_STACK_SIZE (1024 * 1024) // 1MB, backed on first touch
+#define USER_STACK_TOP  0x00007FFFFFFFF000 // Guard page sits below the stack
 
 // Signals
 #define SIGTERM 15
@@ -45,8 +47,9 @@ typedef struct process {
     
     // CPU state
     cpu_registers_t registers;
-    uint32_t time_slice;
-    uint64_t cpu_time;
+    uint64_t time_slice; // ns, from calculate_time_slice() when switched to
+    uint64_t cpu_time;   // ns
+    uint64_t run_start;  // Monotonic ns it was last switched to
     uint64_t start_time;
     uint64_t exit_time;
     int exit_code;
@@ -58,6 +61,7 @@ typedef struct process {
     uint64_t heap_base;
     uint64_t heap_size;
     uint64_t entry_point;
+    struct vma* vmas; // Sorted list of mapped user ranges
     
     // File descriptors
     file_descriptor_t fds[MAX_FDS_PER_PROCESS];
@@ -73,6 +77,12 @@ typedef struct process {
     
     // Linked list
     struct process* next;
+    
+    // Scheduling: ready in the queue of its class
+    uint32_t sched_class;
+    run_node_t run_node;   // SCHED_CLASS_PRIORITY
+    fair_node_t fair_node; // SCHED_CLASS_FAIR
+    sched_wait_t wait;
 } process_t;
 
 // Process queue
@@ -88,7 +98,10 @@ typedef struct {
     uint32_t ppid;
     uint32_t state;
     uint32_t priority;
-    uint64_t cpu_time;
+    uint64_t cpu_time;  // ns
+    uint64_t wait_time; // ns ready but not running
+    uint64_t max_wait;  // Longest single wait, ns
+    uint64_t rss; // Resident user pages
     char name[256];
 } process_info_t;
 
@@ -122,10 +135,10 @@ void add_to_ready_queue(process_t* proc);
 void remove_from_ready_queue(process_t* proc);
 void add_to_blocked_queue(process_t* proc);
 void remove_from_blocked_queue(process_t* proc);
+void set_process_class(process_t* proc, uint32_t sched_class);
 
 // Memory management for processes
-uint64_t alloc_user_stack(void);
-void free_user_stack(uint64_t stack_base);
+bool setup_user_stack(process_t* proc);
 bool load_executable(process_t* proc, const char* path);
 void copy_address_space(process_t* parent, process_t* child);
 void clear_address_space(process_t* proc);
@@ -134,7 +147,7 @@ void free_process_memory(process_t* proc);
 // Process utilities
 void create_idle_process(void);
 process_t* get_idle_process(void);
-uint32_t calculate_time_slice(process_t* proc);
+uint64_t calculate_time_slice(process_t* proc);
 void setup_process_args(process_t* proc, char* const argv[], char* const envp[]);
 void setup_scheduler_timer(void);
 void update_tss(process_t* proc);
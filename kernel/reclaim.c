@@ -0,0 +1,186 @@
+#include <stddef.h>
+#include "reclaim.h"
+#include "memory.h"
+#include "proc.h"
+
+static shrinker_t* shrinkers;
+static spinlock_t shrinker_lock = SPINLOCK_INIT;
+
+static watermarks_t watermarks;
+static reclaim_stats_t reclaim_stats;
+
+static process_t* kswapd_task;
+static volatile bool kswapd_pending;
+
+// Set while a CPU is inside a shrinker, so allocations made from one don't
+// recurse into reclaim
+static volatile bool reclaiming[MAX_CPUS];
+
+void register_shrinker(shrinker_t* shrinker) {
+    if(shrinker->seeks == 0) shrinker->seeks = DEFAULT_SEEKS;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&shrinker_lock);
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+    spin_unlock(&shrinker_lock);
+    irq_restore(flags);
+}
+
+void unregister_shrinker(shrinker_t* shrinker) {
+    uint64_t flags = irq_save();
+    spin_lock(&shrinker_lock);
+    
+    shrinker_t** link = &shrinkers;
+    while(*link && *link != shrinker) link = &(*link)->next;
+    if(*link) *link = shrinker->next;
+    
+    spin_unlock(&shrinker_lock);
+    irq_restore(flags);
+}
+
+uint64_t count_reclaimable_pages(void) {
+    uint64_t pages = 0;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&shrinker_lock);
+    for(shrinker_t* s = shrinkers; s; s = s->next) {
+        pages += s->count();
+    }
+    spin_unlock(&shrinker_lock);
+    irq_restore(flags);
+    
+    return pages;
+}
+
+// Ask every shrinker for a share of 'pages' in proportion to what it
+// holds, scaled down by how costly its objects are to rebuild. Returns the
+// pages actually freed.
+uint64_t shrink_caches(uint64_t pages) {
+    uint32_t cpu = cpu_id();
+    if(reclaiming[cpu]) return 0;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&shrinker_lock);
+    reclaiming[cpu] = true;
+    
+    uint64_t weighted = 0;
+    for(shrinker_t* s = shrinkers; s; s = s->next) {
+        weighted += s->count() / s->seeks;
+    }
+    
+    uint64_t freed = 0;
+    for(shrinker_t* s = shrinkers; s && freed < pages; s = s->next) {
+        uint64_t available = s->count();
+        if(available == 0) continue;
+        
+        // Every cache with something to give frees at least a page, so a
+        // small one still takes its turn
+        uint64_t share = weighted ? pages * (available / s->seeks) / weighted : pages;
+        if(share == 0) share = 1;
+        if(share > available) share = available;
+        
+        freed += s->scan(share);
+    }
+    
+    // A second, unweighted pass when the proportional one fell short
+    for(shrinker_t* s = shrinkers; s && freed < pages; s = s->next) {
+        freed += s->scan(pages - freed);
+    }
+    
+    reclaiming[cpu] = false;
+    spin_unlock(&shrinker_lock);
+    irq_restore(flags);
+    
+    return freed;
+}
+
+void reclaim_init(uint64_t managed_pages) {
+    set_watermarks(managed_pages / 256);
+}
+
+// low and high sit 25% and 50% above min, leaving kswapd room to work
+// before allocations start reclaiming themselves
+void set_watermarks(uint64_t min_pages) {
+    if(min_pages < 128) min_pages = 128;
+    if(min_pages > 16384) min_pages = 16384;
+    
+    watermarks.min = min_pages;
+    watermarks.low = min_pages + min_pages / 4;
+    watermarks.high = min_pages + min_pages / 2;
+}
+
+void get_watermarks(watermarks_t* marks) {
+    *marks = watermarks;
+}
+
+// Background reclaim: run until free memory is back above the high
+// watermark or nothing more can be freed, then sleep until woken
+static void kswapd(void) {
+    while(1) {
+        kswapd_pending = false;
+        
+        while(get_buddy_free_pages() < watermarks.high) {
+            uint64_t freed = shrink_caches(RECLAIM_BATCH);
+            if(freed == 0) break;
+            reclaim_stats.kswapd_reclaimed += freed;
+        }
+        
+        // Block first, then look for a wakeup, as proc_sleep_ns does: a
+        // kswapd_wake() on any CPU either sets the flag in time to be seen
+        // here or finds kswapd blocked and queues it. Interrupts stay off so
+        // this CPU's own allocations can't wake it halfway.
+        uint64_t flags = irq_save();
+        __atomic_store_n(&kswapd_task->state, PROC_STATE_BLOCKED, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&kswapd_pending, __ATOMIC_SEQ_CST)) {
+            // Take the block back, unless a wakeup already queued us
+            proc_state_t blocked = PROC_STATE_BLOCKED;
+            if(!__atomic_compare_exchange_n(&kswapd_task->state, &blocked, PROC_STATE_RUNNING, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                scheduler_yield();
+            }
+        } else {
+            scheduler_yield();
+        }
+        irq_restore(flags);
+    }
+}
+
+void kswapd_init(void) {
+    kswapd_task = proc_create_kthread("kswapd", kswapd);
+}
+
+void kswapd_wake(void) {
+    if(!kswapd_pending) reclaim_stats.kswapd_wakeups++;
+    
+    __atomic_store_n(&kswapd_pending, true, __ATOMIC_SEQ_CST);
+    if(kswapd_task) proc_wake(kswapd_task);
+}
+
+// Called from the allocator's slow paths with the current free count
+void reclaim_check(uint64_t free_pages) {
+    if(free_pages < watermarks.low) kswapd_wake();
+}
+
+// Synchronous reclaim for an allocation that found nothing free. Returns
+// true if anything was freed and a retry is worthwhile.
+bool reclaim_direct(uint64_t pages) {
+    if(reclaiming[cpu_id()]) return false;
+    
+    kswapd_wake();
+    
+    // Free a batch beyond the request so the next allocation doesn't
+    // land straight back here
+    uint64_t freed = shrink_caches(pages + RECLAIM_BATCH);
+    
+    reclaim_stats.direct_reclaims++;
+    reclaim_stats.direct_reclaimed += freed;
+    if(freed < pages) reclaim_stats.direct_failures++;
+    
+    return freed > 0;
+}
+
+void get_reclaim_stats(reclaim_stats_t* stats) {
+    *stats = reclaim_stats;
+    stats->reclaimable_pages = count_reclaimable_pages();
+}
@@ -0,0 +1,54 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Memory reclaim. Caches that can give memory back register a shrinker;
+// kswapd calls them in the background once free pages fall below the low
+// watermark and stops at the high one. An allocation that finds nothing
+// free calls them directly before giving up.
+
+#define DEFAULT_SEEKS 2  // Cost to rebuild an object, relative to a slab object
+#define RECLAIM_BATCH 32 // Pages asked for per shrink pass
+
+typedef struct shrinker {
+    const char* name;
+    uint64_t (*count)(void);         // Pages the cache could give back now
+    uint64_t (*scan)(uint64_t pages); // Free up to 'pages', return how many went
+    uint32_t seeks;                  // Higher means a smaller share per pass
+    struct shrinker* next;
+} shrinker_t;
+
+// Free page thresholds, in pages
+typedef struct {
+    uint64_t min;  // Reserve the other two are set from
+    uint64_t low;  // Wake kswapd below this
+    uint64_t high; // kswapd sleeps once this many are free
+} watermarks_t;
+
+typedef struct {
+    uint64_t reclaimable_pages;
+    uint64_t kswapd_wakeups;
+    uint64_t kswapd_reclaimed;
+    uint64_t direct_reclaims;
+    uint64_t direct_reclaimed;
+    uint64_t direct_failures;
+} reclaim_stats_t;
+
+void register_shrinker(shrinker_t* shrinker);
+void unregister_shrinker(shrinker_t* shrinker);
+uint64_t shrink_caches(uint64_t pages);
+uint64_t count_reclaimable_pages(void);
+
+void reclaim_init(uint64_t managed_pages);
+void kswapd_init(void);
+void kswapd_wake(void);
+void reclaim_check(uint64_t free_pages);
+bool reclaim_direct(uint64_t pages);
+
+void get_watermarks(watermarks_t* marks);
+void set_watermarks(uint64_t min_pages);
+void get_reclaim_stats(reclaim_stats_t* stats);
+
+#endif
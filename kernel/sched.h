@@ -0,0 +1,152 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "clock.h"
+
+// Priority run queues shared by both process tables. Each level is a FIFO
+// threaded through a node embedded in the process, and a bitmap records
+// which levels are non-empty, so adding, removing and picking a process
+// cost the same however many processes exist. Level 0 runs first.
+
+#define SCHED_PRIORITY_LEVELS  8
+#define SCHED_DEFAULT_PRIORITY 4
+
+// Multiprocessor placement. Each CPU has its own queue; a process goes back
+// to the CPU it last ran on, idle CPUs steal from the busiest queue, and a
+// periodic balancer evens out queues without moving cache-hot processes.
+#define SCHED_NO_CPU           0xFFFFFFFF  // Never ran: goes to the least loaded CPU
+#define SCHED_ALL_CPUS         0xFFFFFFFFFFFFFFFFULL
+#define SCHED_CACHE_HOT_CYCLES 1000000ULL  // Stopped this recently: its cache is still warm
+#define SCHED_BALANCE_CYCLES   20000000ULL // Between periodic balances on each CPU
+#define SCHED_MIGRATE_SCAN     8           // Queued processes examined per migration
+
+// Slice lengths by level: short for the interactive levels at the top, the
+// old 10 ms tick at the default level, longer below it
+#define SCHED_SLICES_NS { 500000, 1000000, 2000000, 5000000, \
+                          10000000, 10000000, 20000000, 20000000 }
+
+typedef struct run_node {
+    struct run_node* prev;
+    struct run_node* next;
+    uint32_t priority; // Level it is queued on
+    bool queued;
+} run_node_t;
+
+typedef struct {
+    run_node_t* head;
+    run_node_t* tail;
+} run_list_t;
+
+// All zeroes is an empty queue
+typedef struct {
+    run_list_t levels[SCHED_PRIORITY_LEVELS];
+    uint32_t bitmap; // Bit n set while level n has a process
+    uint32_t count;
+} run_queue_t;
+
+#define run_node_entry(node, type, member) ((type*)((uint8_t*)(node) - offsetof(type, member)))
+
+// Callers keep interrupts off around these
+void run_queue_init(run_queue_t* queue);
+void run_queue_add(run_queue_t* queue, run_node_t* node, uint32_t priority);
+void run_queue_remove(run_queue_t* queue, run_node_t* node);
+run_node_t* run_queue_pop(run_queue_t* queue);
+
+// Fair-share class. Each task accumulates virtual runtime, the ns it ran
+// scaled down by its weight, and the task furthest behind runs next, so
+// CPU time divides in proportion to weight however greedy a task is. The
+// runnable tasks sit in a red-black tree ordered by virtual runtime, with
+// the leftmost cached. A strict-priority task always runs before a fair
+// one.
+#define SCHED_CLASS_FAIR     0
+#define SCHED_CLASS_PRIORITY 1
+
+// Weights by level, those of nice -20, -15, ... 15: level 4 is nice 0 and
+// each level up gets about three times the CPU of the one below
+#define SCHED_NICE_0_WEIGHT 1024
+#define SCHED_FAIR_WEIGHTS  { 88761, 29154, 9548, 3121, 1024, 335, 110, 36 }
+
+// Default latency targets, changed at run time with fair_set_tunables
+#define SCHED_LATENCY_NS         6000000 // Every runnable task gets a slice within this
+#define SCHED_MIN_GRANULARITY_NS 750000  // Shortest slice, however many are runnable
+#define SCHED_WAKEUP_CREDIT_NS   3000000 // How far behind the queue a woken sleeper may start
+
+typedef struct fair_node {
+    struct fair_node* parent;
+    struct fair_node* left;
+    struct fair_node* right;
+    uint64_t vruntime; // Weighted ns, compared only within one queue
+    uint32_t weight;
+    bool red;
+    bool queued;
+} fair_node_t;
+
+// fair_queue_init before use
+typedef struct {
+    fair_node_t* root;
+    fair_node_t* leftmost;  // Smallest vruntime: the next to run
+    uint64_t min_vruntime;  // Never goes back; new and woken tasks are placed from it
+    uint64_t total_weight;  // Of the queued tasks
+    uint32_t count;
+} fair_queue_t;
+
+typedef struct {
+    uint64_t latency_ns;
+    uint64_t min_granularity_ns;
+    uint64_t wakeup_credit_ns;
+} fair_tunables_t;
+
+// Callers keep interrupts off around these too
+void fair_queue_init(fair_queue_t* queue);
+void fair_node_init(fair_queue_t* queue, fair_node_t* node, uint32_t priority);
+void fair_queue_add(fair_queue_t* queue, fair_node_t* node);
+void fair_queue_remove(fair_queue_t* queue, fair_node_t* node);
+fair_node_t* fair_queue_pop(fair_queue_t* queue);
+
+// Charge ns of real run time, queued or not
+void fair_charge(fair_queue_t* queue, fair_node_t* node, uint64_t ns);
+
+// Weight of a priority level; a queued node picks it up when next added
+uint32_t fair_weight(uint32_t priority);
+
+// The share of the latency target this task gets, in ns
+uint64_t fair_slice_ns(fair_queue_t* queue, fair_node_t* node);
+
+// False, changing nothing, unless 0 < min_granularity <= latency
+bool fair_set_tunables(const fair_tunables_t* tunables);
+void fair_get_tunables(fair_tunables_t* tunables);
+
+// Time a task spends ready but not running, for either class and both
+// process tables
+typedef struct {
+    uint64_t ready_since; // Monotonic ns it was queued, 0 while not waiting
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t runs;        // Waits that ended in running
+} sched_wait_t;
+
+static inline void sched_wait_begin(sched_wait_t* wait) {
+    if (!wait->ready_since) wait->ready_since = clock_monotonic_ns();
+}
+
+// ran is false when it left the queue without running
+static inline void sched_wait_end(sched_wait_t* wait, bool ran) {
+    if (!wait->ready_since) return;
+    
+    if (ran) {
+        uint64_t waited = clock_monotonic_ns() - wait->ready_since;
+        wait->total_ns += waited;
+        if (waited > wait->max_ns) wait->max_ns = waited;
+        wait->runs++;
+    }
+    wait->ready_since = 0;
+}
+
+// From the timer interrupt once the slice of a kernel thread on this CPU
+// is over
+void sched_preempt(void);
+
+#endif
@@ -1,47 +1,441 @@
 #include "proc.h"
+#include "sched.h"
+#include "smp.h"
+#include "lapic.h"
+#include "numa.h"
+#include "memory.h"
+#include "kmemprof.h"
+#include "timer.h"
 #include "kernel.h"
 
-extern process_t* current_proc;
-extern process_t processes[MAX_PROCESSES];
 extern void context_switch(context_t** old, context_t* new);
 
+void run_queue_init(run_queue_t* queue) {
+    memory_set(queue, 0, sizeof(run_queue_t));
+}
+
+// Append at the tail of its level, behind processes of equal priority
+void run_queue_add(run_queue_t* queue, run_node_t* node, uint32_t priority) {
+    if (priority >= SCHED_PRIORITY_LEVELS) priority = SCHED_PRIORITY_LEVELS - 1;
+    
+    run_list_t* list = &queue->levels[priority];
+    node->priority = priority;
+    node->queued = true;
+    node->next = NULL;
+    node->prev = list->tail;
+    
+    if (list->tail) {
+        list->tail->next = node;
+    } else {
+        list->head = node;
+    }
+    list->tail = node;
+    
+    queue->bitmap |= 1U << priority;
+    queue->count++;
+}
+
+void run_queue_remove(run_queue_t* queue, run_node_t* node) {
+    if (!node->queued) return;
+    
+    run_list_t* list = &queue->levels[node->priority];
+    
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    
+    if (!list->head) queue->bitmap &= ~(1U << node->priority);
+    queue->count--;
+    
+    node->prev = NULL;
+    node->next = NULL;
+    node->queued = false;
+}
+
+// Take the head of the highest non-empty level
+run_node_t* run_queue_pop(run_queue_t* queue) {
+    if (!queue->bitmap) return NULL;
+    
+    run_node_t* node = queue->levels[__builtin_ctz(queue->bitmap)].head;
+    run_queue_remove(queue, node);
+    return node;
+}
+
+static inline bool sched_allowed(process_t* p, uint32_t cpu) {
+    return (p->affinity >> cpu) & 1;
+}
+
+// Queued processes plus the running one
+static inline uint32_t sched_load(cpu_t* cpu) {
+    return cpu->run_queue.count + (cpu->current ? 1 : 0);
+}
+
+// Least loaded CPU the process may use, this one on a tie
+static cpu_t* sched_select_cpu(process_t* p) {
+    cpu_t* best = NULL;
+    uint32_t best_load = 0;
+    
+    cpu_t* self = this_cpu();
+    if (sched_allowed(p, self->id)) {
+        best = self;
+        best_load = sched_load(self);
+    }
+    
+    for (uint32_t id = 0; id < smp_cpu_count(); id++) {
+        cpu_t* cpu = smp_cpu(id);
+        if (cpu == self || !sched_allowed(p, id)) continue;
+        
+        uint32_t load = sched_load(cpu);
+        if (!best || load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    
+    return best ? best : self;
+}
+
+// Make sure some CPU comes to look at cpu's queue: cpu itself if it is
+// halted, or else the nearest halted CPU the process may run on, which
+// will steal it
+static void sched_kick(cpu_t* cpu, process_t* p) {
+    // Pairs with the idle loop setting idle before it checks its queue
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    cpu_t* self = this_cpu();
+    if (cpu->idle) {
+        if (cpu != self) smp_send_ipi(cpu, SCHED_IPI_VECTOR);
+        return;
+    }
+    
+    // Nothing waits behind the process but itself
+    if (cpu->run_queue.count <= 1 && (!cpu->current || cpu->current == p)) return;
+    
+    cpu_t* nearest = NULL;
+    uint32_t nearest_distance = 0;
+    uint32_t node = numa_cpu_node(cpu->id);
+    
+    for (uint32_t id = 0; id < smp_cpu_count(); id++) {
+        cpu_t* other = smp_cpu(id);
+        if (other == self || !other->idle || !sched_allowed(p, id)) continue;
+        
+        uint32_t distance = numa_distance(node, numa_cpu_node(id));
+        if (!nearest || distance < nearest_distance) {
+            nearest = other;
+            nearest_distance = distance;
+        }
+    }
+    
+    if (nearest) smp_send_ipi(nearest, SCHED_IPI_VECTOR);
+}
+
+// Mark a process runnable and queue it, on the CPU it last ran on while
+// that is allowed so its cache stays warm. Interrupts stay off so a wakeup
+// from an interrupt handler can't interleave with the queue update.
+void sched_make_ready(process_t* p) {
+    cpu_t* cpu = p->cpu != SCHED_NO_CPU && sched_allowed(p, p->cpu) ? smp_cpu(p->cpu) : NULL;
+    if (!cpu) cpu = sched_select_cpu(p);
+    
+    uint64_t flags = irq_save();
+    spin_lock(&cpu->lock);
+    p->state = PROC_STATE_READY;
+    p->cpu = cpu->id;
+    if (!p->run_node.queued) {
+        run_queue_add(&cpu->run_queue, &p->run_node, p->priority);
+        sched_wait_begin(&p->wait);
+    }
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+    
+    sched_kick(cpu, p);
+}
+
+// Lock the queue of the CPU a process belongs to, NULL if it never had
+// one. Another CPU can take it between reading p->cpu and getting the lock,
+// so look again once it is held.
+static cpu_t* sched_lock_cpu_of(process_t* p, uint64_t* flags) {
+    while (1) {
+        uint32_t id = p->cpu;
+        cpu_t* cpu = id != SCHED_NO_CPU ? smp_cpu(id) : NULL;
+        if (!cpu) return NULL;
+        
+        *flags = irq_save();
+        spin_lock(&cpu->lock);
+        if (p->cpu == id) return cpu;
+        
+        spin_unlock(&cpu->lock);
+        irq_restore(*flags);
+    }
+}
+
+// Requeue at the new level if it is waiting to run
+void sched_set_priority(process_t* p, uint32_t priority) {
+    if (priority >= SCHED_PRIORITY_LEVELS) priority = SCHED_PRIORITY_LEVELS - 1;
+    
+    uint64_t flags;
+    cpu_t* cpu = sched_lock_cpu_of(p, &flags);
+    if (!cpu) {
+        p->priority = priority;
+        return;
+    }
+    
+    p->priority = priority;
+    if (p->run_node.queued) {
+        run_queue_remove(&cpu->run_queue, &p->run_node);
+        run_queue_add(&cpu->run_queue, &p->run_node, priority);
+    }
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+}
+
+// A queued process on a CPU it may no longer use moves now; a running one
+// moves when it next yields
+void sched_set_affinity(process_t* p, uint64_t affinity) {
+    if (!affinity) return;
+    
+    uint64_t flags;
+    cpu_t* cpu = sched_lock_cpu_of(p, &flags);
+    if (!cpu) {
+        p->affinity = affinity;
+        return;
+    }
+    
+    bool moved = false;
+    p->affinity = affinity;
+    if (p->run_node.queued && !sched_allowed(p, cpu->id)) {
+        run_queue_remove(&cpu->run_queue, &p->run_node);
+        moved = true;
+    }
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+    
+    if (moved) sched_make_ready(p);
+}
+
+// Take the best queued process from this CPU
+static process_t* sched_pick(cpu_t* cpu) {
+    uint64_t flags = irq_save();
+    spin_lock(&cpu->lock);
+    
+    run_node_t* node = run_queue_pop(&cpu->run_queue);
+    process_t* p = node ? run_node_entry(node, process_t, run_node) : NULL;
+    
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+    return p;
+}
+
+// CPU with the most queued processes the given CPU could take, counting a
+// CPU on another node as less loaded by the ratio of their distances
+static cpu_t* sched_find_busiest(cpu_t* self) {
+    cpu_t* busiest = NULL;
+    uint32_t busiest_load = 0;
+    uint32_t node = numa_cpu_node(self->id);
+    
+    for (uint32_t id = 0; id < smp_cpu_count(); id++) {
+        cpu_t* cpu = smp_cpu(id);
+        if (cpu == self || !cpu->run_queue.count) continue;
+        
+        uint32_t load = cpu->run_queue.count * NUMA_LOCAL_DISTANCE * 16 /
+                        numa_distance(node, numa_cpu_node(id));
+        if (load > busiest_load) {
+            busiest = cpu;
+            busiest_load = load;
+        }
+    }
+    
+    return busiest;
+}
+
+// Move one queued process from another CPU to this one, highest priority
+// first. Cache-hot processes stay unless take_hot; the first few queued
+// are all that is looked at.
+static process_t* sched_take(cpu_t* from, cpu_t* to, bool take_hot) {
+    uint64_t now = rdtsc();
+    process_t* taken = NULL;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&from->lock);
+    
+    uint32_t scanned = 0;
+    uint32_t levels = from->run_queue.bitmap;
+    while (levels && !taken && scanned < SCHED_MIGRATE_SCAN) {
+        uint32_t level = __builtin_ctz(levels);
+        levels &= levels - 1;
+        
+        run_node_t* node = from->run_queue.levels[level].head;
+        for (; node && scanned < SCHED_MIGRATE_SCAN; node = node->next, scanned++) {
+            process_t* p = run_node_entry(node, process_t, run_node);
+            if (!sched_allowed(p, to->id)) continue;
+            if (!take_hot && now - p->last_ran < SCHED_CACHE_HOT_CYCLES) continue;
+            
+            run_queue_remove(&from->run_queue, node);
+            p->cpu = to->id;
+            taken = p;
+            break;
+        }
+    }
+    
+    spin_unlock(&from->lock);
+    irq_restore(flags);
+    return taken;
+}
+
+// With nothing queued here, run something another CPU has waiting. An idle
+// CPU takes a cache-hot process too: it would only wait where it is.
+static process_t* sched_steal(cpu_t* cpu) {
+    cpu_t* busiest = sched_find_busiest(cpu);
+    if (!busiest) return NULL;
+    
+    process_t* p = sched_take(busiest, cpu, true);
+    if (p) cpu->steals++;
+    return p;
+}
+
+// Pull cache-cold processes from the busiest CPU until the two are within
+// one of each other
+static void sched_balance(cpu_t* cpu) {
+    cpu_t* busiest = sched_find_busiest(cpu);
+    if (!busiest) return;
+    
+    uint32_t theirs = sched_load(busiest);
+    uint32_t mine = sched_load(cpu);
+    
+    for (uint32_t moves = theirs > mine + 1 ? (theirs - mine) / 2 : 0; moves > 0; moves--) {
+        process_t* p = sched_take(busiest, cpu, false);
+        if (!p) break;
+        
+        // Its affinity may have changed while it was on neither queue
+        uint64_t flags = irq_save();
+        spin_lock(&cpu->lock);
+        bool allowed = sched_allowed(p, cpu->id);
+        if (allowed) run_queue_add(&cpu->run_queue, &p->run_node, p->priority);
+        spin_unlock(&cpu->lock);
+        irq_restore(flags);
+        
+        if (!allowed) {
+            sched_make_ready(p);
+            continue;
+        }
+        cpu->pulls++;
+    }
+}
+
+static const uint64_t slice_ns[SCHED_PRIORITY_LEVELS] = SCHED_SLICES_NS;
+
+// Switch to a process taken off a queue, and back once it yields, blocks
+// or is preempted. Interrupts stay off until it is running, so the timer
+// never sees a current process whose context is not yet its own.
+static void sched_run(cpu_t* cpu, process_t* p) {
+    // It may have yielded or blocked on another CPU and be still on its way
+    // out there
+    while (__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__ ("pause");
+    }
+    
+    // Not before: the CPU it is leaving still checks whether it was running
+    // to decide whether to requeue it
+    p->state = PROC_STATE_RUNNING;
+    p->on_cpu = true;
+    sched_wait_end(&p->wait, true);
+    p->cpu = cpu->id;
+    cpu->current = p;
+    cpu->switches++;
+    
+    // Switch address space
+    // vmm_switch_page_table(p->page_table);
+    
+    timer_set_slice(slice_ns[p->priority]);
+    context_switch((context_t**)&cpu->scheduler_context, p->context);
+    timer_set_slice(0);
+    
+    // When we return here, the process has finished or yielded; only now
+    // may another CPU resume it
+    cpu->current = NULL;
+    p->last_ran = rdtsc();
+    __atomic_store_n(&p->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+bool scheduler_run_next(void) {
+    cpu_t* cpu = this_cpu();
+    
+    process_t* p = sched_pick(cpu);
+    if (!p) p = sched_steal(cpu);
+    if (!p) return false;
+    
+    uint64_t flags = irq_save();
+    sched_run(cpu, p);
+    irq_restore(flags);
+    return true;
+}
+
+// Each AP ends up here as soon as it is up; the loop is its idle task. The
+// BSP stays in process.c's schedule() and runs kernel threads from there,
+// through scheduler_run_next(), whenever no user process is ready.
 void scheduler(void) {
+    cpu_t* cpu = this_cpu();
+    
     while(1) {
         // Enable interrupts to allow timer preemption
         __asm__ __volatile__ ("sti");
         
-        process_t* p = NULL;
-        for (int i = 0; i < MAX_PROCESSES; i++) {
-            if (processes[i].state == PROC_STATE_READY) {
-                p = &processes[i];
-                break;
-            }
+        uint64_t now = rdtsc();
+        if (now >= cpu->next_balance) {
+            sched_balance(cpu);
+            cpu->next_balance = now + SCHED_BALANCE_CYCLES;
         }
         
-        if (p) {
-            p->state = PROC_STATE_RUNNING;
-            current_proc = p;
-            
-            // Switch address space
-            // vmm_switch_page_table(p->page_table);
-            
-            // We need a placeholder for the kernel's own context when no process is running
-            static context_t* kernel_context;
-            context_switch(&kernel_context, p->context);
-            
-            // When we return here, the process has finished or yielded
-            current_proc = NULL;
-        } else {
-            // Idle loop
-            __asm__ __volatile__ ("hlt");
+        if (scheduler_run_next()) continue;
+        
+        // Idle: zero a free page per pass while the pool has room and fold
+        // in logged heap events, halt once neither has work
+        if (zero_pool_refill() || kmemprof_drain()) continue;
+        
+        // Once idle is visible, a CPU queueing work either sees it and
+        // sends an IPI, or queued early enough for the checks below to find
+        // the work. sti only takes effect after hlt starts, so that IPI
+        // still ends the halt.
+        __asm__ __volatile__ ("cli");
+        __atomic_store_n(&cpu->idle, true, __ATOMIC_SEQ_CST);
+        
+        process_t* p = cpu->run_queue.count ? NULL : sched_steal(cpu);
+        if (!p && !cpu->run_queue.count) {
+            __asm__ __volatile__ ("sti; hlt");
         }
+        
+        cpu->idle = false;
+        if (p) sched_run(cpu, p);
     }
 }
 
 void scheduler_yield(void) {
-    if (current_proc) {
-        current_proc->state = PROC_STATE_READY;
-        // Trigger context switch back to scheduler
-        // This usually involves saving the current state and jumping to scheduler loop
+    // With interrupts on, a preemption between queueing and switching
+    // would switch away a second time
+    uint64_t flags = irq_save();
+    process_t* p = current_proc;
+    if (p) {
+        // A process that blocked itself stays blocked; a running one goes
+        // to the back of its level
+        if (p->state == PROC_STATE_RUNNING) {
+            sched_make_ready(p);
+        }
+        
+        // Switch back to this CPU's scheduler loop, which resumes after its
+        // own context_switch into this process
+        context_switch(&p->context, (context_t*)this_cpu()->scheduler_context);
     }
+    irq_restore(flags);
+}
+
+// The interrupt frame stays on the thread's stack; the thread returns
+// through it when next resumed
+void sched_preempt(void) {
+    scheduler_yield();
 }
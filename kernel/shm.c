@@ -0,0 +1,282 @@
+#include <stddef.h>
+#include "shm.h"
+#include "memory.h"
+#include "vma.h"
+#include "process.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+static shm_object_t shm_objects[MAX_SHM_OBJECTS];
+static spinlock_t shm_lock = SPINLOCK_INIT;
+
+// Copy a name in from the caller, refusing one that doesn't fit
+static bool shm_copy_name(char* dest, const char* name) {
+    for(uint32_t i = 0; i < SHM_NAME_MAX; i++) {
+        dest[i] = name[i];
+        if(!name[i]) return i > 0;
+    }
+    return false;
+}
+
+static shm_object_t* shm_lookup(const char* name) {
+    for(uint32_t i = 0; i < MAX_SHM_OBJECTS; i++) {
+        shm_object_t* object = &shm_objects[i];
+        if(object->used && object->linked && strcmp(object->name, name) == 0) return object;
+    }
+    return NULL;
+}
+
+static shm_object_t* shm_from_id(int64_t id) {
+    if(id < 0 || id >= MAX_SHM_OBJECTS) return NULL;
+    shm_object_t* object = &shm_objects[id];
+    return object->used && object->linked ? object : NULL;
+}
+
+// Drop the object's own reference on each frame; pages nobody else maps
+// go back to the allocator
+static void shm_release_frames(uint64_t* frames, uint64_t count, uint64_t frame_size) {
+    for(uint64_t i = 0; i < count; i++) {
+        for(uint64_t offset = 0; offset < frame_size; offset += PAGE_SIZE) {
+            put_page(frames[i] + offset);
+        }
+    }
+    kfree(frames);
+}
+
+// A 2 MB frame is one buddy block, but its pages are counted one by one
+// like any other user page so that unmap and fork treat it the same
+static uint64_t shm_alloc_huge_frame(void) {
+    uint8_t* block = (uint8_t*)buddy_alloc(COMPACT_REGION_ORDER);
+    if(!block) return 0;
+    
+    memory_set(block, 0, LARGE_PAGE_SIZE);
+    
+    for(uint64_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+        page_t* page = phys_to_page((uint64_t)block + offset);
+        page->flags = 0;
+        page->order = 0;
+        page->ref_count = 1;
+        page->mapping = NULL;
+    }
+    
+    return (uint64_t)block;
+}
+
+static uint64_t* shm_alloc_frames(uint64_t count, uint64_t frame_size) {
+    uint64_t* frames = (uint64_t*)kmalloc(count * sizeof(uint64_t));
+    if(!frames) return NULL;
+    
+    for(uint64_t i = 0; i < count; i++) {
+        frames[i] = frame_size == PAGE_SIZE ? (uint64_t)alloc_page(ALLOC_ZERO) : shm_alloc_huge_frame();
+        if(!frames[i]) {
+            shm_release_frames(frames, i, frame_size);
+            return NULL;
+        }
+    }
+    
+    return frames;
+}
+
+// Empty a slot that is unlinked and unmapped, handing its frames back to
+// the caller to release outside the lock
+static void shm_detach(shm_object_t* object, uint64_t** frames, uint64_t* count, uint64_t* frame_size) {
+    *frames = object->frames;
+    *count = object->frame_count;
+    *frame_size = object->frame_size;
+    memory_set(object, 0, sizeof(shm_object_t));
+}
+
+int64_t shm_create(const char* name, uint64_t size, uint32_t flags) {
+    char key[SHM_NAME_MAX];
+    if(!name || !shm_copy_name(key, name)) return -1;
+    if(size == 0 || size > SHM_MAX_SIZE) return -1;
+    
+    uint64_t frame_size = (flags & SHM_HUGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    size = (size + frame_size - 1) & ~(frame_size - 1);
+    
+    // Opening an existing object costs nothing
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    shm_object_t* existing = shm_lookup(key);
+    int64_t id = existing && existing->size >= size ? existing - shm_objects : -1;
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+    if(existing) return id;
+    
+    // Allocate outside the lock, then check nobody created it meanwhile
+    uint64_t count = size / frame_size;
+    uint64_t* frames = shm_alloc_frames(count, frame_size);
+    if(!frames) return -1;
+    
+    irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    
+    shm_object_t* object = shm_lookup(key);
+    if(object) {
+        id = object->size >= size ? object - shm_objects : -1;
+        object = NULL;
+    } else {
+        for(uint32_t i = 0; i < MAX_SHM_OBJECTS; i++) {
+            if(!shm_objects[i].used) {
+                object = &shm_objects[i];
+                break;
+            }
+        }
+    }
+    
+    if(object) {
+        strcpy(object->name, key);
+        object->size = size;
+        object->flags = flags;
+        object->maps = 0;
+        object->used = true;
+        object->linked = true;
+        object->frame_size = frame_size;
+        object->frame_count = count;
+        object->frames = frames;
+        id = object - shm_objects;
+    }
+    
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+    
+    if(!object) shm_release_frames(frames, count, frame_size);
+    return id;
+}
+
+// The name goes now; the memory stays until the last mapping does
+int shm_unlink(const char* name) {
+    char key[SHM_NAME_MAX];
+    if(!name || !shm_copy_name(key, name)) return -1;
+    
+    uint64_t* frames = NULL;
+    uint64_t count = 0;
+    uint64_t frame_size = 0;
+    
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    
+    shm_object_t* object = shm_lookup(key);
+    if(object) {
+        object->linked = false;
+        if(object->maps == 0) shm_detach(object, &frames, &count, &frame_size);
+    }
+    
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+    
+    if(frames) shm_release_frames(frames, count, frame_size);
+    return object ? 0 : -1;
+}
+
+void shm_get(shm_object_t* object) {
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    object->maps++;
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+}
+
+void shm_put(shm_object_t* object) {
+    uint64_t* frames = NULL;
+    uint64_t count = 0;
+    uint64_t frame_size = 0;
+    
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    
+    object->maps--;
+    if(object->maps == 0 && !object->linked) shm_detach(object, &frames, &count, &frame_size);
+    
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+    
+    if(frames) shm_release_frames(frames, count, frame_size);
+}
+
+uint64_t shm_map(int64_t id, uint64_t address, uint32_t flags) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table) return 0;
+    
+    // The reference taken here becomes the VMA's
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    shm_object_t* object = shm_from_id(id);
+    if(object) object->maps++;
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+    if(!object) return 0;
+    
+    uint64_t size = object->size;
+    uint64_t frame_size = object->frame_size;
+    
+    if(!address) {
+        address = vma_find_free(proc->vmas, SHM_MAP_BASE, SHM_MAP_LIMIT, size, frame_size);
+    } else if(address & (frame_size - 1)) {
+        address = 0;
+    }
+    
+    uint64_t vma_flags = (flags & SHM_RDONLY) ? PAGE_NO_EXECUTE : PAGE_WRITABLE | PAGE_NO_EXECUTE;
+    vma_t* vma = NULL;
+    if(address && address + size <= USER_SPACE_END) {
+        vma = vma_create(&proc->vmas, address, address + size, vma_flags, VMA_SHM);
+    }
+    if(!vma) {
+        shm_put(object);
+        return 0;
+    }
+    vma->shm = object;
+    
+    page_table_t* pml4 = (page_table_t*)proc->page_table;
+    uint64_t pte_flags = vma_flags | PAGE_PRESENT | PAGE_USER | PAGE_SHARED;
+    
+    for(uint64_t i = 0; i < object->frame_count; i++) {
+        uint64_t virtual_addr = address + i * frame_size;
+        uint64_t frame = object->frames[i];
+        
+        for(uint64_t offset = 0; offset < frame_size; offset += PAGE_SIZE) {
+            get_page(frame + offset);
+        }
+        
+        if(frame_size == PAGE_SIZE) {
+            map_page(pml4, virtual_addr, frame, pte_flags);
+        } else {
+            map_range(pml4, virtual_addr, frame, frame_size, pte_flags);
+        }
+    }
+    
+    return address;
+}
+
+// Only a whole mapping can go, named by its start address
+int shm_unmap(uint64_t address) {
+    process_t* proc = get_current_process();
+    if(!proc || !proc->page_table) return -1;
+    
+    vma_t* vma = vma_find(proc->vmas, address);
+    if(!vma || vma->type != VMA_SHM || vma->start != address) return -1;
+    
+    unmap_user_range((page_table_t*)proc->page_table, vma->start, vma->end);
+    vma_remove(&proc->vmas, vma);
+    return 0;
+}
+
+void get_shm_stats(shm_stats_t* stats) {
+    memory_set(stats, 0, sizeof(shm_stats_t));
+    
+    uint64_t irq_flags = irq_save();
+    spin_lock(&shm_lock);
+    
+    for(uint32_t i = 0; i < MAX_SHM_OBJECTS; i++) {
+        shm_object_t* object = &shm_objects[i];
+        if(!object->used) continue;
+        
+        stats->objects++;
+        stats->mappings += object->maps;
+        stats->bytes += object->size;
+        if(object->frame_size != PAGE_SIZE) stats->huge_bytes += object->size;
+    }
+    
+    spin_unlock(&shm_lock);
+    irq_restore(irq_flags);
+}
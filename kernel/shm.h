@@ -0,0 +1,60 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Named shared memory. An object owns one reference on each of its frames
+// and every mapping of it takes another, so the frames outlive whichever
+// side lets go first. A mapping is backed in full when it is made; fork
+// hands the child the same frames, still writable.
+
+#define MAX_SHM_OBJECTS 64
+#define SHM_NAME_MAX    32
+#define SHM_MAX_SIZE    (256ULL * 1024 * 1024)
+
+#define SHM_MAP_BASE  0x0000100000000000ULL // Where mappings go when the caller gives no address
+#define SHM_MAP_LIMIT 0x0000700000000000ULL
+
+// shm_create flags
+#define SHM_HUGE 0x1 // Back with 2 MB frames and map them as large pages
+
+// shm_map flags
+#define SHM_RDONLY 0x1
+
+typedef struct shm_object {
+    char name[SHM_NAME_MAX];
+    uint64_t size;       // Rounded up to the frame size
+    uint32_t flags;
+    uint32_t maps;       // VMAs mapping it, in any process
+    bool used;
+    bool linked;         // Still found by name; freed once unlinked and unmapped
+    uint64_t frame_size; // PAGE_SIZE, or LARGE_PAGE_SIZE for SHM_HUGE
+    uint64_t frame_count;
+    uint64_t* frames;    // Physical address of each frame
+} shm_object_t;
+
+typedef struct {
+    uint32_t objects;
+    uint32_t mappings;
+    uint64_t bytes;
+    uint64_t huge_bytes;
+} shm_stats_t;
+
+// Return an object id, or -1. Opens the object if the name exists and is
+// at least size bytes.
+int64_t shm_create(const char* name, uint64_t size, uint32_t flags);
+int shm_unlink(const char* name);
+
+// Map or unmap an object in the current process. address 0 lets the kernel
+// pick; returns the mapped address, or 0 on failure.
+uint64_t shm_map(int64_t id, uint64_t address, uint32_t flags);
+int shm_unmap(uint64_t address);
+
+// Mapping references, taken and dropped by the VMA code
+void shm_get(shm_object_t* object);
+void shm_put(shm_object_t* object);
+
+void get_shm_stats(shm_stats_t* stats);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stddef.h>
+#include "smp.h"
+#include "lapic.h"
+#include "acpi.h"
+#include "numa.h"
+#include "timer.h"
+#include "memory.h"
+#include "kernel.h"
+
+_Static_assert(offsetof(cpu_t, id) == CPU_ID_OFFSET, "cpu_id() reads cpu_t.id at CPU_ID_OFFSET");
+
+#define EFER_LMA (1 << 10) // Read-only; the AP sets LME and paging makes it active
+
+// Trampoline code and data slots, from trampoline.asm
+extern uint8_t trampoline_start[];
+extern uint8_t trampoline_end[];
+extern uint64_t trampoline_cr3;
+extern uint64_t trampoline_cr4;
+extern uint64_t trampoline_efer;
+extern uint64_t trampoline_stack;
+extern uint64_t trampoline_entry;
+extern uint64_t trampoline_cpu;
+
+extern void scheduler(void);
+
+// A data slot in the copy at TRAMPOLINE_BASE
+#define TRAMPOLINE_SLOT(slot) (*(volatile uint64_t*)(TRAMPOLINE_BASE + ((uint8_t*)&(slot) - trampoline_start)))
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) descriptor_pointer_t;
+
+static cpu_t cpus[MAX_CPUS];
+static uint32_t cpu_count = 1;
+
+// The shootdown in progress, guarded by tlb_lock; 0 pages flushes everything
+static spinlock_t tlb_lock = SPINLOCK_INIT;
+static volatile uint64_t tlb_address;
+static volatile uint64_t tlb_pages;
+
+// The BSP's tables, which every AP loads too
+static descriptor_pointer_t gdt_pointer;
+static descriptor_pointer_t idt_pointer;
+
+void smp_early_init(void) {
+    cpu_t* cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->online = true;
+    
+    write_msr(MSR_GS_BASE, (uint64_t)cpu);
+    write_msr(MSR_KERNEL_GS_BASE, 0);
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+cpu_t* smp_cpu(uint32_t id) {
+    return id < cpu_count ? &cpus[id] : NULL;
+}
+
+void smp_send_ipi(cpu_t* cpu, uint8_t vector) {
+    lapic_send_ipi(cpu->apic_id, vector);
+}
+
+static void tlb_flush_local(uint64_t address, uint64_t pages) {
+    if(pages == 0 || pages > TLB_FLUSH_MAX_PAGES) {
+        flush_tlb_global();
+        return;
+    }
+    
+    for(uint64_t i = 0; i < pages; i++) {
+        flush_tlb_page(address + i * PAGE_SIZE);
+    }
+}
+
+// Called from the shootdown IPI and from every spin on a lock. Until the
+// APs are up there is nothing to answer, and the GS base may not be set.
+void tlb_shootdown_poll(void) {
+    if(cpu_count <= 1) return;
+    
+    cpu_t* cpu = this_cpu();
+    if(!__atomic_load_n(&cpu->tlb_pending, __ATOMIC_ACQUIRE)) return;
+    
+    tlb_flush_local(tlb_address, tlb_pages);
+    cpu->tlb_shootdowns++;
+    __atomic_store_n(&cpu->tlb_pending, false, __ATOMIC_RELEASE);
+}
+
+// One shootdown at a time. Waiting for the others with interrupts off is
+// safe because a CPU that is itself waiting, for tlb_lock or any other
+// lock, polls for the request while it spins.
+static void smp_shootdown(uint64_t address, uint64_t pages) {
+    tlb_flush_local(address, pages);
+    if(cpu_count <= 1) return;
+    
+    uint64_t flags = irq_save();
+    spin_lock(&tlb_lock);
+    
+    tlb_address = address;
+    tlb_pages = pages;
+    
+    uint32_t self = cpu_id();
+    for(uint32_t i = 0; i < cpu_count; i++) {
+        if(i == self || !cpus[i].online) continue;
+        __atomic_store_n(&cpus[i].tlb_pending, true, __ATOMIC_RELEASE);
+        smp_send_ipi(&cpus[i], TLB_SHOOTDOWN_VECTOR);
+    }
+    
+    for(uint32_t i = 0; i < cpu_count; i++) {
+        while(__atomic_load_n(&cpus[i].tlb_pending, __ATOMIC_ACQUIRE)) {
+            __asm__ __volatile__ ("pause");
+        }
+    }
+    
+    spin_unlock(&tlb_lock);
+    irq_restore(flags);
+}
+
+void smp_flush_tlb_range(uint64_t address, uint64_t pages) {
+    if(pages) smp_shootdown(address & ~(uint64_t)(PAGE_SIZE - 1), pages);
+}
+
+void smp_flush_tlb_all(void) {
+    smp_shootdown(0, 0);
+}
+
+// First C code on an AP, on its own stack with interrupts off
+static void ap_main(cpu_t* cpu) {
+    write_msr(MSR_GS_BASE, (uint64_t)cpu);
+    write_msr(MSR_KERNEL_GS_BASE, 0);
+    
+    __asm__ __volatile__ ("lgdt %0" : : "m"(gdt_pointer));
+    __asm__ __volatile__ ("lidt %0" : : "m"(idt_pointer));
+    
+    // Kernel writes to copy-on-write user pages must fault here as well
+    write_cr0(read_cr0() | CR0_WP);
+    
+    lapic_enable();
+    timer_cpu_init();
+    numa_set_cpu_apic(cpu->id, cpu->apic_id);
+    
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    
+    scheduler();
+}
+
+// INIT, then up to two SIPIs, as the MP spec lays out. The trampoline data
+// is shared, so APs come up one at a time.
+static bool smp_boot_ap(uint32_t apic_id) {
+    cpu_t* cpu = &cpus[cpu_count];
+    void* stack = vzalloc(AP_STACK_SIZE);
+    if(!stack) return false;
+    
+    cpu->self = cpu;
+    cpu->id = cpu_count;
+    cpu->apic_id = apic_id;
+    cpu->online = false;
+    cpu->stack = (uint64_t)stack;
+    
+    TRAMPOLINE_SLOT(trampoline_stack) = (uint64_t)stack + AP_STACK_SIZE;
+    TRAMPOLINE_SLOT(trampoline_cpu) = (uint64_t)cpu;
+    
+    lapic_send_init(apic_id);
+    pit_delay_us(10000);
+    
+    for(uint32_t attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_startup(apic_id, TRAMPOLINE_BASE >> 12);
+        
+        // 200 us between SIPIs; then give a slow AP up to 100 ms to check in
+        pit_delay_us(200);
+        for(uint32_t waited = 0; attempt == 1 && waited < 100 && !cpu->online; waited++) {
+            pit_delay_us(1000);
+        }
+    }
+    
+    if(!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+        kprintf("SMP: CPU with APIC id %u did not start\n", apic_id);
+        vfree(stack);
+        memory_set(cpu, 0, sizeof(cpu_t));
+        return false;
+    }
+    
+    cpu_count++;
+    return true;
+}
+
+// Local APIC id of an enabled MADT processor entry, or -1
+static int64_t madt_cpu_apic_id(acpi_madt_entry_t* header) {
+    if(header->type == MADT_LOCAL_APIC) {
+        acpi_madt_lapic_t* cpu = (acpi_madt_lapic_t*)header;
+        return (cpu->flags & MADT_ENABLED) ? cpu->apic_id : -1;
+    }
+    
+    // Only ids an xAPIC can address; the rest would need x2APIC mode
+    if(header->type == MADT_LOCAL_X2APIC) {
+        acpi_madt_x2apic_t* cpu = (acpi_madt_x2apic_t*)header;
+        return (cpu->flags & MADT_ENABLED) && cpu->x2apic_id < 0xFF ? (int64_t)cpu->x2apic_id : -1;
+    }
+    
+    return -1;
+}
+
+void smp_init(void) {
+    acpi_madt_t* madt = (acpi_madt_t*)acpi_find_table("APIC");
+    if(!madt) {
+        kprintf("SMP: no MADT, running on the boot CPU only\n");
+        return;
+    }
+    
+    uint8_t* start = (uint8_t*)madt + sizeof(acpi_madt_t);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    
+    // An override entry replaces the 32-bit address
+    uint64_t lapic_address = madt->lapic_address;
+    for(uint8_t* entry = start; entry + sizeof(acpi_madt_entry_t) <= end;) {
+        acpi_madt_entry_t* header = (acpi_madt_entry_t*)entry;
+        if(header->length == 0) break;
+        if(header->type == MADT_LAPIC_OVERRIDE) {
+            lapic_address = ((acpi_madt_lapic_override_t*)entry)->address;
+        }
+        entry += header->length;
+    }
+    
+    lapic_init(lapic_address ? lapic_address : LAPIC_DEFAULT_BASE);
+    lapic_enable();
+    cpus[0].apic_id = lapic_id();
+    
+    // Everything the APs copy from the BSP
+    memory_copy((void*)TRAMPOLINE_BASE, trampoline_start, trampoline_end - trampoline_start);
+    TRAMPOLINE_SLOT(trampoline_cr3) = (uint64_t)get_kernel_page_table();
+    TRAMPOLINE_SLOT(trampoline_cr4) = read_cr4();
+    TRAMPOLINE_SLOT(trampoline_efer) = read_msr(MSR_EFER) & ~(uint64_t)EFER_LMA;
+    TRAMPOLINE_SLOT(trampoline_entry) = (uint64_t)ap_main;
+    __asm__ __volatile__ ("sgdt %0" : "=m"(gdt_pointer));
+    __asm__ __volatile__ ("sidt %0" : "=m"(idt_pointer));
+    
+    for(uint8_t* entry = start; entry + sizeof(acpi_madt_entry_t) <= end && cpu_count < MAX_CPUS;) {
+        acpi_madt_entry_t* header = (acpi_madt_entry_t*)entry;
+        if(header->length == 0) break;
+        
+        int64_t apic_id = madt_cpu_apic_id(header);
+        if(apic_id >= 0 && apic_id != cpus[0].apic_id) smp_boot_ap((uint32_t)apic_id);
+        
+        entry += header->length;
+    }
+    
+    kprintf("SMP: %u CPU%s online\n", cpu_count, cpu_count == 1 ? "" : "s");
+}
@@ -0,0 +1,81 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "sched.h"
+#include "spinlock.h"
+
+// Symmetric multiprocessing. The BSP finds the other CPUs in the ACPI MADT
+// and starts each one with INIT-SIPI-SIPI through a real-mode trampoline.
+// Every CPU reaches its own cpu_t through its GS base and runs its own
+// scheduler loop over its own run queue.
+
+#define TRAMPOLINE_BASE 0x7000 // Page aligned below 1 MB; the SIPI vector is its page number
+#define AP_STACK_SIZE   16384  // Each AP's scheduler loop runs here
+#define TLB_FLUSH_MAX_PAGES 32 // Past this a shootdown flushes everything instead
+
+typedef struct cpu {
+    struct cpu* self;       // First, so this_cpu() is one GS-relative load
+    uint32_t id;            // At CPU_ID_OFFSET, for cpu_id()
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool idle;     // Halted in the scheduler loop
+    
+    struct process* current;  // proc.h process running here, NULL in the scheduler loop
+    void* scheduler_context;  // Where a process running here switches back to
+    uint64_t stack;           // AP boot stack, 0 on the BSP
+    
+    // Scheduler state, run_queue guarded by lock
+    spinlock_t lock;
+    run_queue_t run_queue;
+    uint64_t next_balance;  // TSC of the next periodic balance
+    uint64_t switches;
+    uint64_t steals;        // Taken from another CPU while idle
+    uint64_t pulls;         // Moved here by the periodic balancer
+    
+    // Timer state (timer.h), touched only by this CPU with interrupts off
+    struct ktimer* timers;      // Pending software timers, soonest first
+    uint64_t slice_end;         // TSC when the running process is preempted, 0 for never
+    uint64_t timer_armed;       // TSC the APIC timer fires at, 0 if it is not counting
+    uint64_t timer_interrupts;
+    
+    // TLB shootdown: set by the CPU that changed the page tables, cleared
+    // here once the flush it asked for is done
+    volatile bool tlb_pending;
+    uint64_t tlb_shootdowns;
+} __attribute__((aligned(CACHE_LINE_SIZE))) cpu_t;
+
+static inline cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    __asm__ __volatile__ ("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Point the BSP's GS base at its cpu_t; the first thing kernel_main does
+void smp_early_init(void);
+
+// Start every other enabled CPU in the MADT
+void smp_init(void);
+
+uint32_t smp_cpu_count(void);
+
+// NULL unless the CPU is online
+cpu_t* smp_cpu(uint32_t id);
+
+// Interrupt another CPU with a vector of its local APIC
+void smp_send_ipi(cpu_t* cpu, uint8_t vector);
+
+// TLB shootdown. After changing a mapping other CPUs may have cached,
+// flush it here and on every other online CPU; these return once all of
+// them have. Interrupts may be off and locks held: a CPU spinning on a
+// lock still answers, from spin_lock().
+void smp_flush_tlb_range(uint64_t address, uint64_t pages);
+void smp_flush_tlb_all(void); // Global kernel mappings included
+
+static inline void smp_flush_tlb_page(uint64_t address) {
+    smp_flush_tlb_range(address, 1);
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// smp.c; answers TLB shootdowns while spinning with interrupts off
+void tlb_shootdown_poll(void);
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t* lock) {
+    while(__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain read so waiters don't bounce the cache line
+        while(lock->locked) {
+            tlb_shootdown_poll();
+            __asm__ __volatile__ ("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
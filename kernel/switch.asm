@@ -28,3 +28,11 @@ context_switch:
     pop rbp
 
     ret
+
+global kthread_start
+
+; First switch into a new kernel thread lands here with its entry point in
+; r12. Scheduler loops switch with interrupts off, so turn them on first.
+kthread_start:
+    sti
+    jmp r12
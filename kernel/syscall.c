@@ -1,14 +1,29 @@
+#include "syscall.h"
 #include "kernel.h"
 #include "proc.h"
+#include "shm.h"
+#include "mmap.h"
+#include "clock.h"
+#include "sched.h"
 
 // System Call Numbers
 #define SYS_READ  0
 #define SYS_WRITE 1
 #define SYS_OPEN  2
 #define SYS_CLOSE 3
+#define SYS_MMAP   9
+#define SYS_MUNMAP 11
+#define SYS_BRK    12
+#define SYS_MSYNC  26
+#define SYS_SHM_CREATE 29
+#define SYS_SHM_MAP    30
+#define SYS_SHM_UNLINK 31
+#define SYS_SHM_UNMAP  67
 #define SYS_FORK  57
 #define SYS_EXEC  59
 #define SYS_EXIT  60
+#define SYS_CLOCK_GETTIME 228 // Also served without a syscall by the vDSO
+#define SYS_SCHED_TUNABLES 314
 
 typedef uint64_t (*syscall_handler_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
@@ -23,9 +38,67 @@ static uint64_t sys_write(uint64_t fd, uint64_t buf, uint64_t count) {
     return count;
 }
 
+static uint64_t sys_mmap(uint64_t address, uint64_t length, uint64_t prot, uint64_t flags,
+                         uint64_t fd, uint64_t offset) {
+    return do_mmap(address, length, (uint32_t)prot, (uint32_t)flags, (int)fd, offset);
+}
+
+static uint64_t sys_munmap(uint64_t address, uint64_t length) {
+    return (uint64_t)(int64_t)do_munmap(address, length);
+}
+
+static uint64_t sys_brk(uint64_t address) {
+    return do_brk(address);
+}
+
+static uint64_t sys_msync(uint64_t address, uint64_t length, uint64_t flags) {
+    return (uint64_t)(int64_t)do_msync(address, length, (uint32_t)flags);
+}
+
+// Shared memory: create or open by name, map by id, unmap by address
+static uint64_t sys_shm_create(uint64_t name, uint64_t size, uint64_t flags) {
+    return (uint64_t)shm_create((const char*)name, size, (uint32_t)flags);
+}
+
+static uint64_t sys_shm_map(uint64_t id, uint64_t address, uint64_t flags) {
+    uint64_t mapped = shm_map((int64_t)id, address, (uint32_t)flags);
+    return mapped ? mapped : (uint64_t)-1;
+}
+
+static uint64_t sys_shm_unmap(uint64_t address) {
+    return (uint64_t)(int64_t)shm_unmap(address);
+}
+
+static uint64_t sys_shm_unlink(uint64_t name) {
+    return (uint64_t)(int64_t)shm_unlink((const char*)name);
+}
+
+static uint64_t sys_clock_gettime(uint64_t clock, uint64_t ts) {
+    if (!ts) return -1;
+    return clock_gettime((int)clock, (timespec_t*)ts);
+}
+
+// Fair-class tunables: copy the current ones out to 'old' and install
+// 'values', either may be 0. Fails if the new ones are inconsistent.
+static uint64_t sys_sched_tunables(uint64_t values, uint64_t old) {
+    if (old) fair_get_tunables((fair_tunables_t*)old);
+    if (values && !fair_set_tunables((const fair_tunables_t*)values)) return -1;
+    return 0;
+}
+
 static syscall_handler_t syscall_table[] = {
     [SYS_EXIT] = (syscall_handler_t)sys_exit,
     [SYS_WRITE] = (syscall_handler_t)sys_write,
+    [SYS_MMAP] = (syscall_handler_t)sys_mmap,
+    [SYS_MUNMAP] = (syscall_handler_t)sys_munmap,
+    [SYS_BRK] = (syscall_handler_t)sys_brk,
+    [SYS_MSYNC] = (syscall_handler_t)sys_msync,
+    [SYS_SHM_CREATE] = (syscall_handler_t)sys_shm_create,
+    [SYS_SHM_MAP] = (syscall_handler_t)sys_shm_map,
+    [SYS_SHM_UNLINK] = (syscall_handler_t)sys_shm_unlink,
+    [SYS_SHM_UNMAP] = (syscall_handler_t)sys_shm_unmap,
+    [SYS_CLOCK_GETTIME] = (syscall_handler_t)sys_clock_gettime,
+    [SYS_SCHED_TUNABLES] = (syscall_handler_t)sys_sched_tunables,
     // Add more handlers...
 };
 
@@ -0,0 +1,10 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include "interrupt.h"
+
+// int 0x80: number in rax, arguments in rdi, rsi, rdx, r10, r8 and r9, the
+// result back in rax
+void handle_syscall(interrupt_frame_t* frame);
+
+#endif
@@ -1,33 +1,186 @@
 #include "kernel.h"
 #include "process.h"
+#include "timer.h"
+#include "clock.h"
+#include "lapic.h"
+#include "smp.h"
+#include "sched.h"
+#include "cpu.h"
+#include "io.h"
+
+#define CPUID_TSC_DEADLINE (1 << 24) // Leaf 1, ECX
+
+static uint64_t lapic_khz;   // APIC timer counts per ms at divide 16, 0 on the PIT fallback
+static bool tsc_deadline;
+
+void pit_delay_us(uint32_t us) {
+    uint64_t count = (uint64_t)PIT_FREQUENCY * us / 1000000;
+    if (count == 0) count = 1;
+    if (count > 0xFFFF) count = 0xFFFF;
+    
+    // Gate channel 2 on with the speaker off, count down once in mode 0
+    // and wait for its output to go high
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+    
+    while (!(inb(0x61) & 0x20));
+    
+    outb(0x61, gate);
+}
+
+// Count APIC timer ticks over an interval of the already calibrated TSC
+static void timer_calibrate(void) {
+    lapic_timer_setup(LVT_MASKED | LVT_TIMER_ONESHOT);
+    lapic_timer_start(0xFFFFFFFF);
+    uint64_t end = rdtsc() + clock_ns_to_tsc(TIMER_CALIBRATE_US * 1000ULL);
+    
+    while (rdtsc() < end) {
+        __asm__ __volatile__ ("pause");
+    }
+    
+    uint32_t counted = 0xFFFFFFFF - lapic_timer_remaining();
+    lapic_timer_start(0);
+    
+    lapic_khz = lapic_present() ? (uint64_t)counted * 1000 / TIMER_CALIBRATE_US : 0;
+    
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    tsc_deadline = lapic_khz && (ecx & CPUID_TSC_DEADLINE);
+}
+
+// Point this CPU's timer at a TSC deadline, unless it already is
+static void timer_program(cpu_t* cpu, uint64_t deadline) {
+    if (!lapic_khz || deadline == cpu->timer_armed) return;
+    cpu->timer_armed = deadline;
+    
+    if (tsc_deadline) {
+        write_msr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+    
+    // A count that does not fit fires early; the handler then rearms
+    uint64_t now = rdtsc();
+    uint64_t count = deadline > now ? (deadline - now) * lapic_khz / clock_tsc_khz() : 1;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_timer_start((uint32_t)count);
+}
+
+// Arm for the earliest of slice end and first timer; with neither, stay
+// quiet
+static void timer_rearm(cpu_t* cpu) {
+    uint64_t deadline = cpu->slice_end;
+    if (cpu->timers && (!deadline || cpu->timers->deadline < deadline)) {
+        deadline = cpu->timers->deadline;
+    }
+    if (deadline) timer_program(cpu, deadline);
+}
+
+void timer_cpu_init(void) {
+    lapic_timer_setup(tsc_deadline ? LVT_TIMER_TSC_DEADLINE : LVT_TIMER_ONESHOT);
+}
 
 // APIC/PIT Timer Setup for Preemptive Scheduling
 void setup_scheduler_timer(void) {
-    // Using PIT (Programmable Interval Timer) for simplicity but high frequency
-    uint32_t divisor = 1193182 / 100; // 100 Hz (10ms)
+    static bool done;
+    if (done) return;
+    done = true;
+    
+    // The APIC sits where its base MSR says until the MADT is read
+    if (!lapic_present()) lapic_init(read_msr(MSR_APIC_BASE) & ~0xFFFULL);
+    lapic_enable();
+    timer_calibrate();
+    
+    if (lapic_khz) {
+        // Mask the PIT's IRQ 0; each CPU's APIC timer takes over
+        outb(0x21, inb(0x21) | 0x01);
+        timer_cpu_init();
+        kprintf("Scheduler timer: APIC %s, %lu kHz\n",
+                tsc_deadline ? "TSC-deadline" : "one-shot", lapic_khz);
+        return;
+    }
+    
+    uint32_t divisor = PIT_FREQUENCY / PIT_FALLBACK_HZ;
     outb(0x43, 0x36);             // Command register
     outb(0x40, divisor & 0xFF);   // Low byte
     outb(0x40, (divisor >> 8) & 0xFF); // High byte
     
-    kprintf("Scheduler timer initialized (100Hz)\n");
+    kprintf("Scheduler timer initialized (PIT %uHz)\n", PIT_FALLBACK_HZ);
+}
+
+// Keep the list sorted so the head is always the next to expire
+void timer_add(ktimer_t* timer, uint64_t delay_ns) {
+    cpu_t* cpu = this_cpu();
+    if (timer->pending) timer_cancel(timer);
+    
+    timer->deadline = rdtsc() + clock_ns_to_tsc(delay_ns);
+    ktimer_t** link = &cpu->timers;
+    while (*link && (*link)->deadline <= timer->deadline) {
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    *link = timer;
+    timer->pending = true;
+    
+    if (cpu->timers == timer) timer_rearm(cpu);
 }
 
-// Timer Interrupt Handler (called from ISR)
+// A timer that moves further out leaves the hardware armed early; the
+// interrupt finds nothing due and rearms
+void timer_cancel(ktimer_t* timer) {
+    if (!timer->pending) return;
+    
+    ktimer_t** link = &this_cpu()->timers;
+    while (*link && *link != timer) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = timer->next;
+    timer->pending = false;
+}
+
+void timer_set_slice(uint64_t ns) {
+    cpu_t* cpu = this_cpu();
+    cpu->slice_end = ns ? rdtsc() + clock_ns_to_tsc(ns) : 0;
+    
+    // Ending a slice leaves the timer armed rather than paying to disarm it
+    if (cpu->slice_end && (!cpu->timer_armed || cpu->slice_end < cpu->timer_armed)) {
+        timer_program(cpu, cpu->slice_end);
+    }
+}
+
+// Timer Interrupt Handler (called from ISR): run what has expired, end the
+// slice if it is over, and program the next expiry
 void timer_handler(interrupt_frame_t* frame) {
-    // Increment system time
-    // update_system_time();
-    
-    if (current_process) {
-        current_process->cpu_time += 10;
-        
-        // Check if time slice expired
-        if (current_process->time_slice > 0) {
-            current_process->time_slice--;
-        }
-        
-        if (current_process->time_slice == 0) {
-            // Trigger a schedule
-            schedule();
-        }
+    (void)frame;
+    cpu_t* cpu = this_cpu();
+    uint64_t now = rdtsc();
+    cpu->timer_armed = 0;
+    cpu->timer_interrupts++;
+    
+    // Callbacks may add timers of their own
+    while (cpu->timers && cpu->timers->deadline <= now) {
+        ktimer_t* timer = cpu->timers;
+        cpu->timers = timer->next;
+        __atomic_store_n(&timer->pending, false, __ATOMIC_SEQ_CST);
+        timer->fn(timer);
+    }
+    
+    bool slice_over = cpu->slice_end && cpu->slice_end <= now;
+    if (slice_over) cpu->slice_end = 0;
+    timer_rearm(cpu);
+    
+    if (!slice_over) return;
+    
+    process_t* current_process = get_current_process();
+    if (cpu->current) {
+        // A kernel thread: back to this CPU's scheduler loop
+        sched_preempt();
+    } else if (current_process && current_process->state == PROCESS_RUNNING) {
+        // context_switch charges it for the time it ran. Otherwise this tick
+        // landed in schedule()'s idle loop, which picks the next process.
+        schedule();
     }
 }
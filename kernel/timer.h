@@ -0,0 +1,46 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "interrupt.h"
+
+#define PIT_FREQUENCY 1193182
+
+// Each CPU has one one-shot timer, the local APIC's, in TSC-deadline mode
+// when the CPU has it. It is programmed for whichever comes first of the
+// running process's slice end and the CPU's earliest software timer, and
+// not at all when neither exists, so an idle CPU takes no ticks. Without a
+// usable APIC timer the PIT ticks at PIT_FALLBACK_HZ instead and the same
+// deadlines are checked on each tick.
+
+#define PIT_FALLBACK_HZ   100
+#define TIMER_CALIBRATE_US 10000 // TSC interval the APIC timer is measured over
+
+// Software timer. fn runs in the timer interrupt on the CPU that added it.
+typedef struct ktimer {
+    uint64_t deadline;  // TSC
+    void (*fn)(struct ktimer* timer);
+    void* data;
+    struct ktimer* next;
+    bool pending;
+} ktimer_t;
+
+// Busy-wait on PIT channel 2, which leaves the tick on channel 0 alone.
+// Good for up to about 50 ms; for delays before other timers exist.
+void pit_delay_us(uint32_t us);
+
+// Per AP, once setup_scheduler_timer has calibrated on the BSP
+void timer_cpu_init(void);
+
+// On the calling CPU, with interrupts off; cancel on that same CPU
+void timer_add(ktimer_t* timer, uint64_t delay_ns);
+void timer_cancel(ktimer_t* timer);
+
+// The process about to run here gets ns before the timer preempts it; 0
+// ends the slice when it stops running. Interrupts off.
+void timer_set_slice(uint64_t ns);
+
+void timer_handler(interrupt_frame_t* frame);
+
+#endif
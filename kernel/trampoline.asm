@@ -0,0 +1,105 @@
+; Application processor startup. smp_init copies trampoline_start up to
+; trampoline_end to TRAMPOLINE_BASE, fills in the data slots at the end and
+; sends a SIPI for that page. The AP starts at the top in real mode and
+; leaves in long mode, on the BSP's page tables and its own stack.
+
+TRAMPOLINE_BASE equ 0x7000 ; Must match smp.h
+
+; Address of a trampoline label once copied
+%define T(label) (TRAMPOLINE_BASE + ((label) - trampoline_start))
+
+global trampoline_start
+global trampoline_end
+global trampoline_cr3
+global trampoline_cr4
+global trampoline_efer
+global trampoline_stack
+global trampoline_entry
+global trampoline_cpu
+
+section .text
+
+[bits 16]
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+
+    o32 lgdt [T(trampoline_gdtr)]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+
+    jmp dword 0x08:T(trampoline_32)
+
+[bits 32]
+trampoline_32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Same paging setup as the BSP: its CR4, EFER and kernel page tables
+    mov eax, [T(trampoline_cr4)]
+    mov cr4, eax
+    mov eax, [T(trampoline_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080
+    mov eax, [T(trampoline_efer)]
+    xor edx, edx
+    wrmsr
+
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    jmp 0x18:T(trampoline_64)
+
+[bits 64]
+trampoline_64:
+    mov ax, 0x20
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; entry(cpu) never returns
+    mov rsp, [T(trampoline_stack)]
+    mov rdi, [T(trampoline_cpu)]
+    mov rax, [T(trampoline_entry)]
+    call rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+; Same layout as the boot GDT, so the selectors match the BSP's
+align 8
+trampoline_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF ; 0x10: 32-bit data
+    dq 0x00AF9A000000FFFF ; 0x18: 64-bit code
+    dq 0x00AF92000000FFFF ; 0x20: 64-bit data
+trampoline_gdt_end:
+
+trampoline_gdtr:
+    dw trampoline_gdt_end - trampoline_gdt - 1
+    dd T(trampoline_gdt)
+
+; Filled in by smp_init before each SIPI
+align 8
+trampoline_cr3:   dq 0
+trampoline_cr4:   dq 0
+trampoline_efer:  dq 0
+trampoline_stack: dq 0
+trampoline_entry: dq 0
+trampoline_cpu:   dq 0
+
+trampoline_end:
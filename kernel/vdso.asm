@@ -0,0 +1,86 @@
+; User-space clock reads. vdso_init copies vdso_start up to vdso_end into
+; the page mapped right after the vvar page in every process, so the code
+; finds vvar one page below its own start. It must stay position
+; independent: RIP-relative references only.
+
+VVAR_SIZE equ 4096
+
+; vdso_data_t, must match vdso.h
+VVAR_SEQ             equ 0
+VVAR_TSC_BASE        equ 8
+VVAR_MULT            equ 16
+VVAR_REALTIME_OFFSET equ 24
+
+CLOCK_REALTIME  equ 0 ; Must match clock.h
+CLOCK_MONOTONIC equ 1
+CLOCK_SHIFT     equ 32
+NSEC_PER_SEC    equ 1000000000
+
+global vdso_start
+global vdso_end
+
+section .text
+
+[bits 64]
+vdso_start:
+    ; Entry table, indexed by the VDSO_* slots in vdso.h
+    dq vdso_clock_gettime - vdso_start
+    dq vdso_clock_ns - vdso_start
+
+; uint64_t clock_ns(int clock)
+vdso_clock_ns:
+    lea r8, [rel vdso_start - VVAR_SIZE]
+    cmp edi, CLOCK_MONOTONIC
+    ja .unknown
+
+.retry:
+    ; An odd or changed count means the kernel was mid-update
+    mov r9d, [r8 + VVAR_SEQ]
+    test r9d, 1
+    jnz .busy
+
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, [r8 + VVAR_TSC_BASE]
+    mul qword [r8 + VVAR_MULT]
+    shrd rax, rdx, CLOCK_SHIFT
+
+    cmp edi, CLOCK_REALTIME
+    jne .done
+    add rax, [r8 + VVAR_REALTIME_OFFSET]
+
+.done:
+    cmp r9d, [r8 + VVAR_SEQ]
+    jne .retry
+    ret
+
+.busy:
+    pause
+    jmp .retry
+
+.unknown:
+    xor eax, eax
+    ret
+
+; int clock_gettime(int clock, timespec_t* ts)
+vdso_clock_gettime:
+    cmp edi, CLOCK_MONOTONIC
+    ja .invalid
+
+    mov r10, rsi
+    call vdso_clock_ns
+    xor edx, edx
+    mov rcx, NSEC_PER_SEC
+    div rcx
+    mov [r10], rax     ; tv_sec
+    mov [r10 + 8], rdx ; tv_nsec
+    xor eax, eax
+    ret
+
+.invalid:
+    mov eax, -1
+    ret
+
+vdso_end:
@@ -0,0 +1,46 @@
+#include <stddef.h>
+#include "vdso.h"
+#include "clock.h"
+#include "kernel.h"
+
+_Static_assert(offsetof(vdso_data_t, tsc_base) == 8, "vdso.asm reads tsc_base at 8");
+_Static_assert(offsetof(vdso_data_t, mult) == 16, "vdso.asm reads mult at 16");
+_Static_assert(offsetof(vdso_data_t, realtime_offset) == 24, "vdso.asm reads realtime_offset at 24");
+
+// User code, from vdso.asm
+extern uint8_t vdso_start[];
+extern uint8_t vdso_end[];
+
+static vdso_data_t* vvar_page;
+static void* text_page;
+
+void vdso_init(void) {
+    vvar_page = (vdso_data_t*)alloc_page(ALLOC_ZERO);
+    text_page = alloc_page(ALLOC_ZERO);
+    if(!vvar_page || !text_page) {
+        kprintf("vDSO: out of memory, not mapping it\n");
+        vvar_page = NULL;
+        return;
+    }
+    
+    // The kernel's own references keep both frames from ever being freed
+    // when the last process unmaps them
+    get_page((uint64_t)vvar_page);
+    get_page((uint64_t)text_page);
+    
+    memory_copy(text_page, vdso_start, vdso_end - vdso_start);
+    clock_fill_vdso(vvar_page);
+}
+
+bool vdso_map(vma_t** vmas, page_table_t* pml4) {
+    if(!vvar_page) return true;
+    
+    vma_t* vma = vma_create(vmas, VDSO_BASE, VDSO_TEXT + PAGE_SIZE, 0, VMA_VDSO);
+    if(!vma) return false;
+    
+    get_page((uint64_t)vvar_page);
+    get_page((uint64_t)text_page);
+    map_page(pml4, VDSO_BASE, (uint64_t)vvar_page, PAGE_PRESENT | PAGE_USER | PAGE_NO_EXECUTE);
+    map_page(pml4, VDSO_TEXT, (uint64_t)text_page, PAGE_PRESENT | PAGE_USER);
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+#include "vma.h"
+
+// Every process gets two read-only pages at VDSO_BASE: the vvar page the
+// kernel publishes clock parameters in, and code that reads the clocks
+// from it without a system call. The code starts with a table of entry
+// point offsets.
+
+#define VDSO_BASE 0x00007FFF00000000ULL // vvar page; the code page follows
+#define VDSO_TEXT (VDSO_BASE + PAGE_SIZE)
+
+// Entry table slots, also in sdk/include/rodmin.h
+#define VDSO_CLOCK_GETTIME 0 // int clock_gettime(int clock, timespec_t* ts)
+#define VDSO_CLOCK_NS      1 // uint64_t clock_ns(int clock), 0 for an unknown clock
+
+// vvar page contents; offsets are repeated in vdso.asm
+typedef struct vdso_data {
+    volatile uint32_t seq;  // Odd while the kernel is rewriting the rest
+    uint32_t reserved;
+    uint64_t tsc_base;      // TSC at monotonic time 0
+    uint64_t mult;          // ns = (tsc - tsc_base) * mult >> CLOCK_SHIFT
+    int64_t realtime_offset; // Realtime ns minus monotonic ns
+} vdso_data_t;
+
+// After memory_init and clock_init
+void vdso_init(void);
+
+// Map both pages into an address space being built
+bool vdso_map(vma_t** vmas, page_table_t* pml4);
+
+#endif
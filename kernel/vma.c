@@ -0,0 +1,251 @@
+#include "vma.h"
+#include "filemap.h"
+#include "shm.h"
+#include "kernel.h"
+#include "smp.h"
+
+vma_t* vma_create(vma_t** list, uint64_t start, uint64_t end, uint64_t flags, uint32_t type) {
+    start &= ~(uint64_t)(PAGE_SIZE - 1);
+    end = (end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if(start >= end) return NULL;
+    
+    // Keep the list sorted and refuse overlaps
+    vma_t** link = list;
+    while(*link && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if(*link && (*link)->start < end) return NULL;
+    
+    vma_t* vma = (vma_t*)kmalloc(sizeof(vma_t));
+    if(!vma) return NULL;
+    
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->type = type;
+    vma->inode_num = 0;
+    vma->file_offset = 0;
+    vma->file_end = start;
+    vma->ra_next = 0;
+    vma->ra_end = 0;
+    vma->ra_window = 0;
+    vma->shm = NULL;
+    vma->next = *link;
+    *link = vma;
+    
+    return vma;
+}
+
+vma_t* vma_find(vma_t* list, uint64_t address) {
+    for(vma_t* vma = list; vma && vma->start <= address; vma = vma->next) {
+        if(address < vma->end) return vma;
+    }
+    return NULL;
+}
+
+// Lowest address at or above base where size bytes fit below limit,
+// aligned to align. Returns 0 if the range is full.
+uint64_t vma_find_free(vma_t* list, uint64_t base, uint64_t limit, uint64_t size, uint64_t align) {
+    uint64_t candidate = (base + align - 1) & ~(align - 1);
+    
+    for(vma_t* vma = list; vma; vma = vma->next) {
+        if(vma->end <= candidate) continue;
+        if(vma->start >= candidate + size) break;
+        candidate = (vma->end + align - 1) & ~(align - 1);
+    }
+    
+    if(candidate + size > limit || candidate + size < candidate) return 0;
+    return candidate;
+}
+
+// Unlink and free one VMA. The caller has already dropped its pages.
+void vma_remove(vma_t** list, vma_t* vma) {
+    for(vma_t** link = list; *link; link = &(*link)->next) {
+        if(*link == vma) {
+            *link = vma->next;
+            if(vma->shm) shm_put(vma->shm);
+            kfree(vma);
+            return;
+        }
+    }
+}
+
+// Cut a VMA in two at a page aligned address inside it. Returns the upper
+// part, linked in right after the lower one.
+vma_t* vma_split(vma_t* vma, uint64_t address) {
+    vma_t* upper = (vma_t*)kmalloc(sizeof(vma_t));
+    if(!upper) return NULL;
+    
+    *upper = *vma;
+    upper->start = address;
+    upper->file_offset += address - vma->start;
+    if(upper->shm) shm_get(upper->shm);
+    
+    vma->end = address;
+    vma->next = upper;
+    
+    return upper;
+}
+
+vma_t* vma_copy_all(vma_t* list) {
+    vma_t* head = NULL;
+    vma_t** tail = &head;
+    
+    for(vma_t* vma = list; vma; vma = vma->next) {
+        vma_t* copy = (vma_t*)kmalloc(sizeof(vma_t));
+        if(!copy) {
+            vma_destroy_all(&head);
+            return NULL;
+        }
+        
+        *copy = *vma;
+        copy->next = NULL;
+        if(copy->shm) shm_get(copy->shm);
+        *tail = copy;
+        tail = &copy->next;
+    }
+    
+    return head;
+}
+
+void vma_destroy_all(vma_t** list) {
+    vma_t* vma = *list;
+    while(vma) {
+        vma_t* next = vma->next;
+        if(vma->shm) shm_put(vma->shm);
+        kfree(vma);
+        vma = next;
+    }
+    *list = NULL;
+}
+
+// Sequential faults read ahead in a window that doubles up to
+// FILEMAP_READAHEAD_MAX, topped up once a fault gets halfway into what was
+// read last. A fault anywhere else starts over.
+static void vma_readahead(vma_t* vma, uint64_t index) {
+    bool sequential = index == vma->ra_next;
+    vma->ra_next = index + 1;
+    
+    if(!sequential) {
+        vma->ra_window = 0;
+        vma->ra_end = index + 1;
+        return;
+    }
+    if(index + vma->ra_window / 2 < vma->ra_end) return;
+    
+    uint64_t start = vma->ra_end > index + 1 ? vma->ra_end : index + 1;
+    vma->ra_window = vma->ra_window ? vma->ra_window * 2 : FILEMAP_READAHEAD_MIN;
+    if(vma->ra_window > FILEMAP_READAHEAD_MAX) vma->ra_window = FILEMAP_READAHEAD_MAX;
+    
+    filemap_readahead(vma->inode_num, start, vma->ra_window);
+    vma->ra_end = start + vma->ra_window;
+}
+
+// Fault in a page of a file mapping. Pages holding only file data are
+// mapped straight from the page cache, read-only and COW if the mapping is
+// writable. A write fault, or the page where file data gives way to BSS,
+// gets a private copy instead.
+static bool vma_fault_file(vma_t* vma, page_table_t* pml4, uint64_t page_addr, bool write) {
+    uint64_t index = (vma->file_offset + (page_addr - vma->start)) / PAGE_SIZE;
+    vma_readahead(vma, index);
+    
+    uint64_t cached = filemap_get_page(vma->inode_num, index);
+    if(!cached) return false;
+    
+    if(!write && page_addr + PAGE_SIZE <= vma->file_end) {
+        uint64_t flags = vma->flags;
+        if(flags & PAGE_WRITABLE) flags = (flags & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+        
+        // The mapping keeps the reference filemap_get_page() took
+        map_page(pml4, page_addr, cached, flags | PAGE_PRESENT | PAGE_USER);
+        return true;
+    }
+    
+    uint8_t* page = (uint8_t*)alloc_page(ALLOC_MOVABLE);
+    if(!page) {
+        put_page(cached);
+        return false;
+    }
+    
+    uint64_t bytes = vma->file_end - page_addr;
+    if(bytes > PAGE_SIZE) bytes = PAGE_SIZE;
+    
+    memory_copy(page, (void*)cached, bytes);
+    memory_set(page + bytes, 0, PAGE_SIZE - bytes);
+    put_page(cached);
+    
+    map_page(pml4, page_addr, (uint64_t)page, vma->flags | PAGE_PRESENT | PAGE_USER);
+    return true;
+}
+
+// A shared file page is the page cache frame itself, so every process
+// mapping it sees the same data. Past the end of the file there is nothing
+// to share.
+static bool vma_fault_shared(vma_t* vma, page_table_t* pml4, uint64_t page_addr) {
+    if(page_addr >= vma->file_end) return false;
+    
+    uint64_t index = (vma->file_offset + (page_addr - vma->start)) / PAGE_SIZE;
+    vma_readahead(vma, index);
+    
+    uint64_t cached = filemap_get_page(vma->inode_num, index);
+    if(!cached) return false;
+    
+    // The mapping keeps the reference filemap_get_page() took
+    map_page(pml4, page_addr, cached, vma->flags | PAGE_PRESENT | PAGE_USER | PAGE_SHARED);
+    return true;
+}
+
+// Back a page that isn't present yet. Returns false if the address isn't
+// covered or the access isn't allowed.
+bool vma_handle_fault(vma_t* list, page_table_t* pml4, uint64_t address, bool write) {
+    vma_t* vma = vma_find(list, address);
+    // Shared memory and the vDSO are mapped in full up front, so a fault
+    // there is an access the mapping doesn't allow
+    if(!vma || vma->type == VMA_GUARD || vma->type == VMA_SHM || vma->type == VMA_VDSO) return false;
+    if(write && !(vma->flags & PAGE_WRITABLE)) return false;
+    
+    uint64_t page_addr = address & ~(uint64_t)(PAGE_SIZE - 1);
+    if(vma->type == VMA_SHARED_FILE) return vma_fault_shared(vma, pml4, page_addr);
+    if(vma->type == VMA_FILE && page_addr < vma->file_end) {
+        return vma_fault_file(vma, pml4, page_addr, write);
+    }
+    
+    void* page = alloc_page(ALLOC_ZERO | ALLOC_MOVABLE);
+    if(!page) return false;
+    
+    map_page(pml4, page_addr, (uint64_t)page, vma->flags | PAGE_PRESENT | PAGE_USER);
+    
+    return true;
+}
+
+// Write the dirty pages of a shared file mapping in [start, end) back to
+// the file. Each dirty bit is cleared before its page is written, so a
+// store that lands meanwhile dirties it again. Returns pages written.
+uint64_t vma_sync(vma_t* vma, page_table_t* pml4, uint64_t start, uint64_t end) {
+    if(vma->type != VMA_SHARED_FILE) return 0;
+    
+    if(start < vma->start) start = vma->start;
+    if(end > vma->end) end = vma->end;
+    
+    uint64_t written = 0;
+    for(uint64_t page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+        uint64_t* pte = get_pte(pml4, page_addr);
+        if(!pte || (*pte & (PAGE_PRESENT | PAGE_DIRTY)) != (PAGE_PRESENT | PAGE_DIRTY)) continue;
+        
+        *pte &= ~(uint64_t)PAGE_DIRTY;
+        smp_flush_tlb_page(page_addr);
+        
+        uint64_t index = (vma->file_offset + (page_addr - vma->start)) / PAGE_SIZE;
+        if(filemap_write_page(vma->inode_num, index, *pte & PAGE_ADDR_MASK) > 0) written++;
+    }
+    
+    if(written) filemap_write_done(vma->inode_num);
+    return written;
+}
+
+// Before an address space goes away, so shared file writes aren't lost
+void vma_sync_all(vma_t* list, page_table_t* pml4) {
+    for(vma_t* vma = list; vma; vma = vma->next) {
+        vma_sync(vma, pml4, vma->start, vma->end);
+    }
+}
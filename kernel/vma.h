@@ -0,0 +1,59 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+// Virtual memory area types
+#define VMA_ANON  0 // Zero-filled on first touch
+#define VMA_STACK 1 // Zero-filled on first touch, guard page below
+#define VMA_GUARD 2 // Never mapped; faults here are stack overflows
+#define VMA_FILE  3 // Private file mapping served from the page cache
+#define VMA_SHM   4 // Shared memory object, mapped in full when created
+#define VMA_SHARED_FILE 5 // Shared file mapping: page cache frames, written back by msync
+#define VMA_VDSO  6 // Kernel clock pages (vdso.h), mapped in full when created
+
+#define USER_SPACE_END 0x0000800000000000ULL // End of the lower canonical half
+
+// A range of user address space, page aligned, sorted by start address.
+// Pages inside it are only backed once touched, shared memory aside.
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags; // PAGE_* bits for the pages mapped in this range
+    uint32_t type;
+    
+    // VMA_FILE: file page backing 'start', and where file data stops.
+    // Pages at or past file_end are zero-filled.
+    uint32_t inode_num;
+    uint64_t file_offset;
+    uint64_t file_end;
+    
+    // File mappings: readahead state for sequential faults
+    uint64_t ra_next;   // Page index a sequential fault would touch next
+    uint64_t ra_end;    // First page index not yet read ahead
+    uint32_t ra_window; // Pages read ahead last time
+    
+    // VMA_SHM: the object; each VMA holds one mapping reference on it
+    struct shm_object* shm;
+    
+    struct vma* next;
+} vma_t;
+
+vma_t* vma_create(vma_t** list, uint64_t start, uint64_t end, uint64_t flags, uint32_t type);
+vma_t* vma_find(vma_t* list, uint64_t address);
+uint64_t vma_find_free(vma_t* list, uint64_t base, uint64_t limit, uint64_t size, uint64_t align);
+void vma_remove(vma_t** list, vma_t* vma);
+vma_t* vma_split(vma_t* vma, uint64_t address);
+vma_t* vma_copy_all(vma_t* list);
+void vma_destroy_all(vma_t** list);
+
+// Page faults
+bool vma_handle_fault(vma_t* list, page_table_t* pml4, uint64_t address, bool write);
+
+// Shared file writeback
+uint64_t vma_sync(vma_t* vma, page_table_t* pml4, uint64_t start, uint64_t end);
+void vma_sync_all(vma_t* list, page_table_t* pml4);
+
+#endif
@@ -93,8 +93,8 @@ int socket(int domain, int type, int protocol) {
     sock->remote_addr = 0;
     
     // Initialize buffers
-    sock->recv_buffer = (uint8_t*)kmalloc(SOCKET_BUFFER_SIZE);
-    sock->send_buffer = (uint8_t*)kmalloc(SOCKET_BUFFER_SIZE);
+    sock->recv_buffer = (uint8_t*)vmalloc(SOCKET_BUFFER_SIZE);
+    sock->send_buffer = (uint8_t*)vmalloc(SOCKET_BUFFER_SIZE);
     sock->recv_head = 0;
     sock->recv_tail = 0;
     sock->send_head = 0;
@@ -249,8 +249,8 @@ int close_socket(int sockfd) {
     }
     
     // Free buffers
-    kfree(sock->recv_buffer);
-    kfree(sock->send_buffer);
+    vfree(sock->recv_buffer);
+    vfree(sock->send_buffer);
     
     // Mark socket as free
     socket_slots[sockfd] = false;
@@ -386,6 +386,6 @@ void add_to_accept_queue(tcp_connection_t* conn);
 void init_network_drivers(void);
 
 // Standard functions
-void memcpy(void* dest, const void* src, size_t n);
+void* memcpy(void* dest, const void* src, size_t n);
 
 #endif
\ No newline at end of file
@@ -32,4 +32,31 @@ void rod_window_blit(rod_window_t win, const uint32_t* buffer);
 void* rod_malloc(size_t size);
 void rod_free(void* ptr);
 
+// Time API, read from the vDSO the kernel maps into every process, so no
+// system call is made. Clock numbers match the kernel's clock.h.
+#define ROD_CLOCK_REALTIME  0 // Wall clock, ns since 1970 UTC
+#define ROD_CLOCK_MONOTONIC 1 // ns since boot
+
+typedef struct {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+} rod_timespec_t;
+
+// Code page of the vDSO, which starts with a table of entry point offsets
+#define ROD_VDSO_TEXT          0x00007FFF00001000ULL
+#define ROD_VDSO_CLOCK_GETTIME 0
+#define ROD_VDSO_CLOCK_NS      1
+
+#define ROD_VDSO_ENTRY(slot) (ROD_VDSO_TEXT + ((const uint64_t*)ROD_VDSO_TEXT)[slot])
+
+// 0 on success, -1 for an unknown clock
+static inline int rod_clock_gettime(int clock, rod_timespec_t* ts) {
+    return ((int (*)(int, rod_timespec_t*))ROD_VDSO_ENTRY(ROD_VDSO_CLOCK_GETTIME))(clock, ts);
+}
+
+// Nanoseconds on the clock, 0 for an unknown clock
+static inline uint64_t rod_clock_ns(int clock) {
+    return ((uint64_t (*)(int))ROD_VDSO_ENTRY(ROD_VDSO_CLOCK_NS))(clock);
+}
+
 #endif